@@ -6,40 +6,61 @@
 #include <tuple>
 #include <unistd.h>
 #include <iostream>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
 
-// for conversion with PAPERO_compress of FOOT PAPERO DAQ raw files to a rootfile with TTrees of raw events
+#include "rawFile.h"
+#include "eventIndex.h"
+#include "corruptionMap.h"
+#include "PAPERO_kernels.h"
+#include "PAPERO_layout.h"
 
-uint64_t seek_first_evt_header(std::fstream &file, uint64_t offset, bool verbose)
-{
-  unsigned int header;
-  bool found = false;
+// for conversion with PAPERO_compress of FOOT PAPERO DAQ raw files to a rootfile with TTrees of raw events
 
-  unsigned char buffer[4];
-  unsigned int val;
+#define sync_scan_chunk (1 << 20) // bytes handed to the sync word scanner at once
 
-  header = 0xcaf14afa;
+// Looks for a sync word starting at offset and moving by 4 bytes, checking at most
+// max_window bytes (0 means up to the end of the file).
+// Returns the offset of the word, -1 if it's not found. skipped is set to the number of bytes jumped over.
+uint64_t scan_sync_word(RawFile &file, uint64_t offset, const unsigned char pattern[4], uint64_t max_window, uint64_t &skipped)
+{
+  uint64_t position = offset;
+  skipped = 0;
 
-  while (!found && !file.eof())
+  while (max_window == 0 || position - offset < max_window)
   {
-    file.seekg(offset);
-    file.read(reinterpret_cast<char *>(&buffer), 4);
-    val = buffer[3] | buffer[2] << 8 | buffer[1] << 16 | buffer[0] << 24;
+    uint64_t len = sync_scan_chunk;
+    if (max_window != 0 && max_window - (position - offset) < len)
+    {
+      len = max_window - (position - offset);
+    }
 
-    if (val == header)
+    uint64_t nwords = file.Available(position, len) / 4;
+    if (nwords == 0)
     {
-      found = true;
-      if (verbose)
-      {
-        std::cout << "Found header at offset " << offset << std::endl;
-      }
+      break;
     }
-    else
+
+    uint64_t index = find_sync_word(file.GetData(position, nwords * 4), nwords, pattern);
+    if (index < nwords)
     {
-      offset += 4;
+      skipped = position + 4 * index - offset;
+      return position + 4 * index;
     }
+    position += 4 * nwords;
   }
 
-  if (!found)
+  skipped = position - offset;
+  return -1;
+}
+
+uint64_t seek_first_evt_header(RawFile &file, uint64_t offset, bool verbose, uint64_t max_window = 0)
+{
+  uint64_t skipped = 0;
+  uint64_t found = scan_sync_word(file, offset, evt_header_bytes, max_window, skipped);
+
+  if (found == (uint64_t)-1)
   {
     if (verbose)
     {
@@ -49,20 +70,31 @@ uint64_t seek_first_evt_header(std::fstream &file, uint64_t offset, bool verbose
   }
   else
   {
-    return offset;
+    if (verbose)
+    {
+      std::cout << "Found header at offset " << found << std::endl;
+    }
+    return found;
   }
 }
 
-bool read_evt_header(std::fstream &file, uint64_t offset, bool verbose)
+bool read_evt_header(RawFile &file, uint64_t offset, bool verbose)
 {
   unsigned int header;
-  unsigned char buffer[4];
+  const unsigned char *buffer;
   unsigned int val;
 
   header = 0xcaf14afa;
 
-  file.seekg(offset);
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer = file.GetData(offset, 4);
+  if (!buffer)
+  {
+    if (verbose)
+    {
+      std::cout << "Reached EOF" << std::endl;
+    }
+    return false;
+  }
   val = buffer[3] | buffer[2] << 8 | buffer[1] << 16 | buffer[0] << 24;
 
   if (val == header)
@@ -83,16 +115,23 @@ bool read_evt_header(std::fstream &file, uint64_t offset, bool verbose)
   }
 }
 
-bool read_de10_footer(std::fstream &file, uint64_t offset, bool verbose)
+bool read_de10_footer(RawFile &file, uint64_t offset, bool verbose)
 {
   unsigned int footer;
-  unsigned char buffer[4];
+  const unsigned char *buffer;
   unsigned int val;
 
   footer = 0xcefaed0b;
 
-  file.seekg(offset);
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer = file.GetData(offset, 4);
+  if (!buffer)
+  {
+    if (verbose)
+    {
+      std::cout << "Can't find DE10 footer" << std::endl;
+    }
+    return false;
+  }
   val = buffer[3] | buffer[2] << 8 | buffer[1] << 16 | buffer[0] << 24;
 
   if (val == footer)
@@ -113,9 +152,10 @@ bool read_de10_footer(std::fstream &file, uint64_t offset, bool verbose)
   }
 }
 
-std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, uint64_t> read_de10_header(std::fstream &file, uint64_t offset, bool verbose)
+// With quiet, a header that is missing or cut short is not reported: following a file, it is still to be written
+std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, uint64_t> read_de10_header(RawFile &file, uint64_t offset, bool verbose, uint64_t max_window = 0, bool quiet = false)
 {
-  unsigned char buffer[4];
+  const unsigned char *buffer;
 
   unsigned long evt_lenght = 0;
   unsigned long fw_version = 0;
@@ -127,45 +167,36 @@ std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, uns
   uint32_t ext_timestamp_part = 0;
   uint64_t ext_timestamp = 0UL;
   unsigned long val = 0;
-  bool found = false;
   uint64_t original_offset = offset;
 
-  unsigned long long header = 0xffffffffbaba1a9a;
-
-  char dummy[100];
-
   if (verbose)
   {
     std::cout << "\t\nStarting from offset " << offset << std::endl;
   }
 
-  file.seekg(offset);
-
-  if (file.peek() != EOF)
+  if (!file.Eof(offset))
   {
-    while (!found && !file.eof())
-    {
-      file.seekg(offset);
-      file.read(reinterpret_cast<char *>(&buffer), 4);
-      val = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
+    uint64_t skipped = 0;
+    uint64_t found_offset = scan_sync_word(file, offset, de10_header_bytes, max_window, skipped);
 
-      if (val == header)
+    if (found_offset == (uint64_t)-1)
+    {
+      if (!quiet)
       {
-        found = true;
-        if (verbose)
+        std::cout << "\n\tCan't find DE10 header";
+        if (max_window)
         {
-          std::cout << "Found DE10 header at offset " << offset << " with delta value of " << offset - original_offset << std::endl;
+          std::cout << " within " << max_window << " bytes";
         }
+        std::cout << ", closing file ..." << std::endl;
       }
-      else
-      {
-        offset += 4;
-      }
+      return std::make_tuple(false, -1, -1, -1, -1, -1, -1, -1, -1);
     }
-    if (!found)
+
+    offset = found_offset;
+    if (verbose)
     {
-      std::cout << "\n\tCan't find DE10 header, closing file ..." << std::endl;
-      return std::make_tuple(false, -1, -1, -1, -1, -1, -1, -1, -1);
+      std::cout << "Found DE10 header at offset " << offset << " with delta value of " << offset - original_offset << std::endl;
     }
   }
   else
@@ -177,32 +208,41 @@ std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, uns
     return std::make_tuple(false, -1, -1, -1, -1, -1, -1, -1, -1);
   }
 
-  // file.seekg(offset + 8);
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  // the header words following the magic one
+  buffer = file.GetData(offset + 4, 32);
+  if (!buffer)
+  {
+    if (!quiet)
+    {
+      std::cout << "\n\tTruncated DE10 header, closing file ..." << std::endl;
+    }
+    return std::make_tuple(false, -1, -1, -1, -1, -1, -1, -1, -1);
+  }
+
   val = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
   evt_lenght = val - 10;
 
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer += 4;
   fw_version = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
 
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer += 4;
   trigger = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
 
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer += 4;
   board_id = buffer[2] | buffer[3] << 8;
   trigger_id = buffer[0] | buffer[1] << 8;
 
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer += 4;
   timestamp_part = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
   timestamp = 0x0000000000000000 | ((uint64_t)timestamp_part << 32UL);
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer += 4;
   timestamp_part = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
   timestamp |= (uint64_t)timestamp_part;
 
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer += 4;
   ext_timestamp_part = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
   ext_timestamp = 0x0000000000000000 | ((uint64_t)ext_timestamp_part << 32UL);
-  file.read(reinterpret_cast<char *>(&buffer), 4);
+  buffer += 4;
   ext_timestamp_part = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
   ext_timestamp |= (uint64_t)ext_timestamp_part;
 
@@ -221,44 +261,566 @@ std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, uns
   return std::make_tuple(true, evt_lenght, fw_version, trigger, board_id, timestamp, ext_timestamp, trigger_id, offset);
 }
 
-std::vector<unsigned int> read_event(std::fstream &file, uint64_t offset, int event_size, bool verbose, bool astra)
+// Decodes the payload of the fragment whose DE10 header is at offset into event, a caller-owned
+// buffer of at least 2 * event_size values. Returns false if the payload is cut by the end of the file
+// (or has a corrupted length).
+bool read_event(RawFile &file, uint64_t offset, int event_size, unsigned int *event, bool verbose, bool astra)
 {
-
-  file.seekg(offset + 36);
   if (verbose)
   {
     std::cout << "\tReading event at position " << offset + 36 << std::endl;
   }
 
-  event_size = event_size * 2;
+  const unsigned char *buffer = event_size > 0 ? file.GetData(offset + 36, (uint64_t)event_size * 4) : nullptr;
+  if (!buffer)
+  {
+    if (verbose)
+    {
+      std::cout << "\tEvent at position " << offset + 36 << " is truncated" << std::endl;
+    }
+    return false;
+  }
+
+  unpack_payload(buffer, event_size, event, astra);
+  return true;
+}
+
+std::vector<unsigned int> read_event(RawFile &file, uint64_t offset, int event_size, bool verbose, bool astra)
+{
+  std::vector<unsigned int> event(event_size > 0 ? 2 * event_size : 0);
+
+  // an event cut by the end of the file is returned empty
+  if (!read_event(file, offset, event_size, event.data(), verbose, astra))
+  {
+    event.clear();
+  }
+
+  return event;
+}
+
+// Decodes the payload of the fragment whose DE10 header is at offset and scatters every sample straight
+// to its final slot: detectors[k] is the buffer (layout.detector_size values) of the k-th detector of the board.
+// Returns false if the payload is truncated or its size doesn't match the layout.
+bool decode_event(RawFile &file, uint64_t offset, int event_size, const board_layout &layout, unsigned int *const *detectors, bool verbose, bool astra)
+{
+  if (verbose)
+  {
+    std::cout << "\tDecoding event at position " << offset + 36 << std::endl;
+  }
+
+  if (2 * event_size != layout.n_samples)
+  {
+    std::cout << "\n\tEvent at position " << offset + 36 << " has " << 2 * event_size << " samples, expected " << layout.n_samples << std::endl;
+    return false;
+  }
+
+  const unsigned char *buffer = file.GetData(offset + 36, (uint64_t)event_size * 4);
+  if (!buffer)
+  {
+    if (verbose)
+    {
+      std::cout << "\tEvent at position " << offset + 36 << " is truncated" << std::endl;
+    }
+    return false;
+  }
+
+  // unpack a small block at a time (it stays in L1) and scatter it
+  const int block_size = 64;
+  unsigned int block[block_size];
+
+  for (int first = 0; first < layout.n_samples; first += block_size)
+  {
+    int n = std::min(block_size, layout.n_samples - first);
+    unpack_payload(buffer + 2 * first, n / 2, block, astra);
+
+    const channel_slot *slot = layout.slot + first;
+    for (int i = 0; i < n; i++)
+    {
+      if (slot[i].detector != dropped_sample)
+      {
+        detectors[slot[i].detector][slot[i].channel] = block[i];
+      }
+    }
+  }
+
+  return true;
+}
+
+// Channel map used to decode a fragment, nullptr if the combination is not supported
+const board_layout *select_layout(unsigned long fw_version, bool gsi, bool dune)
+{
+  if (fw_version == ladderone_fw_version)
+  {
+    if (gsi)
+    {
+      return nullptr;
+    }
+    return dune ? &dampe_dune_layout : &dampe_layout;
+  }
+  return gsi ? &gsi_layout : (dune ? &dune_layout : &foot_layout);
+}
 
-  unsigned char buffer[4];
-  unsigned int val1;
-  unsigned int val2;
+// Header-only walk over the fragments of a file: boards fragments per event, each preceded by its
+// DE10 header and followed by the footer (plus the next event header after the last board).
+// Payloads are not decoded, only checked to be complete.
+class FragmentWalker
+{
+public:
+  FragmentWalker(RawFile &_file, int _boards, uint64_t _sync_window, bool _verbose) : file(_file), boards(_boards), sync_window(_sync_window), verbose(_verbose) {}
 
-  std::vector<unsigned int> event;
+  // look for the first event header from offset on, first_event is the number of the event found there
+  bool Start(uint64_t _offset = 0, int first_event = 0)
+  {
+    offset = seek_first_evt_header(file, _offset, verbose);
+    boards_read = 0;
+    evtnum = first_event;
+    return offset != (uint64_t)-999;
+  }
 
-  for (size_t i = 0; i < event_size; i = i + 2)
+  // reads the next fragment header, false at the end of the file or if the data is corrupted
+  bool Next(de10_fragment &fragment)
   {
-    file.read(reinterpret_cast<char *>(&buffer), 4);
+    if (file.Eof(offset))
+    {
+      return false;
+    }
 
-    if (!astra)
+    if (boards_read == 0)
     {
-      val1 = buffer[0] | buffer[1] << 8;
-      val2 = buffer[2] | buffer[3] << 8;
+      if (!SkipCorrupted())
+      {
+        return false;
+      }
+      if (!read_evt_header(file, offset, verbose)) // check for event header if this is the first board
+      {
+        return false;
+      }
+      event_offset = offset;
+    }
 
-      event.push_back(val1 / 4);
-      event.push_back(val2 / 4);
+    // the first board header comes right after the 4 bytes event header: anything more was skipped to resync
+    uint64_t end;
+    if (!ReadHeader(offset + (boards_read == 0 ? 4 : 0), fragment, end))
+    {
+      return false;
+    }
+    fragment.event_offset = event_offset;
+    fragment.event = evtnum;
+    fragment.board = boards_read;
+
+    // next fragment starts after the footer (plus the event header after the last board)
+    boards_read++;
+    if (boards_read == boards)
+    {
+      boards_read = 0;
+      evtnum++;
+      offset = end + 8;
     }
     else
     {
-      val1 = buffer[0] | (buffer[1] & 0x0f) << 8;
-      val2 = buffer[2] | (buffer[3] & 0x0f) << 8;
+      offset = end + 4;
+    }
+
+    return true;
+  }
+
+  // Reads the next fragment header, whatever board it comes from: unlike Next, the fragments of an event
+  // aren't counted, the event header in front of them is skipped if there is one. Event and board of the
+  // fragment are left to the EventBuilder. With wait, a truncated fragment is not an error and the
+  // walker stays where it was, to read it again once it is complete.
+  bool NextFragment(de10_fragment &fragment, bool wait = false)
+  {
+    if (file.Eof(offset + 4)) // nothing but the word closing the last event
+    {
+      return false;
+    }
 
-      event.push_back(val1);
-      event.push_back(val2);
+    uint64_t start_offset = offset;
+    int start_resyncs = resyncs;
+    uint64_t start_skipped_bytes = skipped_bytes;
+
+    if (!SkipCorrupted())
+    {
+      return false;
+    }
+
+    // the first fragment of an event comes after the word closing the previous event and the event header
+    bool event_header = false;
+    for (uint64_t header_offset : {offset, offset + 4})
+    {
+      if (file.Available(header_offset, 4) == 4 && read_evt_header(file, header_offset, false))
+      {
+        event_header = true;
+        event_offset = header_offset;
+        offset = header_offset + 4;
+        break;
+      }
     }
+
+    uint64_t end;
+    waiting = wait;
+    bool good = ReadHeader(offset, fragment, end);
+    waiting = false;
+    if (!good)
+    {
+      offset = start_offset;
+      resyncs = start_resyncs;
+      skipped_bytes = start_skipped_bytes;
+      return false;
+    }
+    fragment.event_offset = event_header ? event_offset : fragment.offset;
+    offset = end + 4;
+    return true;
   }
 
-  return event;
+  // Reads the headers of all the fragments of the next event. If the event is not complete, because the
+  // file is still being written, nothing is read and the walker stays at the beginning of the event, so
+  // that it can be read again once the rest is there. A broken event header is skipped looking for the next one.
+  bool NextEvent(std::vector<de10_fragment> &fragments)
+  {
+    fragments.resize(boards);
+    uint64_t start_offset = offset;
+    int start_resyncs = resyncs;
+    uint64_t start_skipped_bytes = skipped_bytes;
+
+    if (!SkipCorrupted())
+    {
+      return false;
+    }
+    if (file.Available(offset, 4) == 4 && !read_evt_header(file, offset, verbose))
+    {
+      uint64_t found = seek_first_evt_header(file, offset + 4, verbose, sync_window);
+      if (found == (uint64_t)-999)
+      {
+        return false;
+      }
+      resyncs++;
+      skipped_bytes += found - offset;
+      offset = found;
+    }
+
+    waiting = true;
+    for (int i = 0; i < boards; i++)
+    {
+      if (!Next(fragments[i]))
+      {
+        waiting = false;
+        offset = start_offset;
+        boards_read = 0;
+        resyncs = start_resyncs;
+        skipped_bytes = start_skipped_bytes;
+        return false;
+      }
+    }
+    waiting = false;
+    return true;
+  }
+
+  // Damaged regions are jumped over at once, to the next complete event of the map, instead of
+  // scanning through them for sync words. The map must be up to date with the file.
+  void SetCorruptionMap(const CorruptionMap *_map)
+  {
+    map = _map;
+    good_until = 0;
+  }
+
+  int GetEvents() const { return evtnum; }
+  int GetResyncs() const { return resyncs; }
+  uint64_t GetSkippedBytes() const { return skipped_bytes; }
+  uint64_t GetOffset() const { return offset; }
+
+private:
+  // With a corruption map, moves offset out of a damaged region. False if there are no events after it.
+  bool SkipCorrupted()
+  {
+    if (!map || offset < good_until)
+    {
+      return true;
+    }
+    uint64_t good = map->NextGood(offset, good_until);
+    if (good == (uint64_t)-1)
+    {
+      return false;
+    }
+    if (good != offset)
+    {
+      resyncs++;
+      skipped_bytes += good - offset;
+      offset = good;
+    }
+    return true;
+  }
+
+  // Reads the first DE10 header from offset on, expected at the given position: anything before it was
+  // skipped to resync. Fills all but event and board, end is where payload and padding end.
+  bool ReadHeader(uint64_t expected, de10_fragment &fragment, uint64_t &end)
+  {
+    std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, uint64_t> evt_retValues;
+    evt_retValues = read_de10_header(file, offset, verbose, sync_window, waiting);
+    if (!std::get<0>(evt_retValues))
+    {
+      return false;
+    }
+
+    uint64_t skipped = std::get<8>(evt_retValues) - expected;
+    if (skipped)
+    {
+      resyncs++;
+      skipped_bytes += skipped;
+    }
+
+    fragment.offset = std::get<8>(evt_retValues);
+    fragment.evt_size = std::get<1>(evt_retValues);
+    fragment.fw_version = std::get<2>(evt_retValues);
+    fragment.trigger = std::get<3>(evt_retValues);
+    fragment.board_id = std::get<4>(evt_retValues);
+    fragment.timestamp = std::get<5>(evt_retValues);
+    fragment.ext_timestamp = std::get<6>(evt_retValues);
+    fragment.trigger_id = std::get<7>(evt_retValues);
+
+    uint64_t padding_offset = 0;
+    if (fragment.fw_version == ladderone_fw_version)
+    {
+      padding_offset = ladderone_padding;
+      fragment.board_id = fragment.board_id - 300;
+    }
+
+    uint64_t payload_size = 4 * (uint64_t)fragment.evt_size;
+    if (fragment.evt_size <= 0 || file.Available(fragment.offset + 36, payload_size) < payload_size)
+    {
+      if (!waiting)
+      {
+        std::cout << "\n\tEvent at offset " << fragment.offset << " is truncated, closing file ..." << std::endl;
+      }
+      return false;
+    }
+
+    end = fragment.offset + 36 + payload_size + padding_offset;
+    return true;
+  }
+
+  RawFile &file;
+  int boards;
+  uint64_t sync_window;
+  bool verbose;
+
+  uint64_t offset = 0;
+  uint64_t event_offset = 0;
+  int boards_read = 0;
+  int evtnum = 0;
+  int resyncs = 0;
+  uint64_t skipped_bytes = 0;
+  bool waiting = false; // a truncated event is not an error, the rest is still to be written
+  const CorruptionMap *map = nullptr;
+  uint64_t good_until = 0; // end of the events region of the map offset is in
+};
+
+// Event builder: puts together the fragments read by FragmentWalker::NextFragment matching their trigger_id,
+// instead of counting boards_read. Boards may show up in any order and a missing fragment costs a single
+// event, instead of shifting the boards of all the following ones.
+// Events are kept open in a window of the last window_size trigger_ids read, found through a hash map.
+// Complete events come out in the order of their first fragment, with their fragments sorted by board_id
+// (fragment.board) and numbered from first_event on. An event still incomplete when it falls
+// out of the window, or at the end of the file, is dropped and counted. A board showing up twice in
+// an open event (trigger_id wrapped around, or a repeated fragment) opens a new event.
+class EventBuilder
+{
+public:
+  EventBuilder(FragmentWalker &_walker, int _boards, size_t _window_size, int first_event = 0) : walker(_walker), boards(_boards), window_size(std::max<size_t>(1, _window_size)), evtnum(first_event) {}
+
+  // Fragments of the next complete event. At the end of the data, unless following a file still being
+  // written, the events left open are dropped.
+  bool NextEvent(std::vector<de10_fragment> &fragments, bool follow = false)
+  {
+    bool end_of_data = false;
+    while (true)
+    {
+      // the oldest event goes out once complete, or once it falls out of the window
+      while (!open.empty() && (Complete(open.front()) || open.size() > window_size || end_of_data))
+      {
+        bool complete = Complete(open.front());
+        if (complete)
+        {
+          fragments.swap(open.front().fragments);
+          uint64_t event_offset = fragments[0].event_offset; // of the first fragment read
+          // board k has to be the same board in every event, whatever the order they showed up in
+          std::sort(fragments.begin(), fragments.end(), [](const de10_fragment &a, const de10_fragment &b) { return a.board_id < b.board_id; });
+          for (int board = 0; board < boards; board++)
+          {
+            fragments[board].event = evtnum;
+            fragments[board].board = board;
+            fragments[board].event_offset = event_offset;
+          }
+          evtnum++;
+        }
+        else
+        {
+          incomplete++;
+        }
+        PopFront();
+        if (complete)
+        {
+          return true;
+        }
+      }
+
+      if (end_of_data)
+      {
+        return false;
+      }
+
+      de10_fragment fragment;
+      if (!walker.NextFragment(fragment, follow))
+      {
+        if (follow)
+        {
+          return false;
+        }
+        end_of_data = true;
+        continue;
+      }
+      Add(fragment);
+    }
+  }
+
+  // Drops the events left open, when a followed file is not read any longer
+  void Finish()
+  {
+    while (!open.empty())
+    {
+      incomplete++;
+      PopFront();
+    }
+  }
+
+  int GetEvents() const { return evtnum; }
+  int GetIncomplete() const { return incomplete; }
+  int GetDuplicates() const { return duplicates; }
+
+private:
+  struct open_event
+  {
+    int trigger_id;
+    std::vector<de10_fragment> fragments;
+  };
+
+  bool Complete(const open_event &event) const { return (int)event.fragments.size() == boards; }
+
+  void Add(const de10_fragment &fragment)
+  {
+    auto found = by_trigger_id.find(fragment.trigger_id);
+    if (found != by_trigger_id.end())
+    {
+      open_event &event = open[found->second - first_sequence];
+      bool duplicate = false;
+      for (const de10_fragment &other : event.fragments)
+      {
+        duplicate |= other.board_id == fragment.board_id;
+      }
+      if (!duplicate && !Complete(event))
+      {
+        event.fragments.push_back(fragment);
+        return;
+      }
+      duplicates++;
+    }
+
+    open.push_back({fragment.trigger_id, {}});
+    open.back().fragments.reserve(boards);
+    open.back().fragments.push_back(fragment);
+    by_trigger_id[fragment.trigger_id] = first_sequence + open.size() - 1;
+  }
+
+  void PopFront()
+  {
+    // the trigger_id may point to a newer event already
+    auto found = by_trigger_id.find(open.front().trigger_id);
+    if (found != by_trigger_id.end() && found->second == first_sequence)
+    {
+      by_trigger_id.erase(found);
+    }
+    open.pop_front();
+    first_sequence++;
+  }
+
+  FragmentWalker &walker;
+  int boards;
+  size_t window_size;
+  int evtnum;
+  int incomplete = 0;
+  int duplicates = 0;
+  std::deque<open_event> open;                     // open events, oldest first
+  uint64_t first_sequence = 0;                     // sequence number of the oldest open event
+  std::unordered_map<int, uint64_t> by_trigger_id; // trigger_id -> sequence number of its open event
+};
+
+// Walks the headers of the whole file and saves its event index next to it
+bool build_event_index(const char *raw_filename, RawFile &file, int boards, uint64_t sync_window, bool verbose)
+{
+  EventIndexWriter writer;
+  if (!writer.Create(raw_filename, boards, sync_window))
+  {
+    return false;
+  }
+
+  FragmentWalker walker(file, boards, sync_window, verbose);
+  de10_fragment fragment;
+  if (walker.Start(0))
+  {
+    while (walker.Next(fragment))
+    {
+      writer.Fill(fragment);
+    }
+  }
+  return writer.Write();
+}
+
+// Offset of the header of event number first. The event index is used, and built if it is missing or stale;
+// if that's not possible (e.g. streamed input) the headers are walked up to the event.
+// With a corruption map the damaged regions are skipped, so event numbers may not match the ones of
+// the index: the headers are walked.
+// Returns -999 if the event can't be found.
+uint64_t seek_event(const char *raw_filename, RawFile &file, int boards, uint64_t sync_window, int first, bool verbose, const CorruptionMap *map = nullptr)
+{
+  if (first <= 0)
+  {
+    return seek_first_evt_header(file, 0, verbose);
+  }
+
+  EventIndex index;
+  if (file.IsMapped() && !map && !index.Open(raw_filename, boards, sync_window))
+  {
+    std::cout << "\tBuilding event index " << EventIndex::GetIndexName(raw_filename) << std::endl;
+    if (build_event_index(raw_filename, file, boards, sync_window, verbose))
+    {
+      index.Open(raw_filename, boards, sync_window);
+    }
+  }
+
+  if (index.IsOpen())
+  {
+    if ((uint64_t)first >= index.GetEntries())
+    {
+      std::cout << "\tERROR: the file has only " << index.GetEntries() << " events" << std::endl;
+      return -999;
+    }
+    return index.GetOffset(first);
+  }
+
+  FragmentWalker walker(file, boards, sync_window, verbose);
+  walker.SetCorruptionMap(map);
+  de10_fragment fragment;
+  if (!walker.Start(0))
+  {
+    return -999;
+  }
+  while (walker.GetEvents() < first)
+  {
+    if (!walker.Next(fragment))
+    {
+      std::cout << "\tERROR: the file has only " << walker.GetEvents() << " events" << std::endl;
+      return -999;
+    }
+  }
+  return walker.GetOffset();
 }
@@ -0,0 +1,28 @@
+#ifndef PAPERO_KERNELS_H_
+#define PAPERO_KERNELS_H_
+
+#include <cstdint>
+
+// Low level kernels used to walk PAPERO raw data held in memory.
+// SIMD versions (SSE2/AVX2) are selected at runtime, with a scalar fallback
+// for other CPUs: all versions give the same result.
+
+// magic words as they are laid out in the raw file
+const unsigned char evt_header_bytes[4] = {0xca, 0xf1, 0x4a, 0xfa};  // 0xcaf14afa, big endian
+const unsigned char de10_header_bytes[4] = {0x9a, 0x1a, 0xba, 0xba}; // 0xbaba1a9a, little endian
+const unsigned char de10_footer_bytes[4] = {0xce, 0xfa, 0xed, 0x0b}; // 0xcefaed0b, big endian
+
+const unsigned long ladderone_fw_version = 0xffffffff9fd68b40; // boards with the LADDERONE firmware (padding after the payload)
+const uint64_t ladderone_padding = 1024;                       // bytes of padding after the payload of LADDERONE boards
+
+// Index of the first 4-byte word of data[0 .. 4*nwords) equal to pattern, nwords if there is none
+uint64_t find_sync_word(const unsigned char *data, uint64_t nwords, const unsigned char pattern[4]);
+
+// Unpacks nwords payload words, each holding two 16-bit little endian samples, into 2*nwords ADC values
+// written to out: sample / 4 for the standard ADC boards, sample & 0x0fff for ASTRA (12-bit)
+void unpack_payload(const unsigned char *data, uint64_t nwords, unsigned int *out, bool astra);
+
+// Name of the instruction set picked by the runtime dispatch ("avx2", "sse2" or "scalar")
+const char *kernels_isa();
+
+#endif
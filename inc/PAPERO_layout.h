@@ -0,0 +1,88 @@
+#ifndef PAPERO_LAYOUT_H_
+#define PAPERO_LAYOUT_H_
+
+// Channel maps of the boards read by the PAPERO DAQ.
+// The payload of a DE10 fragment holds the samples of all the ADCs of the board interleaved:
+// sample j is channel j / n_adc of the ADC order[j % n_adc]. The ADCs are then concatenated
+// (adc * adc_channels + channel) and split into the detectors connected to the board.
+// The maps below are generated at compile time and tell, for every payload sample, the detector
+// and channel it ends up in, so that decoding and reordering happen in a single pass.
+
+const unsigned short dropped_sample = 0xffff; // sample not written to any detector
+
+struct channel_slot
+{
+  unsigned short detector; // relative to the first detector of the board
+  unsigned short channel;
+};
+
+template <int N>
+struct channel_map
+{
+  int n_detectors;      // detectors filled by one board
+  int detector_size;    // channels per detector
+  channel_slot slot[N]; // destination of each payload sample
+};
+
+// Samples past n_detectors * detector_size are dropped. With gsi_holes the odd 64-channel blocks
+// are removed before splitting, since GSI hybrids are read by only half of the channels.
+template <int NCH, int NADC>
+constexpr channel_map<NADC * NCH> make_channel_map(const int (&order)[NADC], int n_detectors, int detector_size, bool gsi_holes = false)
+{
+  channel_map<NADC * NCH> map{};
+  map.n_detectors = n_detectors;
+  map.detector_size = detector_size;
+
+  for (int j = 0; j < NADC * NCH; j++)
+  {
+    int position = order[j % NADC] * NCH + j / NADC;
+    bool dropped = false;
+
+    if (gsi_holes)
+    {
+      dropped = (position / 64) % 2;
+      position = (position / 128) * 64 + position % 64;
+    }
+    if (position >= n_detectors * detector_size)
+    {
+      dropped = true;
+    }
+
+    map.slot[j].detector = dropped ? dropped_sample : position / detector_size;
+    map.slot[j].channel = dropped ? dropped_sample : position % detector_size;
+  }
+  return map;
+}
+
+// Runtime handle on one of the maps
+struct board_layout
+{
+  int n_samples;
+  int n_detectors;
+  int detector_size;
+  const channel_slot *slot;
+};
+
+template <int N>
+constexpr board_layout make_layout(const channel_map<N> &map)
+{
+  return board_layout{N, map.n_detectors, map.detector_size, map.slot};
+}
+
+constexpr int foot_adc_order[] = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8};  // 10 ADCs of 128 channels
+constexpr int dune_adc_order[] = {1, 0, 3, 2, 4, 8, 6, 5, 9, 7};  // 10 ADCs of 192 channels
+constexpr int dampe_adc_order[] = {1, 0};                         // 2 ADCs of 192 channels (LADDERONE firmware)
+
+constexpr auto foot_map = make_channel_map<128>(foot_adc_order, 2, 640);       // J5 and J7 detectors
+constexpr auto gsi_map = make_channel_map<128>(foot_adc_order, 1, 640, true);  // GSI hybrids, one detector
+constexpr auto dune_map = make_channel_map<192>(dune_adc_order, 4, 384);       // protoDUNE: 4 DAMPE detectors, last 2 ADCs unused
+constexpr auto dampe_map = make_channel_map<192>(dampe_adc_order, 2, 192);     // LADDERONE
+constexpr auto dampe_dune_map = make_channel_map<192>(dampe_adc_order, 4, 76); // LADDERONE with the protoDUNE splitting
+
+constexpr board_layout foot_layout = make_layout(foot_map);
+constexpr board_layout gsi_layout = make_layout(gsi_map);
+constexpr board_layout dune_layout = make_layout(dune_map);
+constexpr board_layout dampe_layout = make_layout(dampe_map);
+constexpr board_layout dampe_dune_layout = make_layout(dampe_dune_map);
+
+#endif
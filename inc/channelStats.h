@@ -0,0 +1,119 @@
+#ifndef CHANNELSTATS_H_
+#define CHANNELSTATS_H_
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Per-channel statistics for the calibration, kept in a few contiguous arrays for all the channels of a
+// detector instead of a ROOT histogram per channel.
+
+// Running mean and variance of each channel (Welford). Like the histograms they replace, values outside
+// [min, max) are counted as entries but left out of mean and RMS (they would be under/overflows).
+class ChannelMoments
+{
+public:
+  ChannelMoments(int channels = 0, double min = -std::numeric_limits<double>::infinity(), double max = std::numeric_limits<double>::infinity())
+  {
+    Reset(channels, min, max);
+  }
+
+  void Reset(int channels, double min, double max);
+
+  void Fill(int channel, double value)
+  {
+    entries[channel]++;
+    if (!(value >= min && value < max))
+    {
+      return;
+    }
+    uint64_t count = ++n[channel];
+    double delta = value - mean[channel];
+    mean[channel] += delta / count;
+    m2[channel] += delta * (value - mean[channel]);
+  }
+
+  // Adds the values of other, filled with the same range: merging the partial moments of consecutive
+  // blocks of values in their order always gives the same result
+  void Merge(const ChannelMoments &other);
+
+  int GetChannels() const { return entries.size(); }
+  uint64_t GetEntries(int channel) const { return entries[channel]; }
+  double GetMean(int channel) const { return n[channel] ? mean[channel] : 0; }
+  // standard deviation of the values, like TH1::GetRMS
+  double GetRMS(int channel) const;
+
+private:
+  double min;
+  double max;
+  std::vector<uint64_t> entries;
+  std::vector<uint64_t> n; // values in range
+  std::vector<double> mean;
+  std::vector<double> m2; // sum of the squared differences from the mean
+};
+
+// Counts of the values of each channel in bins of fixed width over [min, min + bins * width): a dense table
+// holding the whole distribution, filled with a single increment. ADC samples are small integers, so that
+// with bins of width 1 centered on them (min = -0.5) the distribution is exact. Each channel may have its
+// own min, for tables covering a window around its values instead of the whole ADC range. Values out of
+// range are only counted, and left out of the estimates: GetOutside tells how many there are.
+// Quantiles take the values of a bin as uniformly spread over it.
+class ChannelCounts
+{
+public:
+  ChannelCounts(int channels = 0, double min = 0, double width = 1, int bins = 0) { Reset(channels, min, width, bins); }
+  ChannelCounts(const std::vector<double> &mins, double width, int bins) { Reset(mins, width, bins); }
+
+  void Reset(int channels, double min, double width, int bins) { Reset(std::vector<double>(channels, min), width, bins); }
+  // a table starting from mins[channel] for each channel
+  void Reset(const std::vector<double> &mins, double width, int bins);
+
+  void Fill(int channel, double value)
+  {
+    double bin = std::floor((value - mins[channel]) / width);
+    if (bin >= 0 && bin < bins)
+    {
+      counts[(size_t)channel * bins + (int)bin]++;
+    }
+    else
+    {
+      outside[channel]++;
+    }
+  }
+
+  // Adds the counts of other, made with the same binning and mins: the order doesn't matter
+  void Add(const ChannelCounts &other);
+
+  int GetChannels() const { return channels; }
+  uint64_t GetEntries(int channel) const;
+  // values out of range, left out of the table
+  uint64_t GetOutside(int channel) const { return outside[channel]; }
+
+  // value with a fraction q of the values of the channel below it
+  double GetQuantile(int channel, double q) const;
+  double GetMedian(int channel) const { return GetQuantile(channel, 0.5); }
+  // median of the absolute differences from the median, 1.4826 * MAD is the sigma of a gaussian
+  double GetMAD(int channel) const;
+  // Mean and standard deviation of the values within k standard deviations from the mean, iterated
+  // starting from median and MAD until they don't change
+  void GetClipped(int channel, double k, double &mean, double &sigma) const;
+  // Mean and sigma of the gaussian core of the distribution, in closed form: parabola through the logarithm of
+  // the counts within 3 sigmas, iterated starting from the mode. Median and 1.4826 * MAD if there is no peak.
+  void GetGaussianCore(int channel, double &mean, double &sigma) const;
+
+private:
+  // counts of the values below each bin edge of the channel
+  void Cumulative(int channel, std::vector<uint64_t> &below) const;
+  // values of the channel below x, given its cumulative counts
+  double Below(int channel, const std::vector<uint64_t> &below, double x) const;
+
+  int channels = 0;
+  int bins = 0;
+  std::vector<double> mins; // of the table of each channel
+  double width = 1;
+  std::vector<uint32_t> counts; // channel by channel
+  std::vector<uint64_t> outside;
+};
+
+#endif
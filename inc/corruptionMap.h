@@ -0,0 +1,86 @@
+#ifndef CORRUPTIONMAP_H_
+#define CORRUPTIONMAP_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "rawFile.h"
+
+// Corruption map of a PAPERO raw file, saved next to it as a binary sidecar (<raw file>.map).
+// The whole file is walked once by its structure (event header, boards fragments each made of
+// DE10 header, payload, padding and footer, then the word closing the event) and split into regions:
+//   events:  complete events, their padding and footers included
+//   padding: LADDERONE padding (fw_version 0xffffffff9fd68b40) of fragments of broken events
+//   footer:  DE10 footers of fragments of broken events
+//   garbage: anything else, i.e. broken fragments and the bytes in between that don't belong to an event
+// A converter asks for the next events region instead of scanning for sync words through a damaged
+// region, and doesn't stop at the first event it can't read.
+// Like the event index, the map remembers size and modification time of the raw file and the
+// number of boards it was made for: it is considered stale if any of them changed.
+
+enum raw_region_type : uint32_t
+{
+  region_events = 0,
+  region_padding = 1,
+  region_footer = 2,
+  region_garbage = 3
+};
+
+const char *region_name(raw_region_type type);
+
+struct raw_region
+{
+  uint64_t begin; // offsets in the raw file, end excluded
+  uint64_t end;
+  raw_region_type type;
+  uint32_t events; // complete events in an events region
+};
+
+class CorruptionMap
+{
+public:
+  static std::string GetMapName(const std::string &raw_filename) { return raw_filename + ".map"; }
+
+  // Walks the whole file
+  void Scan(RawFile &file, int boards);
+
+  bool Write(const std::string &raw_filename) const;
+  // false if the map is missing, stale or made for another number of boards
+  bool Read(const std::string &raw_filename, int boards);
+
+  const std::vector<raw_region> &GetRegions() const { return regions; }
+
+  // Offset of the events region holding offset, or the beginning of the next one if offset is in a
+  // damaged region: -1 if there are no events after it. until is set to the end of that events region.
+  // Offsets past the end of the scanned file are returned as they are.
+  uint64_t NextGood(uint64_t offset, uint64_t &until) const;
+
+  uint64_t GetEvents() const { return good_events; }
+  uint64_t GetBrokenEvents() const { return broken_events; }
+  // bytes of each type, the padding and footers of complete events included
+  uint64_t GetBytes(raw_region_type type) const { return bytes[type]; }
+  // runs of regions that are not events after the first event, where a converter has to resync
+  uint64_t GetDamagedRegions() const;
+  // footer words found with something else, in events that are complete otherwise
+  uint64_t GetMissingFooters() const { return missing_footers; }
+
+  // Summary and the largest damaged regions
+  void Print(std::ostream &out, size_t largest = 10) const;
+
+private:
+  void Clear();
+  // content is what the bytes are, type the region they end up in
+  void Add(uint64_t begin, uint64_t end, raw_region_type type, raw_region_type content, uint32_t events = 0);
+
+  int boards = 0;
+  uint64_t size = 0;
+  std::vector<raw_region> regions;
+  uint64_t good_events = 0;
+  uint64_t broken_events = 0;
+  uint64_t missing_footers = 0;
+  uint64_t bytes[4] = {0, 0, 0, 0};
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef EVENTINDEX_H_
+#define EVENTINDEX_H_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "rawFile.h"
+
+// Event index of a PAPERO raw file, saved next to it as a binary sidecar (<raw file>.idx).
+// For every complete event it holds the offset of the event header, the trigger number and id
+// and the board ids and timestamps, in fixed-size records: jumping to event N of the raw file
+// is a lookup in the memory-mapped index instead of a scan from the start of the file.
+// The index remembers size and modification time of the raw file, and the number of boards and
+// the sync window used to walk it: it is considered stale if any of them changed.
+
+// A DE10 board fragment: header content and position in the raw file
+struct de10_fragment
+{
+  uint64_t offset;       // of the DE10 header
+  uint64_t event_offset; // of the event header the fragment belongs to
+  int evt_size;          // payload lenght in 32-bit words
+  unsigned long fw_version;
+  int board_id; // already fixed for the LADDERONE firmware
+  int trigger;
+  int trigger_id;
+  uint64_t timestamp;
+  uint64_t ext_timestamp;
+  int event; // event number
+  int board; // position of the fragment in the event (0 .. boards-1)
+};
+
+struct board_record
+{
+  int board_id;
+  uint64_t timestamp;
+  uint64_t ext_timestamp;
+};
+
+struct event_record
+{
+  uint64_t offset; // of the event header
+  int trigger;     // trigger number and id, as read by the first board
+  int trigger_id;
+  std::vector<board_record> boards;
+};
+
+// size and modification time of a file, to tell if an index of it is stale
+bool raw_file_stamp(const std::string &raw_filename, uint64_t &size, int64_t &mtime_s, int64_t &mtime_ns);
+
+class EventIndex
+{
+public:
+  static std::string GetIndexName(const std::string &raw_filename) { return raw_filename + ".idx"; }
+
+  // Maps the index of raw_filename, false if it is missing, stale or made with other settings
+  bool Open(const std::string &raw_filename, int boards, uint64_t sync_window);
+  void Close() { file.Close(); }
+  bool IsOpen() const { return file.IsOpen(); }
+
+  uint64_t GetEntries() const { return entries; }
+  int GetBoards() const { return boards; }
+
+  // offset of the event header of event n, -1 if it is out of range
+  uint64_t GetOffset(uint64_t n);
+  bool GetEvent(uint64_t n, event_record &record);
+
+private:
+  RawFile file;
+  int boards = 0;
+  uint64_t entries = 0;
+};
+
+// Writes the index while the raw file is walked: fragments are handed over in file order and an
+// event is recorded once all its boards are there. The index is written to a temporary file and
+// moved in place by Write(), so that readers never see a partial index.
+class EventIndexWriter
+{
+public:
+  ~EventIndexWriter();
+
+  bool Create(const std::string &raw_filename, int boards, uint64_t sync_window);
+  void Fill(const de10_fragment &fragment);
+  bool Write();
+  // drops the index, e.g. if the file wasn't walked until its end
+  void Discard();
+
+  uint64_t GetEntries() const { return entries; }
+
+private:
+  std::ofstream out;
+  std::string index_filename;
+  std::string tmp_filename;
+  std::vector<unsigned char> header;
+  std::vector<unsigned char> record;
+  int boards = 0;
+  uint64_t entries = 0;
+};
+
+#endif
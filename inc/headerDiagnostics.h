@@ -0,0 +1,47 @@
+#ifndef HEADERDIAGNOSTICS_H_
+#define HEADERDIAGNOSTICS_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "eventIndex.h"
+
+// Timing diagnostics of a PAPERO run out of the DE10 headers alone, the ones written by PAPERO_info:
+// trigger number and id, timestamp and ext_timestamp of each board, the time between consecutive
+// events and the delta of each board with respect to the first one.
+// Header fields are kept in columns, one set per board, preallocated for the events expected: graphs
+// and histograms are made once, by Write(), instead of growing them event by event.
+class HeaderDiagnostics
+{
+public:
+  HeaderDiagnostics(int boards, uint64_t expected_events = 0);
+
+  // Preallocates the columns for this many events
+  void Reserve(uint64_t expected_events);
+
+  // Fragments are handed over in event order, fragment.board being the position of the board in the event
+  void Fill(const de10_fragment &fragment);
+
+  uint64_t GetEvents() const { return columns.empty() ? 0 : columns[0].event.size(); }
+
+  // Writes graphs and histograms to the current directory
+  void Write() const;
+
+  // Events of a raw file, estimated from the size of its first fragment: boards fragments per event
+  static uint64_t EstimateEvents(uint64_t bytes, int boards, const de10_fragment &first);
+
+private:
+  struct board_columns
+  {
+    std::vector<int> event;
+    std::vector<int> trigger;
+    std::vector<int> trigger_id;
+    std::vector<uint64_t> timestamp;
+    std::vector<uint64_t> ext_timestamp;
+  };
+
+  int boards;
+  std::vector<board_columns> columns;
+};
+
+#endif
@@ -1,25 +1,26 @@
 #include "TMath.h"
 #include "TROOT.h"
-#include <fstream>
+#include <cstring>
 #include <iterator>
 #include <vector>
 #include <unistd.h>
 #include <iostream>
 
+#include "rawFile.h"
+
 #define verbose false
 
-int seek_endianess(std::fstream &file)
+int seek_endianess(RawFile &file)
 {
   bool found = false;
   bool little_endianess; //Expecting little endian file
-  unsigned char buffer[2];
+  const unsigned char *buffer;
   unsigned short val;
+  int offset = 0; //Start of the binary file
 
-  file.seekg(0); //Start of the binary file
-
-  while (!found && !file.eof())
+  while (!found && (buffer = file.GetData(offset, 2)))
   {
-    file.read(reinterpret_cast<char *>(&buffer), 2);
+    offset += 2;
     val = buffer[0] | (buffer[1] << 8);
 
     if (val == 0xbbaa)
@@ -53,13 +54,13 @@ int seek_endianess(std::fstream &file)
   }
 }
 
-int seek_header(std::fstream &file, bool little_endian)
+int seek_header(RawFile &file, bool little_endian)
 {
   int offset = 0;
   unsigned short header;
   bool found = false;
 
-  unsigned char buffer[2];
+  const unsigned char *buffer;
   unsigned short val;
 
   if (little_endian)
@@ -71,10 +72,8 @@ int seek_header(std::fstream &file, bool little_endian)
     header = 0x90eb;
   }
 
-  while (!found && !file.eof())
+  while (!found && (buffer = file.GetData(offset, 2)))
   {
-    file.seekg(offset);
-    file.read(reinterpret_cast<char *>(&buffer), 2);
     val = buffer[0] | (buffer[1] << 8);
 
     if (val == header)
@@ -98,15 +97,17 @@ int seek_header(std::fstream &file, bool little_endian)
   }
 }
 
-int seek_raw(std::fstream &file, int offset, bool little_endian)
+int seek_raw(RawFile &file, int offset, bool little_endian)
 {
   bool found = false;
   bool is_raw = 0;
-  unsigned char buffer[2];
+  const unsigned char *buffer = file.GetData(offset + 2, 2);
   unsigned short val;
 
-  file.seekg(offset + 2);
-  file.read(reinterpret_cast<char *>(&buffer), 2);
+  if (!buffer)
+  {
+    return is_raw;
+  }
 
   if (little_endian)
   {
@@ -126,18 +127,17 @@ int seek_raw(std::fstream &file, int offset, bool little_endian)
   return is_raw;
 }
 
-int seek_version(std::fstream &file)
+int seek_version(RawFile &file)
 {
   bool found = false;
   int version;
-  unsigned char buffer[2];
+  const unsigned char *buffer;
   unsigned short val;
+  int offset = 0;
 
-  file.seekg(0);
-
-  while (!found && !file.eof())
+  while (!found && (buffer = file.GetData(offset, 2)))
   {
-    file.read(reinterpret_cast<char *>(&buffer), 2);
+    offset += 2;
     val = buffer[0] | (buffer[1] << 8);
 
     if (val == 0x1212 || val == 0x1313)
@@ -158,7 +158,7 @@ int seek_version(std::fstream &file)
   }
 }
 
-std::vector<unsigned short> read_event(std::fstream &file, int offset,
+std::vector<unsigned short> read_event(RawFile &file, int offset,
                                        int version, int evt)
 {
   int bitsize = -999;
@@ -172,7 +172,7 @@ std::vector<unsigned short> read_event(std::fstream &file, int offset,
     bitsize = 2048;
   }
 
-  file.seekg(offset + 4 + evt * bitsize);
+  uint64_t position = offset + 4 + (uint64_t)evt * bitsize;
 
   int event_size;
 
@@ -189,10 +189,13 @@ std::vector<unsigned short> read_event(std::fstream &file, int offset,
     std::cout << "Error: unknown miniTRB version" << std::endl;
   }
 
-  std::vector<unsigned short> buffer(event_size);
-  file.read(reinterpret_cast<char *>(buffer.data()), buffer.size() * 2);
-  std::streamsize s = file.gcount();
-  buffer.resize(s / 2);
+  //The last event can be cut by the end of the file
+  uint64_t s = file.Available(position, event_size * 2);
+  std::vector<unsigned short> buffer(s / 2);
+  if (!buffer.empty())
+  {
+    memcpy(buffer.data(), file.GetData(position, buffer.size() * 2), buffer.size() * 2);
+  }
 
   std::vector<unsigned short> event(s / 2);
 
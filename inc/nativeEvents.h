@@ -0,0 +1,116 @@
+#ifndef NATIVEEVENTS_H_
+#define NATIVEEVENTS_H_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "rawFile.h"
+
+// Native format of converted runs (PAPERO_convert --native), read without ROOT by memory-mapping the file.
+// Every event is a fixed-size record: the header read by the first board and the ADC values of all the
+// detectors as 16-bit integers, so event N is at data_offset + N * record_size and reading it is a copy.
+//
+// Layout, native (little endian) byte order:
+//   file header (64 bytes): magic, version, detectors, entries, record size, chunk entries, chunk index offset, data offset
+//   channels of each detector (4 bytes each), padded to 8 bytes
+//   records: event (4), trigger (4), trigger_id (4), reserved (4), timestamp (8), ext_timestamp (8),
+//            then the samples of each detector (2 bytes each), padded to 8 bytes
+//   chunk index (optional): one entry every chunk_entries records with the event number of the first one
+//            and the timestamp ranges of the chunk, 40 bytes each
+// Entries and chunk index are written when the file is closed: files that weren't closed (the converter was
+// killed, or it is still following a raw file) have no index and their entries are told from the file size.
+// A file without events has no detectors either, as they are set with the first event.
+
+#define native_events_extension ".pev"
+
+struct native_event_header
+{
+  int32_t event = -1;
+  uint32_t trigger = 0;
+  uint32_t trigger_id = 0;
+  uint64_t timestamp = 0;
+  uint64_t ext_timestamp = 0;
+};
+
+// Events [first_entry, first_entry + chunk entries) of the file
+struct native_chunk
+{
+  uint64_t first_entry;
+  int64_t first_event;
+  uint64_t min_timestamp;
+  uint64_t max_timestamp;
+  uint64_t min_ext_timestamp;
+  uint64_t max_ext_timestamp;
+};
+
+class NativeEventWriter
+{
+public:
+  ~NativeEventWriter() { Close(); }
+
+  bool Create(const std::string &filename, uint32_t chunk_entries = 4096);
+
+  // Channels of each detector, to be set before the first event
+  void SetDetectors(const std::vector<uint32_t> &channels);
+  bool HasDetectors() const { return !channels.empty(); }
+
+  // samples[det] holds the channels of detector det
+  void Fill(const native_event_header &header, const uint16_t *const *samples);
+
+  // Writes what was filled so far, so that the file can be read while it is written
+  void Flush() { out.flush(); }
+
+  // Writes chunk index and entries, false if something went wrong while writing
+  bool Close();
+
+  uint64_t GetEntries() const { return entries; }
+  uint64_t GetBytesWritten() const { return bytes_written; }
+
+private:
+  void WriteHeader(uint64_t index_offset);
+
+  std::ofstream out;
+  std::vector<uint32_t> channels;
+  std::vector<unsigned char> record;
+  uint64_t record_size = 0;
+  uint64_t data_offset = 0;
+  uint64_t entries = 0;
+  uint64_t bytes_written = 0;
+  uint32_t chunk_entries = 0;
+  std::vector<native_chunk> chunks;
+};
+
+class NativeEventFile
+{
+public:
+  // true if the file starts with the magic number of the native format
+  static bool IsNative(const char *filename);
+
+  bool Open(const char *filename);
+  void Close() { file.Close(); }
+  bool IsOpen() const { return file.IsOpen(); }
+
+  uint64_t GetEntries() const { return entries; }
+  int GetDetectors() const { return channels.size(); }
+  int GetChannels(int detector) const { return channels.at(detector); }
+
+  // nullptr if entry is out of range. The pointer is valid until the next call if the file isn't mapped.
+  const uint16_t *GetSamples(uint64_t entry, int detector);
+  bool GetHeader(uint64_t entry, native_event_header &header);
+
+  // empty if the file wasn't closed by the writer
+  const std::vector<native_chunk> &GetChunks() const { return chunks; }
+
+private:
+  RawFile file;
+  std::vector<uint32_t> channels;
+  std::vector<uint64_t> detector_offset; // of the samples of each detector in a record
+  uint64_t record_size = 0;
+  uint64_t data_offset = 0;
+  uint64_t entries = 0;
+  std::vector<native_chunk> chunks;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef RAWEVENTREADER_H_
+#define RAWEVENTREADER_H_
+
+#include "TChain.h"
+#include "TBranch.h"
+#include <string>
+#include <vector>
+
+#include "nativeEvents.h"
+
+class TFile;
+
+// Reads the raw events of converted runs, whatever the layout written by PAPERO_convert:
+//  - one TTree per detector (raw_events, raw_events_B, ...), each with a std::vector<unsigned int> branch
+//  - a single "events" tree (--single_tree), one entry per event with the header fields and
+//    a fixed-size UShort_t array per detector (det0, det1, ...)
+//  - the zero-suppressed single tree (--zero_suppress): per detector only the channels above threshold,
+//    as (det0_n, det0_ch[det0_n], det0_adc[det0_n]); they are expanded back to dense arrays, with the
+//    pedestal saved in the zs_calibration tree for the channels suppressed
+//  - the native format (--native, see nativeEvents.h), memory-mapped and read without ROOT
+// Detectors are numbered in the order of the trees, or of the arrays.
+
+#define single_tree_name "events"
+#define zs_calibration_tree_name "zs_calibration"
+
+// DE10 headers of all the boards, one entry per complete event aligned with the raw events:
+// event/I, boards/I and the board_id, trigger, trigger_id, timestamp and ext_timestamp arrays [boards]
+#define de10_headers_tree_name "de10_headers"
+
+// name of the array holding detector det in the single tree layout
+inline std::string detector_branch_name(int det)
+{
+  return "det" + std::to_string(det);
+}
+
+// event header stored along with the detectors in the single tree layout
+struct raw_event_header
+{
+  Int_t event = -1;
+  UInt_t trigger = 0;
+  UInt_t trigger_id = 0;
+  ULong64_t timestamp = 0;
+  ULong64_t ext_timestamp = 0;
+  Bool_t full = true; // false for zero-suppressed events, unless kept in full
+};
+
+class RawEventReader
+{
+public:
+  RawEventReader() {}
+  ~RawEventReader();
+
+  RawEventReader(const RawEventReader &) = delete;
+  RawEventReader &operator=(const RawEventReader &) = delete;
+
+  // Adds a converted file to the run: the layout and the detectors are taken from the first one
+  bool Add(const char *filename);
+
+  bool IsSingleTree() const { return single_tree; }
+  bool IsNative() const { return native; }
+  bool IsZeroSuppressed() const { return zero_suppressed; }
+  int GetDetectors() const { return detectors; }
+  int GetChannels(int detector) const { return channels.at(detector); }
+
+  // entries of a detector: with one tree per detector they may differ if the last event is incomplete
+  Long64_t GetEntries(int detector = 0);
+
+  // Loads an entry for all the detectors or for a single one, false if it doesn't exist
+  bool GetEntry(Long64_t entry);
+  bool GetEntry(Long64_t entry, int detector);
+
+  // Loads only the header of an entry, false if the file has no event headers
+  bool GetHeaderEntry(Long64_t entry);
+
+  // ADC values of the detector for the last entry loaded
+  const std::vector<unsigned int> &GetData(int detector) const;
+
+  // header of the last entry loaded for all the detectors, from the first board. With one tree per detector
+  // it is filled only if the file has the de10_headers tree.
+  const raw_event_header &GetHeader() const { return header; }
+
+private:
+  bool Init(const char *filename);
+  bool AddNative(const char *filename);
+  bool ReadPedestals(TFile *f, const char *filename);
+  void Expand(int detector, int tree_number);
+  bool LoadHeaders(Long64_t entry);
+  bool LoadNativeHeader(NativeEventFile *native_file, Long64_t local_entry);
+  NativeEventFile *LocateNative(Long64_t entry, Long64_t &local_entry);
+
+  bool single_tree = false;
+  bool native = false;
+  bool zero_suppressed = false;
+  int detectors = 0;
+  std::vector<int> channels;
+
+  // one tree per detector
+  std::vector<TChain *> chains;
+  std::vector<std::vector<unsigned int> *> vectors;
+  TChain *headers = nullptr;
+  std::vector<UInt_t> header_trigger;
+  std::vector<UInt_t> header_trigger_id;
+  std::vector<ULong64_t> header_timestamp;
+  std::vector<ULong64_t> header_ext_timestamp;
+
+  // single tree
+  TChain *events = nullptr;
+  std::vector<std::vector<UShort_t>> arrays;
+  std::vector<TBranch *> branches;
+  std::vector<TBranch *> header_branches; // event, trigger, trigger_id, timestamp, ext_timestamp
+  std::vector<std::vector<unsigned int>> data;
+  raw_event_header header;
+
+  // zero-suppressed single tree
+  std::vector<Int_t> zs_n;
+  std::vector<std::vector<UShort_t>> zs_channel;
+  std::vector<std::vector<Short_t>> zs_adc;
+  std::vector<std::vector<TBranch *>> zs_branches;        // n, channel, adc of each detector
+  std::vector<std::vector<std::vector<int>>> pedestals; // of each file, detector by detector
+
+  // native format, data is shared with the single tree
+  std::vector<NativeEventFile *> native_files;
+  std::vector<Long64_t> native_first; // first entry of each file
+  Long64_t native_entries = 0;
+};
+
+#endif
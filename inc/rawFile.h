@@ -0,0 +1,88 @@
+#ifndef RAWFILE_H_
+#define RAWFILE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Read-only access to a raw DAQ file.
+// Regular files are memory-mapped once and walked by pointer, so reading a word
+// costs a memory access instead of a seekg/read pair. Inputs that can't be mapped
+// (pipes, fifos, process substitution) are read into a sliding window: moving
+// forward is always possible, moving backward only inside the current window
+// (which keeps some history before the last offset read) or if the stream is seekable.
+// Reading is overlapped with decoding in both modes: the kernel is asked to load
+// the mapped pages ahead of the last offset read, and streams are read by a
+// background thread into a ring of chunks that the window takes over.
+
+class RawFile
+{
+public:
+  RawFile() {}
+  ~RawFile() { Close(); }
+
+  RawFile(const RawFile &) = delete;
+  RawFile &operator=(const RawFile &) = delete;
+
+  bool Open(const char *filename);
+  void Close();
+
+  // Picks up data appended to the file after it was opened (e.g. by the DAQ still writing it):
+  // mapped files are mapped again if they grew, streams are read past their previous end.
+  // Pointers returned by GetData before the call are not valid anymore.
+  bool Refresh();
+
+  bool IsOpen() const { return is_open; }
+  bool IsMapped() const { return mapped_data != nullptr; }
+
+  // size of the file in bytes, for streamed input it is the number of bytes read so far
+  uint64_t GetSize() const { return IsMapped() ? size : window_start + window.size(); }
+
+  // true if there isn't a single byte to read at offset
+  bool Eof(uint64_t offset) { return Available(offset, 1) == 0; }
+
+  // number of bytes that can be read starting from offset, at most len
+  uint64_t Available(uint64_t offset, uint64_t len);
+
+  // pointer to len contiguous bytes starting at offset, nullptr if they are not all available.
+  // For streamed input the pointer stays valid only until the next call.
+  const unsigned char *GetData(uint64_t offset, uint64_t len);
+
+private:
+  bool Fill(uint64_t offset, uint64_t len);
+  void Prefetch(uint64_t offset);
+
+  // stream mode: the reader thread is the only one using fd while it runs
+  void StartReader();
+  void StopReader();
+  void ReaderLoop();
+  bool NextChunk();
+
+  bool is_open = false;
+  int fd = -1;
+
+  // mmap mode
+  const unsigned char *mapped_data = nullptr;
+  uint64_t size = 0;
+  std::atomic<uint64_t> prefetched{0}; // pages up to here were already requested, GetData may run on more threads
+
+  // stream mode
+  std::vector<unsigned char> window;
+  uint64_t window_start = 0;
+  bool stream_eof = false;
+
+  std::thread reader;
+  std::mutex reader_mutex;
+  std::condition_variable reader_cv;
+  std::deque<std::vector<unsigned char>> ready; // chunks read ahead, in order
+  std::vector<std::vector<unsigned char>> spare; // chunks to be reused
+  std::vector<unsigned char> chunk;              // last chunk taken over by the window
+  bool reader_eof = false;
+  std::atomic<bool> reader_stop{false};
+};
+
+#endif
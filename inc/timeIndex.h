@@ -0,0 +1,90 @@
+#ifndef TIMEINDEX_H_
+#define TIMEINDEX_H_
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Time index of a converted run: the entries sorted by the DE10 timestamp and ext_timestamp of the first
+// board, to find the entries of a time window or of a spill without reading the run.
+// Each converted file gets a binary sidecar (<converted file>.tidx), written by PAPERO_convert or built from
+// the event headers the first time the file is used. Like the event index of the raw files, it remembers
+// size and modification time of the converted file and it is rebuilt if they changed.
+
+// entries [first, last)
+struct entry_range
+{
+  int64_t first;
+  int64_t last;
+};
+
+enum time_clock
+{
+  board_clock,    // timestamp
+  external_clock, // ext_timestamp
+};
+
+class TimeIndex
+{
+public:
+  static std::string GetIndexName(const std::string &filename) { return filename + ".tidx"; }
+
+  // Adds the timestamps of the next entry
+  void Add(uint64_t timestamp, uint64_t ext_timestamp);
+  void Clear();
+
+  // Sidecar of a single converted file
+  bool Write(const std::string &filename);
+  bool Read(const std::string &filename);
+
+  // Index of a run: files in the order they are added to RawEventReader, their entries following each other.
+  // Missing or stale sidecars are built from the event headers and saved, if possible.
+  bool Load(const std::vector<std::string> &filenames, bool verbose = false);
+
+  uint64_t GetEntries() const { return entries; }
+
+  // entries with time in [t0, t1), in entry order
+  std::vector<entry_range> Find(uint64_t t0, uint64_t t1, time_clock clock = external_clock) const;
+
+  // the spill starting at the first entry with time >= t: it ends at the first gap longer than max_gap
+  std::vector<entry_range> FindSpill(uint64_t t, uint64_t max_gap, time_clock clock = external_clock) const;
+
+private:
+  void Sort();
+
+  uint64_t entries = 0;
+  bool sorted = true;
+  std::vector<std::pair<uint64_t, uint64_t>> by_time[2]; // (time, entry) of each clock, sorted by time
+};
+
+// Parses a "t0:t1" time window
+bool parse_time_window(const std::string &window, uint64_t &t0, uint64_t &t1);
+
+// Sampling step keeping about a fraction (0, 1] of the events, 0 if the fraction is out of range
+int sampling_step(double fraction);
+
+// Iterates over the entries of a list of ranges:
+//   for (int64_t entry = selection.First(); entry >= 0; entry = selection.Next(entry))
+// With a sampling step N only one entry every N is taken, counting across the ranges: the skipped
+// entries are never loaded.
+class EntrySelection
+{
+public:
+  EntrySelection(int64_t entries) : ranges({{0, entries}}) {}
+  EntrySelection(const std::vector<entry_range> &_ranges) : ranges(_ranges) {}
+
+  void SetEvery(int64_t _every) { every = _every > 1 ? _every : 1; }
+  int64_t GetEvery() const { return every; }
+
+  int64_t First() const;
+  int64_t Next(int64_t entry) const; // -1 after the last one
+  int64_t GetEntries() const;        // sampled entries
+
+private:
+  std::vector<entry_range> ranges;
+  int64_t every = 1;
+  mutable size_t current = 0;
+};
+
+#endif
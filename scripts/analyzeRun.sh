@@ -97,6 +97,7 @@ verbose=$(awk -F'"' '/verboseMode/{print $4}' "$settingsFile")
 debug=$(awk -F'"' '/debugMode/{print $4}' "$settingsFile")
 nsigma=$(awk -F'"' '/nSigma/{print $4}' "$settingsFile") # TODO add fallback if not defined
 showPlots=$(awk -F'"' '/showPlots/{print $4}' "$settingsFile") # TODO add fallback if not defined
+settingsPath=$(realpath "$settingsFile") # the apps run from the build directory
 
 # Check if the user has selected a run name or number(s)
 if [ -z "$fileName" ] 
@@ -197,7 +198,7 @@ do
   then
       echo "File ${outputDirectory}/${fileName}.root already exists. Skipping conversion."
   else
-      convert_data="./PAPERO_convert ${filePath} ${outputDirectory}/${fileName}.root --dune"
+      convert_data="./PAPERO_convert ${filePath} ${outputDirectory}/${fileName}.root --dune --settings ${settingsPath}"
       echo "Executing command: "$convert_data
       $convert_data
   fi
@@ -0,0 +1,418 @@
+///////////////////////////////////////
+// Batch processing of PAPERO runs:  //
+// conversion, calibration and       //
+// analysis of many runs at once.    //
+///////////////////////////////////////
+
+// Native replacement of the run loop of scripts/analyzeRun.sh: runs are independent, so each worker of
+// the pool takes the next run and goes through its steps (PAPERO_convert, calibration, dataAnalyzer),
+// each one a process with its output in <output dir>/<run>_<step>.log.
+// A step is skipped if it is up to date: its outputs are there and its log is newer than the raw file
+// (for the conversion) or than the log of the step before. Logs are used instead of the outputs
+// themselves since calibration updates the converted file. A step that fails leaves
+// <run>_<step>.failed.log, its outputs are removed and the rest of the run is skipped.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include "CmdLineParser.h"
+#include "Logger.h"
+
+extern char **environ;
+
+LoggerInit([]{
+  Logger::getUserHeader() << "[" << FILENAME << "]";
+});
+
+struct batch_step
+{
+    std::string name;
+    std::vector<std::string> args;
+    std::vector<std::string> outputs;
+};
+
+struct batch_run
+{
+    std::string name;     // raw file name without extension
+    std::string raw_file;
+    std::vector<batch_step> steps;
+
+    // filled by the worker
+    int done = 0;    // steps run
+    int skipped = 0; // steps up to date
+    std::string failed_step;
+    int exit_code = 0;
+    double seconds = 0;
+};
+
+// modification time in ns, -1 if the file is not there
+static int64_t file_mtime(const std::string &filename)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return -1;
+    return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// Runs a program with stdout and stderr to log_filename, returns its exit code (-1 if it can't be started)
+static int execute(const std::vector<std::string> &args, const std::string &log_filename)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, log_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    std::vector<char *> argv;
+    for (const std::string &arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    int error = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0)
+        return -1;
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Raw files of the runs first..last in directory and its subdirectories: SCD_RUN<5 digits run>_*.dat
+static void find_runs(const std::string &directory, int first, int last, std::vector<std::string> &files)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+        return;
+    while (struct dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = directory + "/" + name;
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            find_runs(path, first, last, files);
+            continue;
+        }
+
+        int run;
+        char separator;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".dat") == 0 && name.compare(0, 7, "SCD_RUN") == 0 &&
+            sscanf(name.c_str() + 7, "%5d%c", &run, &separator) == 2 && separator == '_' && run >= first && run <= last)
+        {
+            files.push_back(path);
+        }
+    }
+    closedir(dir);
+}
+
+// settings are strings, like "nSigma": "20", but plain values are fine too
+static std::string setting(const nlohmann::json &settings, const std::string &key, const std::string &default_value)
+{
+    if (!settings.contains(key))
+        return default_value;
+    const nlohmann::json &value = settings.at(key);
+    return value.is_string() ? value.get<std::string>() : value.dump();
+}
+
+static std::string executable_directory()
+{
+    char path[4096];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n <= 0)
+        return ".";
+    path[n] = '\0';
+    std::string directory = path;
+    return directory.substr(0, directory.find_last_of('/'));
+}
+
+// like mkdir -p: creates the missing parents too, an existing directory is fine
+static bool make_directories(const std::string &directory)
+{
+    for (size_t end = directory.find('/', 1); ; end = directory.find('/', end + 1))
+    {
+        std::string parent = directory.substr(0, end);
+        if (!parent.empty() && mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST)
+            return false;
+        if (end == std::string::npos)
+            break;
+    }
+    struct stat info;
+    if (stat(directory.c_str(), &info) != 0)
+        return false;
+    if (!S_ISDIR(info.st_mode))
+    {
+        errno = ENOTDIR;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    CmdLineParser clp;
+
+    clp.getDescription() << "Converts, calibrates and analyzes many runs in parallel, skipping what is up to date." << std::endl;
+
+    clp.addDummyOption("Main options");
+    clp.addOption("appSettings",  {"-j", "--json-settings"}, "Specify application settings file path.");
+    clp.addOption("firstRun",     {"-f", "--first-run"},     "First run number, looked for in the input directory");
+    clp.addOption("lastRun",      {"-l", "--last-run"},      "Last run number (default: first run)");
+    clp.addOption("fileList",     {"--file-list"},           "Text file with the raw files to process, one per line");
+    clp.addOption("threads",      {"-t", "--threads"},       "Runs processed at the same time (default: number of cores)");
+    clp.addOption("binDir",       {"--bin-dir"},             "Directory of PAPERO_convert, calibration and dataAnalyzer (default: the one of this executable)");
+
+    clp.addDummyOption("Triggers");
+    clp.addTriggerOption("force",       {"--force"},     "Process all the steps, even if up to date");
+    clp.addTriggerOption("noAnalysis",  {"--no-analysis"}, "Only conversion and calibration");
+
+    clp.addDummyOption();
+
+    LogInfo << clp.getDescription().str() << std::endl;
+    LogInfo << "Usage: " << std::endl;
+    LogInfo << clp.getConfigSummary() << std::endl << std::endl;
+
+    clp.parseCmdLine(argc, argv);
+
+    LogThrowIf( clp.isNoOptionTriggered(), "No option was provided." );
+
+    LogInfo << "Provided arguments: " << std::endl;
+    LogInfo << clp.getValueSummary() << std::endl << std::endl;
+
+    ///////////////////////////
+    // Settings, as in analyzeRun.sh
+
+    LogThrowIf( !clp.isOptionTriggered("appSettings"), "Please specify the settings file, using -j <settings_file>." );
+    std::string settings_filename = clp.getOptionVal<std::string>("appSettings");
+    std::ifstream settings_file(settings_filename);
+    LogThrowIf( !settings_file.is_open(), "Can't open the settings file " + settings_filename );
+    nlohmann::json settings;
+    try
+    {
+        settings = nlohmann::json::parse(settings_file);
+    }
+    catch (const nlohmann::json::exception &e)
+    {
+        LogThrow( "Can't parse " + settings_filename + ": " + e.what() );
+    }
+    char settings_path[PATH_MAX];
+    if (realpath(settings_filename.c_str(), settings_path))
+        settings_filename = settings_path;
+
+    std::string input_directory = setting(settings, "inputDirectory", ".");
+    std::string output_directory = setting(settings, "outputDirectory", ".");
+    std::string nsigma = setting(settings, "nSigma", "5");
+    bool verbose = setting(settings, "verboseMode", "false") == "true";
+    bool debug = setting(settings, "debugMode", "false") == "true";
+    LogThrowIf( !make_directories(output_directory), "Can't create the output directory " + output_directory + ": " + strerror(errno) );
+
+    std::string bin_directory = clp.isOptionTriggered("binDir") ? clp.getOptionVal<std::string>("binDir") : executable_directory();
+    bool force = clp.isOptionTriggered("force");
+    bool analysis = !clp.isOptionTriggered("noAnalysis");
+
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    if (clp.isOptionTriggered("threads"))
+        threads = std::max(1, clp.getOptionVal<int>("threads"));
+
+    ///////////////////////////
+    // Runs to process
+
+    std::vector<std::string> raw_files;
+    if (clp.isOptionTriggered("fileList"))
+    {
+        std::ifstream list(clp.getOptionVal<std::string>("fileList"));
+        LogThrowIf( !list.is_open(), "Can't open the file list " + clp.getOptionVal<std::string>("fileList") );
+        std::string line;
+        while (std::getline(list, line))
+        {
+            line.erase(0, line.find_first_not_of(" \t"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (line.empty() || line[0] == '#')
+                continue;
+            // bare names are taken from the input directory
+            raw_files.push_back(line.find('/') == std::string::npos ? input_directory + "/" + line : line);
+        }
+    }
+    if (clp.isOptionTriggered("firstRun"))
+    {
+        int first = clp.getOptionVal<int>("firstRun");
+        int last = clp.isOptionTriggered("lastRun") ? clp.getOptionVal<int>("lastRun") : first;
+        size_t found = raw_files.size();
+        find_runs(input_directory, first, last, raw_files);
+        // by run, wherever they are
+        auto basename = [](const std::string &f) { return f.substr(f.find_last_of('/') + 1); };
+        std::sort(raw_files.begin() + found, raw_files.end(), [&](const std::string &a, const std::string &b) { return basename(a) < basename(b); });
+        for (int run = first; run <= last; run++)
+        {
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "SCD_RUN%05d_", run);
+            if (std::none_of(raw_files.begin() + found, raw_files.end(), [&](const std::string &f) { return f.find(prefix) != std::string::npos; }))
+                LogWarning << "Run " << run << " not found in " << input_directory << std::endl;
+        }
+    }
+    LogThrowIf( raw_files.empty(), "No runs to process: use -f <first_run> [-l <last_run>] or --file-list <file>" );
+
+    std::vector<batch_run> runs;
+    for (const std::string &raw_file : raw_files)
+    {
+        batch_run run;
+        run.raw_file = raw_file;
+        run.name = raw_file.substr(raw_file.find_last_of('/') + 1);
+        run.name = run.name.substr(0, run.name.find_last_of('.'));
+        std::string output = output_directory + "/" + run.name;
+
+        run.steps.push_back({"convert", {bin_directory + "/PAPERO_convert", raw_file, output + ".root", "--dune", "--settings", settings_filename}, {output + ".root"}});
+        run.steps.push_back({"calibration", {bin_directory + "/calibration", output + ".root", "--output", output, "--dune", "--fast"}, {output + ".cal"}});
+        if (analysis)
+        {
+            // no --show-plots: it would wait for the interactive session to be closed
+            batch_step analyze{"analysis", {bin_directory + "/dataAnalyzer", "-r", output + ".root", "-c", output + ".cal", "-o", output_directory, "-s", nsigma}, {}};
+            if (verbose)
+                analyze.args.push_back("-v");
+            if (debug)
+                analyze.args.push_back("-d");
+            run.steps.push_back(analyze);
+        }
+        runs.push_back(run);
+    }
+
+    ///////////////////////////
+    // Worker pool: each worker takes the next run and goes through its steps
+
+    threads = std::min<unsigned int>(threads, runs.size());
+    LogInfo << "Processing " << runs.size() << " run(s) with " << threads << " worker(s)" << std::endl;
+
+    std::atomic<size_t> next_run(0);
+    std::atomic<size_t> finished(0);
+    std::mutex report;
+    auto worker = [&]()
+    {
+        for (size_t i = next_run++; i < runs.size(); i = next_run++)
+        {
+            batch_run &run = runs[i];
+            auto run_start = std::chrono::steady_clock::now();
+            int64_t previous = file_mtime(run.raw_file);
+            if (previous < 0)
+            {
+                run.failed_step = "input";
+                run.exit_code = -1;
+            }
+
+            for (size_t s = 0; s < run.steps.size() && run.failed_step.empty(); s++)
+            {
+                const batch_step &step = run.steps[s];
+                std::string log = output_directory + "/" + run.name + "_" + step.name + ".log";
+
+                int64_t log_mtime = file_mtime(log);
+                bool up_to_date = !force && log_mtime >= previous;
+                for (const std::string &output : step.outputs)
+                    up_to_date &= file_mtime(output) >= 0;
+                if (up_to_date)
+                {
+                    run.skipped++;
+                    previous = log_mtime;
+                    continue;
+                }
+
+                auto step_start = std::chrono::steady_clock::now();
+                {
+                    std::lock_guard<std::mutex> lock(report);
+                    LogInfo << run.name << ": " << step.name << " started" << std::endl;
+                }
+                std::string tmp_log = log + ".tmp";
+                int exit_code = execute(step.args, tmp_log);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - step_start).count();
+
+                if (exit_code != 0)
+                {
+                    // partial outputs would look up to date next time
+                    for (const std::string &output : step.outputs)
+                        remove(output.c_str());
+                    rename(tmp_log.c_str(), (output_directory + "/" + run.name + "_" + step.name + ".failed.log").c_str());
+                    remove(log.c_str());
+                    run.failed_step = step.name;
+                    run.exit_code = exit_code;
+                    break;
+                }
+                rename(tmp_log.c_str(), log.c_str());
+                remove((output_directory + "/" + run.name + "_" + step.name + ".failed.log").c_str());
+                previous = file_mtime(log);
+                run.done++;
+
+                std::lock_guard<std::mutex> lock(report);
+                LogInfo << run.name << ": " << step.name << " done in " << seconds << " s" << std::endl;
+            }
+            run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+
+            std::lock_guard<std::mutex> lock(report);
+            size_t n = ++finished;
+            if (run.failed_step.empty())
+                LogInfo << "[" << n << "/" << runs.size() << "] " << run.name << " done in " << run.seconds << " s" << std::endl;
+            else
+                LogError << "[" << n << "/" << runs.size() << "] " << run.name << " FAILED at " << run.failed_step << " (exit code " << run.exit_code << ")" << std::endl;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (unsigned int t = 1; t < threads; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    ///////////////////////////
+    // Summary
+
+    int failed = 0;
+    LogInfo << "Summary:" << std::endl;
+    for (const batch_run &run : runs)
+    {
+        if (!run.failed_step.empty())
+        {
+            failed++;
+            if (run.failed_step == "input")
+                LogError << "  " << run.name << ": FAILED, can't find " << run.raw_file << std::endl;
+            else
+                LogError << "  " << run.name << ": FAILED at " << run.failed_step << " (exit code " << run.exit_code << "), see " << output_directory << "/" << run.name << "_" << run.failed_step << ".failed.log" << std::endl;
+        }
+        else if (run.done == 0)
+            LogInfo << "  " << run.name << ": up to date" << std::endl;
+        else
+            LogInfo << "  " << run.name << ": " << run.done << " step(s) in " << run.seconds << " s, " << run.skipped << " up to date" << std::endl;
+    }
+    LogInfo << runs.size() - failed << " run(s) processed, " << failed << " failed, in " << seconds << " s" << std::endl;
+
+    return failed ? 1 : 0;
+}
@@ -1,77 +1,634 @@
 #include <iostream>
 #include "TFile.h"
 #include "TTree.h"
+#include "TKey.h"
 #include "TString.h"
 #include "TH1.h"
 #include "TGraph.h"
 #include "anyoption.h"
 #include <ctime>
 #include <tuple>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <nlohmann/json.hpp>
 
 #include "PAPERO.h"
+#include "rawEventReader.h"
+#include "event.h"
+#include "timeIndex.h"
+#include "headerDiagnostics.h"
 
 #define max_detectors 16
-#define ADC_N 10
+#define batch_fragments 4096 // fragments decoded together when running on more threads
+#define follow_poll_ms 200   // how often a file being written is checked for new data
 
-template <typename T>
-void print(std::vector<T> const &v)
+volatile std::sig_atomic_t interrupted = 0;
+
+void stop_following(int)
 {
-    for (auto i : v)
+    interrupted = 1;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Saves the trees filled so far, so that the output file can be read while it is still written
+void flush_trees(std::vector<TTree *> &raw_events_tree, TTree *events_tree, TTree *headers_tree)
+{
+    for (auto tree : raw_events_tree)
     {
-        std::cout << std::hex << i << ' ' << std::endl;
+        if (tree->GetEntries())
+        {
+            tree->AutoSave("SaveSelf;Overwrite");
+        }
+    }
+    if (events_tree)
+    {
+        events_tree->AutoSave("SaveSelf;Overwrite");
+    }
+    if (headers_tree)
+    {
+        headers_tree->AutoSave("SaveSelf;Overwrite");
     }
-    std::cout << '\n';
 }
 
-template <typename T>
-std::vector<T> reorder(std::vector<T> const &v)
+// Compression and buffering of the output file. Defaults are the historical ones (ZLIB, level 3, ROOT
+// baskets and clusters): faster codecs and larger baskets pay off during beam time, ZSTD/LZMA for archival.
+struct output_settings
+{
+    std::string codec = "zlib";
+    int level = 3;
+    int basket_size = 0;       // bytes buffered per branch before compressing, 0 to keep the ROOT default
+    Long64_t cluster_size = 0; // entries per cluster (TTree::SetAutoFlush), 0 to keep the ROOT default
+};
+
+const std::map<std::string, int> codecs = {{"zlib", ROOT::kZLIB}, {"lz4", ROOT::kLZ4}, {"zstd", ROOT::kZSTD}, {"lzma", ROOT::kLZMA}, {"none", 0}};
+
+// Values in the settings files are strings (like "nSigma": "20"), numbers are accepted as well
+std::string json_setting(const nlohmann::json &settings, const char *key)
+{
+    const nlohmann::json &value = settings.at(key);
+    return value.is_string() ? value.get<std::string>() : value.dump();
+}
+
+// Reads the output settings from a JSON settings file (see json/settings_template.json), keys that
+// are missing keep their value
+bool read_output_settings(const char *filename, output_settings &settings)
+{
+    std::ifstream in(filename);
+    if (!in.is_open())
+    {
+        std::cout << "ERROR: can't open settings file " << filename << std::endl;
+        return false;
+    }
+    try
+    {
+        nlohmann::json json = nlohmann::json::parse(in);
+        if (json.contains("compression"))
+            settings.codec = json_setting(json, "compression");
+        if (json.contains("compressionLevel"))
+            settings.level = std::stoi(json_setting(json, "compressionLevel"));
+        if (json.contains("basketSize"))
+            settings.basket_size = std::stoi(json_setting(json, "basketSize"));
+        if (json.contains("clusterSize"))
+            settings.cluster_size = std::stoll(json_setting(json, "clusterSize"));
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "ERROR: can't read settings file " << filename << ": " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void tune_tree(TTree *tree, const output_settings &settings)
+{
+    if (settings.basket_size > 0)
+        tree->SetBasketSize("*", settings.basket_size);
+    if (settings.cluster_size > 0)
+        tree->SetAutoFlush(settings.cluster_size);
+}
+
+// Zero suppression of the single tree: a detector keeps only the channels above pedestal + nsigma * raw sigma
+// of the calibration, as channel number and pedestal-subtracted ADC. One event every keepalive is kept in full,
+// to track the pedestals. Pedestals and thresholds are saved along with the tree, to expand the events back.
+struct zero_suppression
 {
-    std::vector<T> reordered_vec(v.size());
-    int j = 0;
-    constexpr int order[] = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8};
-    for (int ch = 0; ch < 128; ch++)
+    std::vector<calib> calibration; // detector by detector, in the order of the .cal file
+    float nsigma = 5;
+    int keepalive = 1000;
+
+    Bool_t full = true;
+    long long events = 0;
+    std::vector<Int_t> n;
+    std::vector<std::vector<UShort_t>> channel;
+    std::vector<std::vector<Short_t>> adc;
+    std::vector<std::vector<int>> pedestal;  // rounded to ADC counts
+    std::vector<std::vector<int>> threshold; // highest ADC value suppressed
+
+    void Branch(TTree *tree, const std::vector<uint32_t> &channels)
+    {
+        int detectors = channels.size();
+        n.assign(detectors, 0);
+        channel.resize(detectors);
+        adc.resize(detectors);
+        pedestal.resize(detectors);
+        threshold.resize(detectors);
+
+        tree->Branch("full", &full, "full/O");
+        for (int det = 0; det < detectors; det++)
+        {
+            channel[det].resize(channels[det]);
+            adc[det].resize(channels[det]);
+            pedestal[det].assign(channels[det], 0);
+            threshold[det].assign(channels[det], -1);
+            if (det < (int)calibration.size() && calibration[det].ped.size() == channels[det])
+            {
+                for (uint32_t ch = 0; ch < channels[det]; ch++)
+                {
+                    pedestal[det][ch] = std::lround(calibration[det].ped[ch]);
+                    threshold[det][ch] = std::floor(calibration[det].ped[ch] + nsigma * calibration[det].rsig[ch]);
+                }
+            }
+            else
+            {
+                std::cout << "\n\tWARNING: no calibration for detector " << det << ", it is written in full" << std::endl;
+            }
+
+            std::string name = detector_branch_name(det);
+            tree->Branch((name + "_n").c_str(), &n[det], (name + "_n/I").c_str());
+            tree->Branch((name + "_ch").c_str(), channel[det].data(), (name + "_ch[" + name + "_n]/s").c_str());
+            tree->Branch((name + "_adc").c_str(), adc[det].data(), (name + "_adc[" + name + "_n]/S").c_str());
+        }
+
+        TTree *calibration_tree = new TTree(zs_calibration_tree_name, "Pedestals and thresholds of the zero suppression");
+        std::vector<int> *ped = nullptr, *thr = nullptr;
+        calibration_tree->Branch("pedestal", &ped);
+        calibration_tree->Branch("threshold", &thr);
+        for (int det = 0; det < detectors; det++)
+        {
+            ped = &pedestal[det];
+            thr = &threshold[det];
+            calibration_tree->Fill();
+        }
+        calibration_tree->Write();
+        delete calibration_tree;
+    }
+
+    void NextEvent()
+    {
+        full = keepalive > 0 && events % keepalive == 0;
+        events++;
+    }
+
+    void Suppress(int det, const std::vector<UShort_t> &samples)
     {
-        for (int adc : order)
+        int kept = 0;
+        for (size_t ch = 0; ch < samples.size(); ch++)
         {
-            reordered_vec.at(adc * 128 + ch) = v.at(j);
-            j++;
+            if (full || samples[ch] > threshold[det][ch])
+            {
+                channel[det][kept] = ch;
+                adc[det][kept] = samples[ch] - pedestal[det][ch];
+                kept++;
+            }
         }
+        n[det] = kept;
     }
-    return reordered_vec;
+};
+
+// Event-wise output, the single tree layout or the native format: one entry per complete event, with the
+// header read by the first board and a fixed-size UShort_t array per detector. The arrays are created at the
+// first event, for the detectors it holds, numbered in order of position (2 * board_id + detector of the board)
+// like the trees.
+struct event_output
+{
+    TTree *tree = nullptr;
+    NativeEventWriter *native = nullptr;      // writes the native format instead of the tree
+    zero_suppression *suppression = nullptr; // zero-suppressed single tree
+    bool created = false;
+    raw_event_header header;
+    std::vector<std::vector<UShort_t>> arrays = std::vector<std::vector<UShort_t>>(max_detectors); // by position
+    std::vector<int> branch = std::vector<int>(max_detectors, -1);                                   // array of each position
+    std::vector<bool> in_event = std::vector<bool>(max_detectors, false);
+    bool warned = false;
+    output_settings settings;
+
+    void Fill(const de10_fragment &fragment, const board_layout &layout, const unsigned int *samples, int boards)
+    {
+        for (int det = 0; det < layout.n_detectors; det++)
+        {
+            int position = 2 * fragment.board_id + det;
+            arrays[position].assign(samples + det * layout.detector_size, samples + (det + 1) * layout.detector_size);
+            in_event[position] = true;
+        }
+
+        if (fragment.board == 0)
+        {
+            header.event = fragment.event;
+            header.trigger = fragment.trigger;
+            header.trigger_id = fragment.trigger_id;
+            header.timestamp = fragment.timestamp;
+            header.ext_timestamp = fragment.ext_timestamp;
+        }
+
+        if (fragment.board != boards - 1)
+            return;
+
+        if (!created)
+        {
+            std::vector<uint32_t> channels;
+            for (int position = 0; position < max_detectors; position++)
+            {
+                if (in_event[position])
+                {
+                    branch[position] = channels.size();
+                    channels.push_back(arrays[position].size());
+                }
+            }
+
+            if (native)
+            {
+                native->SetDetectors(channels);
+            }
+            else
+            {
+                tree = new TTree(single_tree_name, "PAPERO raw events");
+                tree->Branch("event", &header.event, "event/I");
+                tree->Branch("trigger", &header.trigger, "trigger/i");
+                tree->Branch("trigger_id", &header.trigger_id, "trigger_id/i");
+                tree->Branch("timestamp", &header.timestamp, "timestamp/l");
+                tree->Branch("ext_timestamp", &header.ext_timestamp, "ext_timestamp/l");
+                if (suppression)
+                {
+                    suppression->Branch(tree, channels);
+                }
+                else
+                {
+                    for (int position = 0; position < max_detectors; position++)
+                    {
+                        if (branch[position] >= 0)
+                        {
+                            std::string name = detector_branch_name(branch[position]);
+                            tree->Branch(name.c_str(), arrays[position].data(), (name + "[" + std::to_string(arrays[position].size()) + "]/s").c_str());
+                        }
+                    }
+                }
+                tree->SetAutoSave(0);
+                tune_tree(tree, settings);
+            }
+            created = true;
+        }
+
+        for (int position = 0; position < max_detectors; position++)
+        {
+            if (in_event[position] != (branch[position] >= 0))
+            {
+                // the boards don't match the ones of the first event: missing detectors are left empty
+                if (!warned)
+                {
+                    std::cout << "\n\tWARNING: event " << fragment.event << " doesn't have the detectors of the first event" << std::endl;
+                    warned = true;
+                }
+                std::fill(arrays[position].begin(), arrays[position].end(), 0);
+            }
+            in_event[position] = false;
+        }
+
+        if (native)
+        {
+            const uint16_t *samples[max_detectors];
+            for (int position = 0; position < max_detectors; position++)
+            {
+                if (branch[position] >= 0)
+                    samples[branch[position]] = arrays[position].data();
+            }
+            native_event_header native_header;
+            native_header.event = header.event;
+            native_header.trigger = header.trigger;
+            native_header.trigger_id = header.trigger_id;
+            native_header.timestamp = header.timestamp;
+            native_header.ext_timestamp = header.ext_timestamp;
+            native->Fill(native_header, samples);
+        }
+        else
+        {
+            if (suppression)
+            {
+                suppression->NextEvent();
+                for (int position = 0; position < max_detectors; position++)
+                {
+                    if (branch[position] >= 0)
+                        suppression->Suppress(branch[position], arrays[position]);
+                }
+            }
+            tree->Fill();
+        }
+    }
+};
+
+// DE10 headers of every board, one entry per complete event: entry N is event N of the raw event trees.
+// The timestamps of the first board go to the time index of the output file as well.
+struct header_output
+{
+    TTree *tree = nullptr;
+    TimeIndex index;
+    Int_t event = -1;
+    Int_t boards = 0;
+    std::vector<Int_t> board_id;
+    std::vector<UInt_t> trigger;
+    std::vector<UInt_t> trigger_id;
+    std::vector<ULong64_t> timestamp;
+    std::vector<ULong64_t> ext_timestamp;
+
+    // without tree_output only the time index is filled
+    void Create(int _boards, const output_settings &settings, bool tree_output)
+    {
+        boards = _boards;
+        board_id.assign(boards, -1);
+        trigger.assign(boards, 0);
+        trigger_id.assign(boards, 0);
+        timestamp.assign(boards, 0);
+        ext_timestamp.assign(boards, 0);
+        if (!tree_output)
+            return;
+
+        tree = new TTree(de10_headers_tree_name, "DE10 headers");
+        tree->Branch("event", &event, "event/I");
+        tree->Branch("boards", &boards, "boards/I");
+        tree->Branch("board_id", board_id.data(), "board_id[boards]/I");
+        tree->Branch("trigger", trigger.data(), "trigger[boards]/i");
+        tree->Branch("trigger_id", trigger_id.data(), "trigger_id[boards]/i");
+        tree->Branch("timestamp", timestamp.data(), "timestamp[boards]/l");
+        tree->Branch("ext_timestamp", ext_timestamp.data(), "ext_timestamp[boards]/l");
+        tree->SetAutoSave(0);
+        tune_tree(tree, settings);
+    }
+
+    void Fill(const de10_fragment &fragment)
+    {
+        if (fragment.board >= boards)
+            return;
+
+        event = fragment.event;
+        board_id[fragment.board] = fragment.board_id;
+        trigger[fragment.board] = fragment.trigger;
+        trigger_id[fragment.board] = fragment.trigger_id;
+        timestamp[fragment.board] = fragment.timestamp;
+        ext_timestamp[fragment.board] = fragment.ext_timestamp;
+        if (fragment.board == boards - 1)
+        {
+            if (tree)
+                tree->Fill();
+            index.Add(timestamp[0], ext_timestamp[0]);
+        }
+    }
+};
+
+// Fragments walked from the raw file, along with their decoded samples
+struct fragment_batch
+{
+    std::vector<de10_fragment> fragments;
+    std::vector<const board_layout *> layouts;
+    std::vector<size_t> data_offset; // where the samples of each fragment start in data
+    std::vector<unsigned int> data;  // samples, detector by detector
+
+    void clear()
+    {
+        fragments.clear();
+        layouts.clear();
+        data_offset.clear();
+    }
+};
+
+enum walk_status
+{
+    walk_more,        // the batch is full
+    walk_end_of_data, // nothing else to read, for now
+    walk_stop         // requested events read, or data that can't be converted
+};
+
+// Walks the headers of up to max_fragments fragments. When following a file that is still being written
+// only complete events are taken. With an event builder, fragments come in complete events matched by
+// trigger_id. Walked fragments are added to the event index, if any: it is dropped if the walk stops
+// before the end of the file.
+// With a sampling step only one event every that many, from first_event on, goes to the batch: the others
+// are jumped over by their header (evt_lenght) and never decoded.
+walk_status walk_batch(FragmentWalker &walker, EventBuilder *builder, fragment_batch &batch, size_t max_fragments, int last_event, bool gsi, bool dune, bool follow, EventIndexWriter *index, int first_event = 0, int every = 1)
+{
+    size_t data_size = 0;
+    std::vector<de10_fragment> fragments(1);
+    while (batch.fragments.size() < max_fragments)
+    {
+        int events = builder ? builder->GetEvents() : walker.GetEvents();
+        if (last_event >= 0 && events == last_event) // stop reading after the number of events specified
+        {
+            if (index)
+                index->Discard();
+            return walk_stop;
+        }
+
+        bool walked;
+        if (builder)
+            walked = builder->NextEvent(fragments, follow);
+        else
+            walked = follow ? walker.NextEvent(fragments) : walker.Next(fragments[0]);
+        if (!walked)
+            return walk_end_of_data;
+
+        for (const de10_fragment &fragment : fragments)
+        {
+            if (index)
+                index->Fill(fragment);
+
+            // pick the channel map of the board
+            const board_layout *layout = select_layout(fragment.fw_version, gsi, dune);
+            if (!layout)
+            {
+                if (index)
+                    index->Discard();
+                std::cout << "\n\tERROR: GSI hybrids can't be read with LADDERONE firmware, closing file ..." << std::endl;
+                return walk_stop;
+            }
+            if (2 * fragment.evt_size != layout->n_samples)
+            {
+                if (index)
+                    index->Discard();
+                std::cout << "\n\tCan't decode event at offset " << fragment.offset << ", closing file ..." << std::endl;
+                return walk_stop;
+            }
+            if (2 * fragment.board_id + layout->n_detectors > max_detectors)
+            {
+                if (index)
+                    index->Discard();
+                std::cout << "\n\tERROR: board ID " << fragment.board_id << " out of range, closing file ..." << std::endl;
+                return walk_stop;
+            }
+
+            if ((fragment.event - first_event) % every != 0)
+                continue;
+
+            batch.fragments.push_back(fragment);
+            batch.layouts.push_back(layout);
+            batch.data_offset.push_back(data_size);
+            data_size += layout->n_detectors * layout->detector_size;
+        }
+    }
+    return walk_more;
 }
 
-template <typename T>
-std::vector<T> reorder_DUNE(std::vector<T> const &v)
+// Offset of event first of a file still being written, which may not be there yet: the file is walked event by
+// event as it grows, from where the previous poll stopped. No event index is built, it would be stale right away.
+uint64_t follow_to_event(RawFile &file, int boards, uint64_t sync_window, int first, double timeout)
 {
-    std::vector<T> reordered_vec(v.size());
-    int j = 0;
-    constexpr int order[] = {1, 0, 3, 2, 4, 8, 6, 5, 9, 7};
-    for (int ch = 0; ch < 192; ch++)
+    FragmentWalker walker(file, boards, sync_window, false);
+    std::vector<de10_fragment> fragments;
+    bool started = false;
+    auto last_news = std::chrono::steady_clock::now();
+    while (true)
     {
-        for (int adc : order)
+        started = started || walker.Start(0);
+        while (started && walker.GetEvents() < first && walker.NextEvent(fragments))
+        {
+            last_news = std::chrono::steady_clock::now();
+        }
+        if (started && walker.GetEvents() >= first)
+        {
+            return walker.GetOffset();
+        }
+        if (interrupted || seconds_since(last_news) >= timeout)
         {
-            reordered_vec.at(adc * 192 + ch) = v.at(j);
-            j++;
+            return -999;
         }
+        // the DAQ didn't write the event yet
+        std::this_thread::sleep_for(std::chrono::milliseconds(follow_poll_ms));
+        file.Refresh();
     }
-    return reordered_vec;
 }
 
-template <typename T>
-std::vector<T> reorder_DAMPE(std::vector<T> const &v)
+// Decodes the payloads of a batch. Fragments are shared among the threads, each one writing its own slice of data.
+// Returns the seconds spent decoding.
+double decode_batch(RawFile &file, fragment_batch &batch, int threads)
 {
-    std::vector<T> reordered_vec(v.size());
-    int j = 0;
-    constexpr int order[] = {1, 0};
-    for (int ch = 0; ch < 192; ch++)
+    size_t nfragments = batch.fragments.size();
+    if (nfragments == 0)
+        return 0;
+    auto start = std::chrono::steady_clock::now();
+    batch.data.resize(batch.data_offset.back() + batch.layouts.back()->n_detectors * batch.layouts.back()->detector_size);
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
     {
-        for (int adc : order)
+        for (size_t i = next++; i < nfragments; i = next++)
         {
-            reordered_vec.at(adc * 192 + ch) = v.at(j);
-            j++;
+            const de10_fragment &fragment = batch.fragments[i];
+            const board_layout &layout = *batch.layouts[i];
+            unsigned int *detector_data[max_detectors];
+            for (int det = 0; det < layout.n_detectors; det++)
+            {
+                detector_data[det] = batch.data.data() + batch.data_offset[i] + det * layout.detector_size;
+            }
+            // the walk already checked sizes and payload: this can't fail
+            decode_event(file, fragment.offset, fragment.evt_size, layout, detector_data, false, false);
         }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : pool)
+    {
+        t.join();
+    }
+    return seconds_since(start);
+}
+
+// Bytes of raw payload in a batch
+uint64_t payload_bytes(const fragment_batch &batch)
+{
+    uint64_t bytes = 0;
+    for (const de10_fragment &fragment : batch.fragments)
+    {
+        bytes += 4 * (uint64_t)fragment.evt_size;
     }
-    return reordered_vec;
+    return bytes;
+}
+
+// Fills the TTree(s) with the decoded fragments, in file order
+void write_batch(const fragment_batch &batch, std::vector<TTree *> &raw_events_tree, std::vector<std::vector<unsigned int>> &raw_event_vector, event_output *events, header_output *headers, HeaderDiagnostics *diagnostics, int boards, int &evtnum, bool verbose)
+{
+    for (size_t i = 0; i < batch.fragments.size(); i++)
+    {
+        const de10_fragment &fragment = batch.fragments[i];
+        const board_layout &layout = *batch.layouts[i];
+
+        std::cout << "\r\tReading event " << fragment.event << std::flush;
+
+        if (verbose)
+        {
+            std::cout << "\tBoard ID " << fragment.board_id << std::endl;
+            std::cout << "\tBoards read " << fragment.board + 1 << " out of " << boards << std::endl;
+            std::cout << "\tTrigger ID " << fragment.trigger_id << std::endl;
+            std::cout << "\tFW version is: " << std::hex << fragment.fw_version << std::dec << std::endl;
+            std::cout << "\tEvt lenght: " << fragment.evt_size << std::endl;
+        }
+
+        if (headers)
+        {
+            headers->Fill(fragment);
+        }
+
+        if (diagnostics)
+        {
+            diagnostics->Fill(fragment);
+        }
+
+        if (events)
+        {
+            events->Fill(fragment, layout, batch.data.data() + batch.data_offset[i], boards);
+        }
+        else
+        {
+            for (int det = 0; det < layout.n_detectors; det++)
+            {
+                const unsigned int *samples = batch.data.data() + batch.data_offset[i] + det * layout.detector_size;
+                raw_event_vector.at(2 * fragment.board_id + det).assign(samples, samples + layout.detector_size);
+                raw_events_tree.at(2 * fragment.board_id + det)->Fill();
+            }
+        }
+
+        if (fragment.board == boards - 1)
+        {
+            evtnum++;
+        }
+        else if (verbose)
+        {
+            std::cout << "WARNING: not all boards were read" << std::endl;
+        }
+    }
+}
+
+template <typename T>
+void print(std::vector<T> const &v)
+{
+    for (auto i : v)
+    {
+        std::cout << std::hex << i << ' ' << std::endl;
+    }
+    std::cout << '\n';
 }
 
 AnyOption *opt; // Handle the option input
@@ -86,20 +643,64 @@ int main(int argc, char *argv[])
     opt->addUsage("  -v, --verbose    ................................. Verbose ");
     opt->addUsage("  --boards         ................................. Number of DE10Nano boards connected ");
     opt->addUsage("  --nevents        ................................. Number of events to be read ");
+    opt->addUsage("  --first          ................................. First event to be read (default: 0), found through the event index");
+    opt->addUsage("  --every          ................................. Quick look: convert only one event every N, from the first one on; --nevents counts all the events read");
+    opt->addUsage("  --sample_fraction ................................ Quick look: convert only about this fraction (0, 1] of the events, like --every");
+    opt->addUsage("  --sync_window    ................................. Max number of bytes to scan when looking for a header (default: up to EOF)");
+    opt->addUsage("  --follow         ................................. Keep converting the events appended to a file still being written (stop with Ctrl-C)");
+    opt->addUsage("  --follow_timeout ................................. Stop following the file after this many seconds without new events (default: 60)");
+    opt->addUsage("  --event_builder  ................................. Build the events matching the trigger_id of the fragments: boards may come in any order or be missing");
+    opt->addUsage("  --builder_window ................................. Events kept open by the event builder waiting for their boards (default: 64)");
+    opt->addUsage("  --skip_corrupted ................................. Skip the damaged regions of the file through its corruption map (see PAPERO_info --scan), scanning it first if needed");
+    opt->addUsage("  --flush          ................................. Seconds between flushes of the output file when following (default: 10)");
+    opt->addUsage("  --threads        ................................. Number of threads decoding the events (default: 1)");
+    opt->addUsage("  --single_tree    ................................. Write a single \"events\" tree with one UShort_t array per detector");
+    opt->addUsage("  --zero_suppress  ................................. Calibration (.cal) file: write a single tree with only the channels above threshold");
+    opt->addUsage("  --zs_sigma       ................................. Zero suppression threshold in raw sigmas above pedestal (default: 5)");
+    opt->addUsage("  --keepalive      ................................. Zero suppression: one event every this many is kept in full, 0 for none (default: 1000)");
+    opt->addUsage("  --native         ................................. Write the native event format (see nativeEvents.h) instead of a ROOT file");
+    opt->addUsage("  --codec          ................................. Compression of the output file: zlib, lz4, zstd, lzma or none (default: zlib)");
+    opt->addUsage("  --level          ................................. Compression level, 1 to 9 (default: 3)");
+    opt->addUsage("  --basket_size    ................................. Bytes buffered per branch before compressing (default: ROOT's)");
+    opt->addUsage("  --cluster_size   ................................. Entries per cluster of the output trees (default: ROOT's)");
+    opt->addUsage("  --settings       ................................. JSON settings file with the output settings (compression, compressionLevel, basketSize, clusterSize)");
+    opt->addUsage("  --info           ................................. ROOT file for the PAPERO_info timing diagnostics, made while converting");
     opt->addUsage("  --gsi            ................................. To convert data from GSI hybrids (10 ADC per detector)");
     opt->addUsage("  --dune           ................................. To convert data from protoDUNE setup (3 DAMPE detectors with adapter)");
     opt->setOption("boards");
     opt->setOption("nevents");
+    opt->setOption("first");
+    opt->setOption("every");
+    opt->setOption("sample_fraction");
+    opt->setOption("sync_window");
+    opt->setOption("threads");
+    opt->setOption("follow_timeout");
+    opt->setOption("builder_window");
+    opt->setOption("flush");
+    opt->setOption("codec");
+    opt->setOption("level");
+    opt->setOption("basket_size");
+    opt->setOption("cluster_size");
+    opt->setOption("settings");
+    opt->setOption("info");
+    opt->setOption("zero_suppress");
+    opt->setOption("zs_sigma");
+    opt->setOption("keepalive");
 
     opt->setFlag("help", 'h');
     opt->setFlag("verbose", 'v');
     opt->setFlag("gsi");
     opt->setFlag("dune");
+    opt->setFlag("follow");
+    opt->setFlag("event_builder");
+    opt->setFlag("skip_corrupted");
+    opt->setFlag("single_tree");
+    opt->setFlag("native");
 
     opt->processFile("./options.txt");
     opt->processCommandArgs(argc, argv);
 
-    TFile *foutput;
+    TFile *foutput = nullptr;
 
     if (!opt->hasOptions())
     { /* print usage if no options */
@@ -113,8 +714,8 @@ int main(int argc, char *argv[])
         verbose = true;
 
     // Open binary data file
-    std::fstream file(opt->getArgv(0), std::ios::in | std::ios::out | std::ios::binary);
-    if (file.fail())
+    RawFile file;
+    if (!file.Open(opt->getArgv(0)))
     {
         std::cout << "ERROR: can't open input file" << std::endl; // file could not be opened
         return 2;
@@ -123,15 +724,89 @@ int main(int argc, char *argv[])
     std::cout << " " << std::endl;
     std::cout << "Processing file " << opt->getArgv(0) << std::endl;
 
-    // Create output ROOT file
+    // Output settings: the command line overrides the settings file
+    output_settings settings;
+    if (opt->getValue("settings") && !read_output_settings(opt->getValue("settings"), settings))
+    {
+        return 2;
+    }
+    if (opt->getValue("codec"))
+    {
+        settings.codec = opt->getValue("codec");
+    }
+    if (opt->getValue("level"))
+    {
+        settings.level = atoi(opt->getValue("level"));
+    }
+    if (opt->getValue("basket_size"))
+    {
+        settings.basket_size = atoi(opt->getValue("basket_size"));
+    }
+    if (opt->getValue("cluster_size"))
+    {
+        settings.cluster_size = atoll(opt->getValue("cluster_size"));
+    }
+
+    std::transform(settings.codec.begin(), settings.codec.end(), settings.codec.begin(), ::tolower);
+    auto codec = codecs.find(settings.codec);
+    if (codec == codecs.end())
+    {
+        std::cout << "ERROR: unknown codec " << settings.codec << ", use zlib, lz4, zstd, lzma or none" << std::endl;
+        return 2;
+    }
+    if (settings.codec == "none")
+    {
+        settings.level = 0;
+    }
+    else if (settings.level < 1 || settings.level > 9)
+    {
+        std::cout << "ERROR: compression level must be between 1 and 9" << std::endl;
+        return 2;
+    }
+
+    bool native = false;
+    if (opt->getFlag("native"))
+    {
+        native = true;
+        if (opt->getFlag("single_tree") || opt->getValue("zero_suppress"))
+        {
+            std::cout << "ERROR: --native can't be used with --single_tree or --zero_suppress" << std::endl;
+            return 2;
+        }
+    }
+
+    // Create output file
     TString output_filename = opt->getArgv(1);
-    foutput = new TFile(output_filename.Data(), "RECREATE", "PAPERO data");
-    foutput->cd();
-    foutput->SetCompressionLevel(3);
-    foutput->SetCompressionAlgorithm(ROOT::kZLIB);
+    NativeEventWriter native_writer;
+    if (native)
+    {
+        if (!native_writer.Create(output_filename.Data()))
+        {
+            std::cout << "ERROR: can't create output file " << output_filename << std::endl;
+            return 2;
+        }
+        std::cout << "\tWriting the native event format" << std::endl;
+    }
+    else
+    {
+        foutput = new TFile(output_filename.Data(), "RECREATE", "PAPERO data");
+        foutput->cd();
+        if (codec->second)
+        {
+            foutput->SetCompressionAlgorithm(codec->second);
+        }
+        foutput->SetCompressionLevel(settings.level);
+        std::cout << "\tCompression: " << settings.codec;
+        if (settings.level)
+            std::cout << ", level " << settings.level;
+        if (settings.basket_size > 0)
+            std::cout << ", baskets of " << settings.basket_size << " bytes";
+        if (settings.cluster_size > 0)
+            std::cout << ", clusters of " << settings.cluster_size << " entries";
+        std::cout << std::endl;
+    }
 
     // Initialize TTree(s)
-    std::vector<unsigned int> raw_event_buffer;
 
     std::string alphabet = "ABCDEFGHIJKLMNOPQRSTWXYZ";
     std::vector<TTree *> raw_events_tree(max_detectors);
@@ -193,32 +868,21 @@ int main(int argc, char *argv[])
                 raw_events_tree.at(detector)->SetAutoSave(0);
             }
         }
+        tune_tree(raw_events_tree.at(detector), settings);
     }
 
-    // Find if there is an offset before first event
-    uint64_t offset = 0;
-    offset = seek_first_evt_header(file, offset, verbose);
-    uint64_t padding_offset = 0;
+    uint64_t sync_window = 0;
+    if (opt->getValue("sync_window"))
+    {
+        sync_window = strtoull(opt->getValue("sync_window"), nullptr, 10);
+    }
 
-    // Read raw events and write to TTree
-    bool is_good = false;
     int evtnum = 0;
     int evt_to_read = -1;
+    int first_event = 0;
     int boards = 0;
     bool gsi = false;
-    unsigned long fw_version = 0;
-    int board_id = -1;
-    int trigger_number = -1;
-    int trigger_id = -1;
-    int evt_size = 0;
-    unsigned long timestamp = 0;
-    unsigned long ext_timestamp = 0;
-    int boards_read = 0;
-    float mean_rate = 0;
-    std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, uint64_t> evt_retValues;
-
-    uint64_t old_offset = 0;
-    char dummy[100];
+    int threads = 1;
 
     if (dune)
     {
@@ -240,134 +904,334 @@ int main(int argc, char *argv[])
         std::cout << "\tFormatting data for GSI hybrids" << std::endl;
     }
 
+    if (gsi && dune)
+    {
+        std::cout << "ERROR: --gsi and --dune can't be used together" << std::endl;
+        return 2;
+    }
+
     if (opt->getValue("nevents"))
     {
         evt_to_read = atoi(opt->getValue("nevents"));
     }
 
-    while (!file.eof())
+    event_output events;
+    events.settings = settings;
+    event_output *events_output = nullptr;
+    zero_suppression suppression;
+    if (opt->getValue("zero_suppress"))
     {
-        is_good = false;
-        if (evt_to_read > 0 && evtnum == evt_to_read) // stop reading after the number of events specified
-            break;
+        if (!std::ifstream(opt->getValue("zero_suppress")).good())
+        {
+            std::cout << "ERROR: can't open calibration file " << opt->getValue("zero_suppress") << std::endl;
+            return 2;
+        }
+        suppression.calibration = read_calib_all(opt->getValue("zero_suppress"), verbose);
+        if (opt->getValue("zs_sigma"))
+        {
+            suppression.nsigma = atof(opt->getValue("zs_sigma"));
+        }
+        if (opt->getValue("keepalive"))
+        {
+            suppression.keepalive = atoi(opt->getValue("keepalive"));
+        }
+        events.suppression = &suppression;
+        events_output = &events;
+        std::cout << "\tWriting a zero-suppressed single tree: channels above " << suppression.nsigma << " raw sigmas, one event every "
+                  << suppression.keepalive << " in full" << std::endl;
+    }
+    else if (opt->getFlag("single_tree"))
+    {
+        events_output = &events;
+        std::cout << "\tWriting a single tree for all the detectors" << std::endl;
+    }
+    else if (native)
+    {
+        events.native = &native_writer;
+        events_output = &events;
+    }
 
-        if (boards_read == 0)
-            if (!read_evt_header(file, offset, verbose)) // check for event header if this is the first board
-                break;
+    // DE10 headers, along with the events: the native format has the ones of the first board already
+    header_output headers;
+    headers.Create(boards, settings, !native);
 
-        evt_retValues = read_de10_header(file, offset, verbose); // read de10 header
-        is_good = std::get<0>(evt_retValues);
+    bool follow = false;
+    double follow_timeout = 60;
+    double flush_interval = 10;
+    if (opt->getFlag("follow"))
+    {
+        follow = true;
+        std::cout << "\tFollowing the file while it is written" << std::endl;
+        std::signal(SIGINT, stop_following);
+    }
+    if (opt->getValue("follow_timeout"))
+    {
+        follow_timeout = atof(opt->getValue("follow_timeout"));
+    }
 
-        if (is_good)
+    bool event_builder = opt->getFlag("event_builder");
+    size_t builder_window = 64;
+    if (opt->getValue("builder_window"))
+    {
+        builder_window = std::max(1, atoi(opt->getValue("builder_window")));
+    }
+
+    // PAPERO_info diagnostics out of the headers walked for the conversion
+    HeaderDiagnostics diagnostics(boards);
+    HeaderDiagnostics *info_output = opt->getValue("info") ? &diagnostics : nullptr;
+
+    if (event_builder)
+    {
+        std::cout << "\tBuilding the events by trigger_id, waiting up to " << builder_window << " events for missing boards" << std::endl;
+    }
+    if (opt->getValue("flush"))
+    {
+        flush_interval = atof(opt->getValue("flush"));
+    }
+
+    if (opt->getValue("first"))
+    {
+        first_event = std::max(0, atoi(opt->getValue("first")));
+    }
+
+    // Quick look: events that are not sampled are walked, not decoded
+    int every = 1;
+    if (opt->getValue("every"))
+    {
+        every = std::max(1, atoi(opt->getValue("every")));
+    }
+    else if (opt->getValue("sample_fraction"))
+    {
+        every = sampling_step(atof(opt->getValue("sample_fraction")));
+        if (every == 0)
         {
-            boards_read++;
-            evt_size = std::get<1>(evt_retValues);
-            fw_version = std::get<2>(evt_retValues);
-            trigger_number = std::get<3>(evt_retValues);
-            board_id = std::get<4>(evt_retValues);
-            timestamp = std::get<5>(evt_retValues);
-            ext_timestamp = std::get<6>(evt_retValues);
-            trigger_id = std::get<7>(evt_retValues);
-            offset = std::get<8>(evt_retValues);
+            std::cout << "ERROR: the sample fraction must be in (0, 1]" << std::endl;
+            return 2;
+        }
+    }
+    if (every > 1)
+    {
+        std::cout << "\tQuick look: converting one event every " << every << std::endl;
+    }
 
-            std::cout << "\r\tReading event " << evtnum << std::flush;
+    if (opt->getValue("threads"))
+    {
+        threads = std::max(1, atoi(opt->getValue("threads")));
+    }
+
+    if (threads > 1 && !file.IsMapped())
+    {
+        std::cout << "\tWARNING: input can't be memory-mapped, converting with a single thread" << std::endl;
+        threads = 1;
+    }
+    else if (threads > 1)
+    {
+        std::cout << "\tDecoding with " << threads << " threads" << std::endl;
+    }
 
-            if (verbose)
+    // Damaged regions are jumped over through the corruption map, which needs the whole file
+    CorruptionMap corruption_map;
+    CorruptionMap *skip_map = nullptr;
+    if (opt->getFlag("skip_corrupted") && (follow || !file.IsMapped()))
+    {
+        std::cout << "\tWARNING: the corruption map needs a complete regular file, damaged regions will be scanned through" << std::endl;
+    }
+    else if (opt->getFlag("skip_corrupted"))
+    {
+        if (!corruption_map.Read(opt->getArgv(0), boards))
+        {
+            std::cout << "\tScanning the file for damaged regions" << std::endl;
+            corruption_map.Scan(file, boards);
+            if (corruption_map.Write(opt->getArgv(0)))
             {
-                std::cout << "\tBoard ID " << board_id << std::endl;
-                std::cout << "\tBoards read " << boards_read << " out of " << boards << std::endl;
-                std::cout << "\tTrigger ID " << trigger_id << std::endl;
-                std::cout << "\tFW version is: " << std::hex << fw_version << std::dec << std::endl;
-                std::cout << "\tEvt lenght: " << evt_size << std::endl;
+                std::cout << "\tCorruption map saved to " << CorruptionMap::GetMapName(opt->getArgv(0)) << std::endl;
             }
+        }
+        corruption_map.Print(std::cout, 0);
+        if (corruption_map.GetDamagedRegions() > 0)
+        {
+            skip_map = &corruption_map;
+        }
+    }
+
+    // Find if there is an offset before first event, or jump to the first event requested
+    uint64_t offset;
+    if (follow)
+    {
+        offset = follow_to_event(file, boards, sync_window, first_event, follow_timeout);
+    }
+    else
+    {
+        offset = seek_event(opt->getArgv(0), file, boards, sync_window, first_event, verbose, skip_map);
+    }
+    auto last_news = std::chrono::steady_clock::now(); // last time new events showed up
+    auto last_flush = last_news;
+    if (offset == (uint64_t)-999)
+    {
+        std::cout << "ERROR: can't find event " << first_event << std::endl;
+        return 2;
+    }
+    FragmentWalker walker(file, boards, sync_window, verbose);
+    walker.SetCorruptionMap(skip_map);
+    walker.Start(offset, first_event);
+    EventBuilder builder(walker, boards, builder_window, first_event);
+    int last_event = evt_to_read > 0 ? first_event + evt_to_read : -1;
+
+    // Save the event index while walking the file, unless there is an up to date one
+    // (a file still being written would make it stale right away). The event builder drops
+    // incomplete events, and so does skipping damaged regions: their event numbers don't match the ones of the index.
+    EventIndexWriter index_writer;
+    EventIndexWriter *index = nullptr;
+    EventIndex old_index;
+    if (first_event == 0 && !follow && !event_builder && !skip_map && file.IsMapped() && !old_index.Open(opt->getArgv(0), boards, sync_window) &&
+        index_writer.Create(opt->getArgv(0), boards, sync_window))
+    {
+        index = &index_writer;
+    }
+    old_index.Close();
+
+    // Raw events are converted in batches: the fragment headers of a batch are walked first (header-only),
+    // then the payloads are decoded, on worker threads if requested, and finally written to the TTree(s)
+    // in file order. While a batch is decoded the previous one is written and the next one walked.
+    // With a single thread batches hold a single fragment, so that streamed input never has to go back.
+    size_t batch_size = threads > 1 ? batch_fragments : 1;
+    fragment_batch walked, decoding, decoded;
+    uint64_t decoded_bytes = 0;
+    double decode_seconds = 0; // decoding and writing overlap when running on more threads
+    double write_seconds = 0;
+    auto write_start = std::chrono::steady_clock::now();
+    walk_status status = walk_batch(walker, event_builder ? &builder : nullptr, walked, batch_size, last_event, gsi, dune, follow, index, first_event, every);
+    if (info_output && !walked.fragments.empty())
+    {
+        uint64_t expected_events = HeaderDiagnostics::EstimateEvents(file.GetSize() - offset, boards, walked.fragments[0]);
+        expected_events = (last_event >= 0 ? std::min<uint64_t>(expected_events, evt_to_read) : expected_events) / every + 1;
+        diagnostics.Reserve(expected_events);
+    }
 
-            if (fw_version == 0xffffffff9fd68b40)
+    while (true)
+    {
+        while (!walked.fragments.empty())
+        {
+            std::swap(walked, decoding);
+
+            std::future<double> decoder;
+            if (threads > 1)
             {
-                // std::cout << "\tLADDERONE!!!" << std::endl;
-                padding_offset = 1024;
-                board_id = board_id - 300;
-                // std::cout << "\tFixed Board ID " << board_id << std::endl;
-                raw_event_buffer.clear();
-                raw_event_buffer = reorder_DAMPE(read_event(file, offset, evt_size, verbose, false));
+                decoder = std::async(std::launch::async, decode_batch, std::ref(file), std::ref(decoding), threads);
             }
             else
             {
-                padding_offset = 0;
-                raw_event_buffer.clear();
-                if (!dune)
-                {
-                    raw_event_buffer = reorder(read_event(file, offset, evt_size, verbose, false));
-                }
-                else
-                {
-                    raw_event_buffer = reorder_DUNE(read_event(file, offset, evt_size, verbose, false));
-                }
+                decode_seconds += decode_batch(file, decoding, 1);
             }
 
-            if (!gsi && !dune)
-            {
-                raw_event_vector.at(2 * board_id).clear();
-                raw_event_vector.at(2 * board_id + 1).clear();
-                raw_event_vector.at(2 * board_id) = std::vector<unsigned int>(raw_event_buffer.begin(), raw_event_buffer.begin() + raw_event_buffer.size() / 2);
-                raw_event_vector.at(2 * board_id + 1) = std::vector<unsigned int>(raw_event_buffer.begin() + raw_event_buffer.size() / 2, raw_event_buffer.end());
-                raw_events_tree.at(2 * board_id)->Fill();
-                raw_events_tree.at(2 * board_id + 1)->Fill();
-            }
-            else if (gsi)
+            write_start = std::chrono::steady_clock::now();
+            write_batch(decoded, raw_events_tree, raw_event_vector, events_output, &headers, info_output, boards, evtnum, verbose);
+            write_seconds += seconds_since(write_start);
+
+            walked.clear();
+            if (status == walk_more)
             {
-                for (int hole = 1; hole <= 10; hole++)
-                {
-                    raw_event_buffer.erase(raw_event_buffer.begin() + hole * 64, raw_event_buffer.begin() + (hole + 1) * 64);
-                }
-                raw_event_vector.at(2 * board_id).clear();
-                raw_event_vector.at(2 * board_id) = raw_event_buffer;
-                raw_events_tree.at(2 * board_id)->Fill();
-            }
-            else if (dune)
-            {   
-
-                raw_event_vector.at(2 * board_id).clear();
-                raw_event_vector.at(2 * board_id + 1).clear();
-                raw_event_vector.at(2 * board_id + 2).clear();
-                raw_event_vector.at(2 * board_id + 3).clear();
-
-                uint adc_length = raw_event_buffer.size() / ADC_N;
-                
-                raw_event_vector.at(2 * board_id) = std::vector<unsigned int>(raw_event_buffer.begin(), raw_event_buffer.begin() + 2 * adc_length);
-                raw_event_vector.at(2 * board_id + 1) = std::vector<unsigned int>(raw_event_buffer.begin() + 2 * adc_length, raw_event_buffer.begin() + 4 * adc_length);
-                raw_event_vector.at(2 * board_id + 2) = std::vector<unsigned int>(raw_event_buffer.begin() + 4 * adc_length, raw_event_buffer.begin() + 6 * adc_length);
-                raw_event_vector.at(2 * board_id + 3) = std::vector<unsigned int>(raw_event_buffer.begin() + 6 * adc_length, raw_event_buffer.begin() + 8 * adc_length);
-
-                raw_events_tree.at(2 * board_id)->Fill();
-                raw_events_tree.at(2 * board_id + 1)->Fill();
-                raw_events_tree.at(2 * board_id + 2)->Fill();
-                raw_events_tree.at(2 * board_id + 3)->Fill();
+                status = walk_batch(walker, event_builder ? &builder : nullptr, walked, batch_size, last_event, gsi, dune, follow, index, first_event, every);
             }
 
-            if (boards_read == boards)
+            if (decoder.valid())
             {
-                boards_read = 0;
-                evtnum++;
-                offset = (uint64_t)file.tellg() + padding_offset + 8;
+                decode_seconds += decoder.get();
             }
+            decoded_bytes += payload_bytes(decoding);
+            std::swap(decoding, decoded);
+        }
+        write_start = std::chrono::steady_clock::now();
+        write_batch(decoded, raw_events_tree, raw_event_vector, events_output, &headers, info_output, boards, evtnum, verbose);
+        write_seconds += seconds_since(write_start);
+        decoded.clear();
+
+        if (!follow || status == walk_stop || interrupted)
+            break;
+
+        // Following the file: nothing is being decoded now, so it is safe to map the new data.
+        // Converted events are flushed to the output file every flush_interval seconds.
+        if (seconds_since(last_flush) >= flush_interval)
+        {
+            write_start = std::chrono::steady_clock::now();
+            if (native)
+                native_writer.Flush();
             else
+                flush_trees(raw_events_tree, events.tree, headers.tree);
+            write_seconds += seconds_since(write_start);
+            last_flush = std::chrono::steady_clock::now();
+        }
+        if (seconds_since(last_news) >= follow_timeout)
+        {
+            std::cout << "\n\tNo new events for " << follow_timeout << " s, stop following the file" << std::endl;
+            break;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(follow_poll_ms));
+        file.Refresh();
+        status = walk_batch(walker, event_builder ? &builder : nullptr, walked, batch_size, last_event, gsi, dune, follow, index, first_event, every);
+        if (!walked.fragments.empty())
+        {
+            last_news = std::chrono::steady_clock::now();
+        }
+    }
+
+    std::cout << "\n\tClosing file after " << evtnum << " events";
+    if (every > 1)
+        std::cout << ", sampled out of " << (event_builder ? builder.GetEvents() : walker.GetEvents()) - first_event << " read";
+    std::cout << std::endl;
+    if (event_builder)
+    {
+        builder.Finish();
+        std::cout << "\tEvent builder: " << builder.GetIncomplete() << " incomplete events dropped";
+        if (builder.GetDuplicates())
+            std::cout << ", " << builder.GetDuplicates() << " repeated trigger_ids";
+        std::cout << std::endl;
+    }
+    if (walker.GetResyncs())
+    {
+        std::cout << "\tResynchronized " << walker.GetResyncs() << " times, skipping " << walker.GetSkippedBytes() << " bytes" << std::endl;
+    }
+    if (index && index_writer.Write())
+    {
+        std::cout << "\tEvent index saved to " << EventIndex::GetIndexName(opt->getArgv(0)) << std::endl;
+    }
+    int filled = 0;
+    write_start = std::chrono::steady_clock::now();
+
+    if (events.tree)
+    {
+        events.tree->Write("", TObject::kOverwrite);
+    }
+    if (headers.tree)
+    {
+        headers.tree->Write("", TObject::kOverwrite);
+    }
+
+    if (follow)
+    {
+        // trees may be renamed below: drop the copies flushed while following.
+        // Only the keys go, TFile::Delete("name;*") would free the trees in memory too
+        std::vector<TKey *> flushed;
+        TIter next_key(foutput->GetListOfKeys());
+        while (TKey *key = (TKey *)next_key())
+        {
+            for (auto tree : raw_events_tree)
             {
-                offset = (uint64_t)file.tellg() + padding_offset + 4;
-                if (verbose)
+                if (tree->GetEntries() && !strcmp(key->GetName(), tree->GetName()))
                 {
-                    std::cout << "WARNING: not all boards were read" << std::endl;
+                    flushed.push_back(key);
+                    break;
                 }
             }
         }
-        else
+        for (TKey *key : flushed)
         {
-            break;
+            key->Delete(); // frees the space on file and removes the key from the directory
+            delete key;
         }
     }
 
-    std::cout << "\n\tClosing file after " << evtnum << " events" << std::endl;
-    int filled = 0;
-
     for (size_t detector = 0; detector < raw_events_tree.size(); detector++)
     {   
 
@@ -389,8 +1253,64 @@ int main(int argc, char *argv[])
             filled++;
         }
     }
-    
-    foutput->Close();
-    file.close();
+
+    // Throughput report: payload decoded, bytes written to the output file and compression of the trees
+    Long64_t tot_bytes = events.tree ? events.tree->GetTotBytes() : 0;
+    Long64_t zip_bytes = events.tree ? events.tree->GetZipBytes() : 0;
+    for (auto tree : raw_events_tree)
+    {
+        tot_bytes += tree->GetTotBytes();
+        zip_bytes += tree->GetZipBytes();
+    }
+    if (headers.tree)
+    {
+        tot_bytes += headers.tree->GetTotBytes();
+        zip_bytes += headers.tree->GetZipBytes();
+    }
+
+    double written_mb = 0;
+    if (native)
+    {
+        if (!native_writer.Close())
+        {
+            std::cout << "\tERROR: can't write " << output_filename << std::endl;
+        }
+        written_mb = native_writer.GetBytesWritten() / 1e6;
+    }
+    else
+    {
+        foutput->Close();
+        written_mb = foutput->GetBytesWritten() / 1e6;
+    }
+    write_seconds += seconds_since(write_start);
+
+    // after closing the output: the index remembers size and modification time of the file
+    if (headers.index.Write(output_filename.Data()))
+        std::cout << "\tTime index saved to " << TimeIndex::GetIndexName(output_filename.Data()) << std::endl;
+
+    if (info_output)
+    {
+        TFile info_file(opt->getValue("info"), "RECREATE", "PAPERO info");
+        if (info_file.IsZombie())
+        {
+            std::cout << "\tERROR: can't write " << opt->getValue("info") << std::endl;
+        }
+        else
+        {
+            info_file.cd();
+            diagnostics.Write();
+            info_file.Close();
+            std::cout << "\tTiming diagnostics saved to " << opt->getValue("info") << std::endl;
+        }
+    }
+
+    double decoded_mb = decoded_bytes / 1e6;
+    std::cout << "\tDecoded " << decoded_mb << " MB in " << decode_seconds << " s (" << (decode_seconds > 0 ? decoded_mb / decode_seconds : 0) << " MB/s)" << std::endl;
+    std::cout << "\tWritten " << written_mb << " MB in " << write_seconds << " s (" << (write_seconds > 0 ? written_mb / write_seconds : 0) << " MB/s)";
+    if (zip_bytes > 0)
+        std::cout << ", compression ratio " << (double)tot_bytes / zip_bytes;
+    std::cout << std::endl;
+
+    file.Close();
     return 0;
 }
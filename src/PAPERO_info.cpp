@@ -5,10 +5,12 @@
 #include "TH1.h"
 #include "TGraph.h"
 #include "anyoption.h"
+#include <chrono>
 #include <ctime>
 #include <tuple>
 
 #include "PAPERO.h"
+#include "headerDiagnostics.h"
 
 AnyOption *opt; // Handle the option input
 
@@ -16,17 +18,28 @@ int main(int argc, char *argv[])
 {
     opt = new AnyOption();
     opt->addUsage("Usage: ./PAPERO_info [options] raw_data_file output_rootfile");
+    opt->addUsage("       ./PAPERO_info --scan --boards N raw_data_file");
     opt->addUsage("");
     opt->addUsage("Options: ");
     opt->addUsage("  -h, --help       ................................. Print this help ");
     opt->addUsage("  -v, --verbose    ................................. Verbose ");
     opt->addUsage("  --boards         ................................. Number of DE10Nano boards connected ");
     opt->addUsage("  --nevents        ................................. Number of events to be read ");
+    opt->addUsage("  --first          ................................. First event to be read (default: 0), found through the event index");
+    opt->addUsage("  --sync_window    ................................. Max number of bytes to scan when looking for a header (default: up to EOF)");
+    opt->addUsage("  --event_builder  ................................. Build the events matching the trigger_id of the fragments: boards may come in any order or be missing");
+    opt->addUsage("  --builder_window ................................. Events kept open by the event builder waiting for their boards (default: 64)");
+    opt->addUsage("  --scan           ................................. Check the integrity of the whole file and save its corruption map (raw_data_file.map), used by PAPERO_convert --skip_corrupted");
     opt->setOption("boards");
     opt->setOption("nevents");
+    opt->setOption("first");
+    opt->setOption("sync_window");
+    opt->setOption("builder_window");
 
     opt->setFlag("help", 'h');
     opt->setFlag("verbose", 'v');
+    opt->setFlag("event_builder");
+    opt->setFlag("scan");
 
     opt->processFile("./options.txt");
     opt->processCommandArgs(argc, argv);
@@ -47,8 +60,8 @@ int main(int argc, char *argv[])
         cout << "@@@@@@@@ VERBOSE MODE @@@@@@@@" << endl;
     }
     // Open binary data file
-    std::fstream file(opt->getArgv(0), std::ios::in | std::ios::out | std::ios::binary);
-    if (file.fail())
+    RawFile file;
+    if (!file.Open(opt->getArgv(0)))
     {
         std::cout << "ERROR: can't open input file" << std::endl; // file could not be opened
         return 2;
@@ -57,38 +70,19 @@ int main(int argc, char *argv[])
     std::cout << " " << std::endl;
     std::cout << "Processing file " << opt->getArgv(0) << std::endl;
 
-    // Create output ROOT file
-    TString output_filename = opt->getArgv(1);
-    foutput = new TFile(output_filename.Data(), "RECREATE", "PAPERO info");
-    foutput->cd();
-
     // Find if there is an offset before first event
     uint64_t offset = 0;
-    offset = seek_first_evt_header(file, offset, verbose);
-    int padding_offset = 0;
+    uint64_t sync_window = 0;
+    if (opt->getValue("sync_window"))
+    {
+        sync_window = strtoull(opt->getValue("sync_window"), nullptr, 10);
+    }
 
     // Read raw events and boards headers info
-    bool is_good = false;
     int evtnum = 0;
     int evt_to_read = -1;
+    int first_event = 0;
     int boards = 0;
-    int board_id = -1;
-    int trigger_number = -1;
-    int trigger_id = -1;
-    int evt_size = 0;
-    int boards_read = 0;
-    unsigned int old_offset = 0;
-    unsigned long fw_version = 0;
-    uint64_t timestamp = 0;
-    uint64_t ext_timestamp = 0;
-    uint64_t first_timestamp = 0;
-    uint64_t first_ext_timestamp = 0;
-    long long timestamp_diff = 0;
-    long long ext_timestamp_diff = 0;
-    //uint64_t rate_timestamp[boards];
-    float mean_rate = 0;
-    float ext_mean_rate = 0;
-    std::tuple<bool, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, int> evt_retValues;
 
     if (!opt->getValue("boards"))
     {
@@ -100,180 +94,119 @@ int main(int argc, char *argv[])
         boards = atoi(opt->getValue("boards"));
     }
 
-    std::vector<uint64_t> rate_timestamp(boards, 0);
-    std::vector<uint64_t> ext_rate_timestamp(boards, 0);
-
-    // Initialize TGraphs for each board
-    TGraph *g_trigger_number[boards];
-    TGraph *g_trigger_id[boards];
-    TGraph *g_timestamp[boards];
-    TGraph *g_timestamp_delta[boards - 1];
-    TH1F *h_timestamp_rate[boards];
-    TGraph *g_ext_timestamp[boards];
-    TGraph *g_ext_timestamp_delta[boards - 1];
-    TH1F *h_ext_timestamp_rate[boards];
-
-    for (int i = 0; i < boards; i++)
+    if (opt->getValue("nevents"))
     {
-        g_trigger_number[i] = new TGraph();
-        g_trigger_number[i]->SetName(TString::Format("g_trigger_number_board_%d", i));
-        g_trigger_number[i]->SetTitle(TString::Format("Trigger number for board %d", i));
-        g_trigger_number[i]->GetXaxis()->SetTitle("Event read number");
-        g_trigger_number[i]->GetYaxis()->SetTitle("Trigger number");
-        g_trigger_id[i] = new TGraph();
-        g_trigger_id[i]->SetName(TString::Format("g_trigger_id_board_%d", i));
-        g_trigger_id[i]->SetTitle(TString::Format("Trigger id for board %d", i));
-        g_trigger_id[i]->GetXaxis()->SetTitle("Event read number");
-        g_trigger_id[i]->GetYaxis()->SetTitle("Trigger id");
-        g_timestamp[i] = new TGraph();
-        g_timestamp[i]->SetName(TString::Format("g_timestamp_board_%d", i));
-        g_timestamp[i]->SetTitle(TString::Format("Timestamp for board %d", i));
-        g_timestamp[i]->GetXaxis()->SetTitle("Event read number");
-        g_timestamp[i]->GetYaxis()->SetTitle("Timestamp");
-        g_ext_timestamp[i] = new TGraph();
-        g_ext_timestamp[i]->SetName(TString::Format("g_ext_timestamp_board_%d", i));
-        g_ext_timestamp[i]->SetTitle(TString::Format("Ext Timestamp for board %d", i));
-        g_ext_timestamp[i]->GetXaxis()->SetTitle("Event read number");
-        g_ext_timestamp[i]->GetYaxis()->SetTitle("Ext Timestamp");
-        h_timestamp_rate[i] = new TH1F("", "", 10000, 499900, 1e6);
-        h_timestamp_rate[i]->SetName(TString::Format("g_timestamp_rate_board_%d", i));
-        h_timestamp_rate[i]->SetTitle(TString::Format("Timestamp rate for board %d", i));
-        h_timestamp_rate[i]->GetXaxis()->SetTitle("Timestamp rate");
-        h_timestamp_rate[i]->GetYaxis()->SetTitle("Entries");
-        h_ext_timestamp_rate[i] = new TH1F("", "", 10000, 499900, 1e6);
-        h_ext_timestamp_rate[i]->SetName(TString::Format("g_ext_timestamp_rate_board_%d", i));
-        h_ext_timestamp_rate[i]->SetTitle(TString::Format("Ext Timestamp rate for board %d", i));
-        h_ext_timestamp_rate[i]->GetXaxis()->SetTitle("Ext Timestamp rate");
-        h_ext_timestamp_rate[i]->GetYaxis()->SetTitle("Entries");
+        evt_to_read = atoi(opt->getValue("nevents"));
     }
 
-    for (int i = 0; i < boards - 1; i++)
+    if (opt->getValue("first"))
     {
-        g_timestamp_delta[i] = new TGraph();
-        g_timestamp_delta[i]->SetName(TString::Format("g_timestamp_delta_board_%d", i + 1));
-        g_timestamp_delta[i]->SetTitle(TString::Format("Timestamp delta for board %d", i + 1));
-        g_timestamp_delta[i]->GetXaxis()->SetTitle("Event read number");
-        g_timestamp_delta[i]->GetYaxis()->SetTitle("Timestamp delta");
-        g_ext_timestamp_delta[i] = new TGraph();
-        g_ext_timestamp_delta[i]->SetName(TString::Format("g_ext_timestamp_delta_board_%d", i + 1));
-        g_ext_timestamp_delta[i]->SetTitle(TString::Format("Ext Timestamp delta for board %d", i + 1));
-        g_ext_timestamp_delta[i]->GetXaxis()->SetTitle("Event read number");
-        g_ext_timestamp_delta[i]->GetYaxis()->SetTitle("Ext Timestamp delta");
+        first_event = std::max(0, atoi(opt->getValue("first")));
     }
 
-    if (opt->getValue("nevents"))
+    // Scanner mode: the structure of the whole file is checked, without looking at the headers content
+    if (opt->getFlag("scan"))
     {
-        evt_to_read = atoi(opt->getValue("nevents"));
+        auto start = std::chrono::steady_clock::now();
+        CorruptionMap map;
+        map.Scan(file, boards);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "\tScanned " << file.GetSize() / 1e6 << " MB in " << seconds << " s" << std::endl;
+        map.Print(std::cout);
+        if (map.Write(opt->getArgv(0)))
+        {
+            std::cout << "\tCorruption map saved to " << CorruptionMap::GetMapName(opt->getArgv(0)) << std::endl;
+        }
+        return 0;
     }
 
-    while (!file.eof())
+    // Create output ROOT file
+    TString output_filename = opt->getArgv(1);
+    foutput = new TFile(output_filename.Data(), "RECREATE", "PAPERO info");
+    foutput->cd();
+
+    // Find if there is an offset before first event, or jump to the first event requested
+    offset = seek_event(opt->getArgv(0), file, boards, sync_window, first_event, verbose);
+    if (offset == (uint64_t)-999)
     {
-        if (evt_to_read > 0 && evtnum == evt_to_read)
-            break;
+        std::cout << "ERROR: can't find event " << first_event << std::endl;
+        return 2;
+    }
 
-        evt_retValues = read_de10_header(file, offset, verbose);
-        is_good = std::get<0>(evt_retValues);
+    // Only the headers are read: the walker jumps from one to the next by the payload lenght
+    FragmentWalker walker(file, boards, sync_window, verbose);
+    walker.Start(offset, first_event);
 
-        if (is_good)
-        {
-            boards_read++;
-            evt_size = std::get<1>(evt_retValues);
-            fw_version = std::get<2>(evt_retValues);
-            trigger_number = std::get<3>(evt_retValues);
-            board_id = std::get<4>(evt_retValues);
-            timestamp = std::get<5>(evt_retValues);
-            ext_timestamp = std::get<6>(evt_retValues);
-            trigger_id = std::get<7>(evt_retValues);
-            offset = std::get<8>(evt_retValues);
+    bool event_builder = opt->getFlag("event_builder");
+    size_t builder_window = 64;
+    if (opt->getValue("builder_window"))
+    {
+        builder_window = std::max(1, atoi(opt->getValue("builder_window")));
+    }
+    EventBuilder builder(walker, boards, builder_window, first_event);
 
-            std::cout << "\r\tReading event " << evtnum << std::flush;
+    std::vector<de10_fragment> fragments;
+    bool walked = event_builder ? builder.NextEvent(fragments) : walker.NextEvent(fragments);
 
-            g_trigger_number[boards_read - 1]->SetPoint(evtnum, evtnum, trigger_number);
-            g_trigger_id[boards_read - 1]->SetPoint(evtnum, evtnum, trigger_id);
-            g_timestamp[boards_read - 1]->SetPoint(evtnum, evtnum, timestamp);
-            g_ext_timestamp[boards_read - 1]->SetPoint(evtnum, evtnum, ext_timestamp);
+    // Columns for the events expected, from the event index or from the size of the first event
+    uint64_t expected_events = 0;
+    EventIndex index;
+    if (index.Open(opt->getArgv(0), boards, sync_window))
+    {
+        expected_events = index.GetEntries() - std::min<uint64_t>(index.GetEntries(), first_event);
+    }
+    else if (walked)
+    {
+        expected_events = HeaderDiagnostics::EstimateEvents(file.GetSize() - offset, boards, fragments[0]);
+    }
+    index.Close();
+    if (evt_to_read > 0)
+    {
+        expected_events = std::min<uint64_t>(expected_events, evt_to_read);
+    }
+    HeaderDiagnostics diagnostics(boards, expected_events);
 
-            h_timestamp_rate[boards_read - 1]->Fill(timestamp - rate_timestamp.at(boards_read - 1));
-            h_ext_timestamp_rate[boards_read - 1]->Fill(ext_timestamp - ext_rate_timestamp.at(boards_read - 1));
-            rate_timestamp[boards_read - 1] = timestamp;
-            ext_rate_timestamp[boards_read - 1] = ext_timestamp;
+    evtnum = first_event;
+    while (walked && !(evt_to_read > 0 && evtnum == first_event + evt_to_read))
+    {
+        if (evtnum % 10000 == 0)
+            std::cout << "\r\tReading event " << evtnum << std::flush;
 
-            if (boards_read == 1)
-            {
-                first_timestamp = timestamp;
-                first_ext_timestamp = ext_timestamp;
-            }
-            else
-            {
-                timestamp_diff = first_timestamp - timestamp;
-                ext_timestamp_diff = first_ext_timestamp - ext_timestamp;
-                g_timestamp_delta[boards_read - 2]->SetPoint(evtnum, evtnum, timestamp_diff);
-                g_ext_timestamp_delta[boards_read - 2]->SetPoint(evtnum, evtnum, ext_timestamp_diff);
-            }
+        for (const de10_fragment &fragment : fragments)
+        {
+            diagnostics.Fill(fragment);
 
             if (verbose)
             {
-                std::cout << "\tBoard ID " << board_id << std::endl;
-                std::cout << "\tBoards read " << boards_read << " out of " << boards << std::endl;
-                std::cout << "\tInternal Timestamp " << std::dec << timestamp << std::endl;
-                std::cout << "\tExternal Timestamp " << std::dec << ext_timestamp << std::endl;
-                std::cout << "\tTrigger ID " << trigger_id << std::endl;
-                std::cout << "\tFW version is: " << std::hex << fw_version << std::dec << std::endl;
-                std::cout << "\tEvt lenght: " << evt_size << std::endl;
-            }
-
-            if (fw_version == 0xffffffff9fd68b40)
-            {
-                // std::cout << "\tLADDERONE!!!" << std::endl;
-                padding_offset = 1024;
-                board_id = board_id - 300;
-            }
-            else
-            {
-                padding_offset = 0;
-            }
-
-            if (boards_read == boards)
-            {
-                boards_read = 0;
-                evtnum++;
-                offset = (int)file.tellg() + padding_offset + 8;
+                std::cout << "\tBoard ID " << fragment.board_id << std::endl;
+                std::cout << "\tBoards read " << fragment.board + 1 << " out of " << boards << std::endl;
+                std::cout << "\tInternal Timestamp " << std::dec << fragment.timestamp << std::endl;
+                std::cout << "\tExternal Timestamp " << std::dec << fragment.ext_timestamp << std::endl;
+                std::cout << "\tTrigger ID " << fragment.trigger_id << std::endl;
+                std::cout << "\tFW version is: " << std::hex << fragment.fw_version << std::dec << std::endl;
+                std::cout << "\tEvt lenght: " << fragment.evt_size << std::endl;
             }
-            else
-            {
-                offset = (int)file.tellg() + padding_offset + 4;
-                if (verbose)
-                {
-                    std::cout << "WARNING: not all boards were read" << std::endl;
-                }
-            }
-        }
-        else
-        {
-            break;
         }
-    }
+        evtnum++;
 
-    std::cout << "\n\tClosing file after " << evtnum << " events" << std::endl;
+        walked = event_builder ? builder.NextEvent(fragments) : walker.NextEvent(fragments);
+    }
 
-    // Write graphs to file
-    for (int i = 0; i < boards; i++)
+    std::cout << "\r\tReading event " << evtnum << std::flush;
+    std::cout << "\n\tClosing file after " << evtnum - first_event << " events" << std::endl;
+    if (event_builder)
     {
-        g_trigger_number[i]->Write();
-        g_trigger_id[i]->Write();
-        g_timestamp[i]->Write();
-        g_ext_timestamp[i]->Write();
-        h_timestamp_rate[i]->Write();
-        h_ext_timestamp_rate[i]->Write();
+        std::cout << "\tEvent builder: " << builder.GetIncomplete() << " incomplete events dropped" << std::endl;
     }
-
-    for (int i = 0; i < boards - 1; i++)
+    if (walker.GetResyncs())
     {
-        g_timestamp_delta[i]->Write();
-        g_ext_timestamp_delta[i]->Write();
+        std::cout << "\tResynchronized " << walker.GetResyncs() << " times, skipping " << walker.GetSkippedBytes() << " bytes" << std::endl;
     }
 
+    // Write graphs to file
+    diagnostics.Write();
+
     foutput->Close();
-    file.close();
+    file.Close();
     return 0;
 }
@@ -0,0 +1,230 @@
+#include "PAPERO_kernels.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PAPERO_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+//////////////////////////////////////////////
+// Scalar versions
+
+static uint64_t find_sync_word_scalar(const unsigned char *data, uint64_t nwords, const unsigned char pattern[4])
+{
+  uint32_t word;
+  memcpy(&word, pattern, 4);
+  uint64_t pair = ((uint64_t)word << 32) | word; // two words per 64-bit compare
+
+  uint64_t i = 0;
+  for (; i + 2 <= nwords; i += 2)
+  {
+    uint64_t val;
+    memcpy(&val, data + 4 * i, 8);
+    uint64_t diff = val ^ pair;
+    if ((uint32_t)diff == 0 || (uint32_t)(diff >> 32) == 0)
+    {
+      // one of the two words matches, find out which one
+      return memcmp(data + 4 * i, pattern, 4) == 0 ? i : i + 1;
+    }
+  }
+  if (i < nwords && memcmp(data + 4 * i, pattern, 4) == 0)
+  {
+    return i;
+  }
+  return nwords;
+}
+
+static void unpack_payload_scalar(const unsigned char *data, uint64_t nsamples, unsigned int *out, bool astra)
+{
+  if (!astra)
+  {
+    for (uint64_t i = 0; i < nsamples; i++, data += 2)
+    {
+      out[i] = (data[0] | data[1] << 8) / 4;
+    }
+  }
+  else
+  {
+    for (uint64_t i = 0; i < nsamples; i++, data += 2)
+    {
+      out[i] = data[0] | (data[1] & 0x0f) << 8;
+    }
+  }
+}
+
+#ifdef PAPERO_X86_KERNELS
+
+//////////////////////////////////////////////
+// SSE2: 16 words per iteration
+
+__attribute__((target("sse2"))) static uint64_t find_sync_word_sse2(const unsigned char *data, uint64_t nwords, const unsigned char pattern[4])
+{
+  int32_t word;
+  memcpy(&word, pattern, 4);
+  const __m128i pat = _mm_set1_epi32(word);
+
+  uint64_t i = 0;
+  for (; i + 16 <= nwords; i += 16)
+  {
+    const __m128i *p = reinterpret_cast<const __m128i *>(data + 4 * i);
+    __m128i c0 = _mm_cmpeq_epi32(_mm_loadu_si128(p), pat);
+    __m128i c1 = _mm_cmpeq_epi32(_mm_loadu_si128(p + 1), pat);
+    __m128i c2 = _mm_cmpeq_epi32(_mm_loadu_si128(p + 2), pat);
+    __m128i c3 = _mm_cmpeq_epi32(_mm_loadu_si128(p + 3), pat);
+    __m128i any = _mm_or_si128(_mm_or_si128(c0, c1), _mm_or_si128(c2, c3));
+    if (_mm_movemask_epi8(any))
+    {
+      // one movemask bit per byte: 4 bits per matching word
+      uint64_t mask = (uint64_t)(uint16_t)_mm_movemask_epi8(c0) |
+                      (uint64_t)(uint16_t)_mm_movemask_epi8(c1) << 16 |
+                      (uint64_t)(uint16_t)_mm_movemask_epi8(c2) << 32 |
+                      (uint64_t)(uint16_t)_mm_movemask_epi8(c3) << 48;
+      return i + __builtin_ctzll(mask) / 4;
+    }
+  }
+  return i + find_sync_word_scalar(data + 4 * i, nwords - i, pattern);
+}
+
+// 8 samples per iteration: shift or mask the 16-bit lanes, then widen them to 32 bits
+__attribute__((target("sse2"))) static void unpack_payload_sse2(const unsigned char *data, uint64_t nsamples, unsigned int *out, bool astra)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_set1_epi16(0x0fff);
+
+  uint64_t i = 0;
+  for (; i + 8 <= nsamples; i += 8)
+  {
+    __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 2 * i));
+    samples = astra ? _mm_and_si128(samples, mask) : _mm_srli_epi16(samples, 2);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi16(samples, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 4), _mm_unpackhi_epi16(samples, zero));
+  }
+  unpack_payload_scalar(data + 2 * i, nsamples - i, out + i, astra);
+}
+
+//////////////////////////////////////////////
+// AVX2: 16 words per iteration
+
+__attribute__((target("avx2"))) static uint64_t find_sync_word_avx2(const unsigned char *data, uint64_t nwords, const unsigned char pattern[4])
+{
+  int32_t word;
+  memcpy(&word, pattern, 4);
+  const __m256i pat = _mm256_set1_epi32(word);
+
+  uint64_t i = 0;
+  for (; i + 16 <= nwords; i += 16)
+  {
+    const __m256i *p = reinterpret_cast<const __m256i *>(data + 4 * i);
+    __m256i c0 = _mm256_cmpeq_epi32(_mm256_loadu_si256(p), pat);
+    __m256i c1 = _mm256_cmpeq_epi32(_mm256_loadu_si256(p + 1), pat);
+    if (!_mm256_testz_si256(_mm256_or_si256(c0, c1), _mm256_or_si256(c0, c1)))
+    {
+      uint64_t mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(c0) |
+                      (uint64_t)(uint32_t)_mm256_movemask_epi8(c1) << 32;
+      return i + __builtin_ctzll(mask) / 4;
+    }
+  }
+  return i + find_sync_word_scalar(data + 4 * i, nwords - i, pattern);
+}
+
+// 16 samples per iteration: widen 8 samples at a time to 32 bits, then shift or mask
+__attribute__((target("avx2"))) static void unpack_payload_avx2(const unsigned char *data, uint64_t nsamples, unsigned int *out, bool astra)
+{
+  const __m256i mask = _mm256_set1_epi32(0x0fff);
+
+  uint64_t i = 0;
+  for (; i + 16 <= nsamples; i += 16)
+  {
+    __m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 2 * i)));
+    __m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 2 * i + 16)));
+    if (astra)
+    {
+      lo = _mm256_and_si256(lo, mask);
+      hi = _mm256_and_si256(hi, mask);
+    }
+    else
+    {
+      lo = _mm256_srli_epi32(lo, 2);
+      hi = _mm256_srli_epi32(hi, 2);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 8), hi);
+  }
+  unpack_payload_scalar(data + 2 * i, nsamples - i, out + i, astra);
+}
+
+#endif
+
+//////////////////////////////////////////////
+// Runtime dispatch
+
+enum kernel_isa
+{
+  isa_scalar,
+  isa_sse2,
+  isa_avx2
+};
+
+static kernel_isa detect_isa()
+{
+#ifdef PAPERO_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return isa_avx2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    return isa_sse2;
+  }
+#endif
+  return isa_scalar;
+}
+
+static const kernel_isa selected_isa = detect_isa();
+
+const char *kernels_isa()
+{
+  switch (selected_isa)
+  {
+  case isa_avx2:
+    return "avx2";
+  case isa_sse2:
+    return "sse2";
+  default:
+    return "scalar";
+  }
+}
+
+uint64_t find_sync_word(const unsigned char *data, uint64_t nwords, const unsigned char pattern[4])
+{
+#ifdef PAPERO_X86_KERNELS
+  if (selected_isa == isa_avx2)
+  {
+    return find_sync_word_avx2(data, nwords, pattern);
+  }
+  if (selected_isa == isa_sse2)
+  {
+    return find_sync_word_sse2(data, nwords, pattern);
+  }
+#endif
+  return find_sync_word_scalar(data, nwords, pattern);
+}
+
+void unpack_payload(const unsigned char *data, uint64_t nwords, unsigned int *out, bool astra)
+{
+#ifdef PAPERO_X86_KERNELS
+  if (selected_isa == isa_avx2)
+  {
+    unpack_payload_avx2(data, 2 * nwords, out, astra);
+    return;
+  }
+  if (selected_isa == isa_sse2)
+  {
+    unpack_payload_sse2(data, 2 * nwords, out, astra);
+    return;
+  }
+#endif
+  unpack_payload_scalar(data, 2 * nwords, out, astra);
+}
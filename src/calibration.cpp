@@ -8,119 +8,128 @@
 #include "TCanvas.h"
 #include "TLatex.h"
 #include "TPDF.h"
+#include "TROOT.h"
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <sstream>
 #include <string>
+#include <thread>
 #include "TLine.h"
 #include "TKey.h"
 #include "TPaveText.h"
 #include "anyoption.h"
 #include "event.h"
+#include "rawEventReader.h"
+#include "channelStats.h"
+#include "timeIndex.h"
+
+#define calibration_chunk_entries 1024 // entries read at once by a thread, whatever the number of threads
 
 AnyOption *opt; // Handle the option input
 
-int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, float sigmaraw_cut = 3, float sigma_cut = 6, int board = 0, int side = 0, bool pdf_only = false, bool fast = true, bool fit = false, bool single_file = true, bool last_board = false, int max_ADC = -1, bool isDune = false)
-{
-  TFile *foutput;
-  if (!pdf_only)
-  {
-    TString root_filename;
-    if (!single_file)
-    {
-      root_filename = output_filename + "_board-" + board + "_side-" + side + ".root";
-    }
-    else
-    {
-      root_filename = output_filename + ".root";
-    }
-    foutput = new TFile(root_filename.Data(), "UPDATE");
-    foutput->cd();
-  }
+const double cn_range = 50; // CN-subtracted signal taken for the sigmas, in ADC counts: [-cn_range, cn_range)
+const int adc_range = 16384; // ADC samples are 16 bits / 4 (14 bits), 12 bits for ASTRA
+// The ADC count table of a channel is a window of adc_counts_bins ADC counts around its pedestal, placed at the
+// median of its first adc_window_entries values: 4 kB per channel for each thread, instead of 64 kB for all the range
+const int adc_counts_bins = 1024;
+const int adc_window_entries = 64;
+const int cn_counts_per_adc = 8;  // resolution of the CN-subtracted signal in the count tables: 1/8 ADC count
 
-  std::string alphabet = "ABCDEFGHIJKLMNOPQRSTWXYZ";
-  // Read raw event from input chain TTree
-  std::vector<unsigned int> *raw_event = 0;
-  TBranch *RAW = 0;
-  TString branch_name;
+// How pedestals, raw sigmas and sigmas are estimated from the values of each channel
+enum calibration_estimator
+{
+  moments_estimator, // mean and RMS
+  fit_estimator,     // gaussian fit of a histogram
+  median_estimator,  // median and 1.4826 * MAD of the count tables, not pulled by signal or dead events
+  clipped_estimator, // mean and RMS of the count tables within a few sigmas, iterated
+  fastfit_estimator  // gaussian core of the count tables in closed form, instead of the fit
+};
+
+// With --fit --fastfit both run, and the fast fit of each channel is compared with the fit in statistical
+// errors of the fit: sigma / sqrt(entries) for the mean, sigma / sqrt(2 entries) for sigma. On simulated
+// gaussian channels the fast fit stays within 1 (pedestal), 2 (raw sigma) and 4 (sigma) of them.
+const double fastfit_mean_tolerance = 3;
+const double fastfit_sigma_tolerance = 5;
+
+bool uses_counts(calibration_estimator estimator)
+{
+  return estimator == median_estimator || estimator == clipped_estimator || estimator == fastfit_estimator;
+}
 
-  if(!isDune)
+// Calibration of a detector. All the detectors are calibrated together, in a single pass over the run:
+// the first half of the entries gives pedestals and raw sigmas, the second half the sigmas after pedestal
+// and common noise subtraction.
+struct detector_calibration
+{
+  int detector = 0; // in the reader
+  int board = 0;    // as in the names of the output objects
+  int side = 0;
+  int label_board = 0; // as in the .cal file and in the PDF: the protoDUNE setup has all the detectors on board 0
+  int label_side = 0;
+  bool last_board = false; // closes the PDF
+  int channels = 0;
+  Long64_t entries = 0;
+  std::string header; // of the .cal file, asked for before reading the run
+
+  // Running moments of each channel: raw ADC for pedestals and raw sigmas, CN-subtracted signal in the
+  // [-cn_range, cn_range) ADC range for sigmas. Histograms are booked only for the gaussian fits, count
+  // tables of the same values only for the estimators using them.
+  ChannelMoments adc_moments;
+  ChannelMoments cn_moments;
+  ChannelCounts adc_counts;
+  ChannelCounts cn_counts;
+  std::vector<TH1D *> hADC;
+  std::vector<TH1D *> hCN;
+  std::vector<double> adc_counts_min; // first value of the ADC count table of each channel
+
+  std::vector<float> pedestals;
+  std::vector<float> rsigma;
+  std::vector<double> sigmas; // from the count tables
+  // with --fit --fastfit, the fast fit of pedestals and raw sigmas (sigmas are in sigmas)
+  std::vector<double> fastfit_pedestals;
+  std::vector<double> fastfit_rsigma;
+};
+
+// Prepares the calibration of the detector on a board side: false if it can't be done
+bool begin_calibration(RawEventReader &reader, detector_calibration &cal, float sigmaraw_cut, float sigma_cut, bool pdf_only, bool fast, calibration_estimator estimator, bool isDune)
+{
+  int board = cal.board;
+  int side = cal.side;
+  if (!isDune && side != 0 && side != 1)
   {
-    if (side == 0)
-    {
-      chain.SetBranchAddress("RAW Event J5", &raw_event, &RAW);
-    }
-    else if (side == 1)
-    {
-      chain.SetBranchAddress("RAW Event J7", &raw_event, &RAW);
-    }
-    else
-    {
-      std::cout << "Side must be 0 or 1" << std::endl;
-      return 1;
-    }
+    std::cout << "Side must be 0 or 1" << std::endl;
+    return false;
   }
-  else
+  cal.detector = 2 * board + side;
+  if (!reader.GetEntry(0, cal.detector))
   {
-    if (board == 0 && side == 0)
-    {
-      branch_name = (TString) "RAW Event";
-    } 
-    else
-    {
-      branch_name = (TString) "RAW Event " + alphabet[2 * board + side];
-    }
-    chain.SetBranchAddress(branch_name, &raw_event, &RAW);
+    std::cout << "ERROR: can't read the first entry of detector " << cal.detector << std::endl;
+    return false;
   }
+  cal.channels = reader.GetData(cal.detector).size();
+  int NChannels = cal.channels;
 
-
-  chain.GetEntry(0);
-  int NChannels = raw_event->size();
-  int NVas = NChannels / 64;
-
-  // histos
-  TH1D *hADC[NChannels];
-  TH1D *hSignal[NChannels];
-  TH1D *hCN[NChannels];
-  for (int ch = 0; ch < NChannels; ch++)
+  cal.adc_moments = ChannelMoments(NChannels);
+  cal.cn_moments = ChannelMoments(NChannels, -cn_range, cn_range);
+  if (estimator == fit_estimator)
   {
-    hADC[ch] = new TH1D(Form("pedestal_channel_%d_board_%d_side_%d", ch, board, side), Form("Pedestal %d", ch), 1000, 0, -1);
-    hADC[ch]->GetXaxis()->SetTitle("ADC");
-    hSignal[ch] = new TH1D(Form("signal_channel_%d_board_%d_side_%d", ch, board, side), Form("Signal %d", ch), 1000, -50, 50);
-    hSignal[ch]->GetXaxis()->SetTitle("ADC");
-    hCN[ch] = new TH1D(Form("cn_channel_%d_board_%d_side_%d", ch, board, side), Form("CN %d", ch), 1000, -50, 50);
-    hCN[ch]->GetXaxis()->SetTitle("ADC");
+    cal.hADC.resize(NChannels);
+    cal.hCN.resize(NChannels);
+    for (int ch = 0; ch < NChannels; ch++)
+    {
+      cal.hADC[ch] = new TH1D(Form("pedestal_channel_%d_board_%d_side_%d", ch, board, side), Form("Pedestal %d", ch), 1000, 0, -1);
+      cal.hADC[ch]->GetXaxis()->SetTitle("ADC");
+      cal.hCN[ch] = new TH1D(Form("cn_channel_%d_board_%d_side_%d", ch, board, side), Form("CN %d", ch), 1000, -cn_range, cn_range);
+      cal.hCN[ch]->GetXaxis()->SetTitle("ADC");
+    }
   }
 
-  TF1 *fittedgaus;
-
-  TGraph *gr = new TGraph(NChannels);
-  gr->SetName((TString) "Pedestals" + "_board-" + board + "_side-" + side);
-  gr->SetTitle("Pedestals");
-
-  TGraph *gr2 = new TGraph(NChannels);
-  gr2->SetName((TString) "RawSigma" + "_board-" + board + "_side-" + side);
-  gr2->SetTitle("Raw Sigmas");
-  gr2->GetXaxis()->SetTitle("channel");
-  gr2->GetXaxis()->SetLimits(0, NChannels);
-
-  TGraph *gr3 = new TGraph(NChannels);
-  gr3->SetName((TString) "Sigma" + "_board-" + board + "_side-" + side);
-  gr3->SetTitle("Sigmas");
-  gr3->GetXaxis()->SetTitle("channel");
-  gr3->GetXaxis()->SetLimits(0, NChannels);
-
-  std::vector<float> pedestals[NChannels];
-  float mean_pedestal = 0;
-  float rms_pedestal = 0;
-  std::vector<float> rsigma[NChannels];
-  float mean_rsigma = 0;
-  float rms_rsigma = 0;
-  std::vector<float> sigma[NChannels];
-  float mean_sigma = 0;
-  float rms_sigma = 0;
-  float max_sigma = 0;
-
   char name[100];
   char location[100];
   char bias[100];
@@ -128,15 +137,15 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
   char curr6v[100];
   char curr3v[100];
   char delay[100];
-  
 
   if (isDune)
   {
     side = 2 * board + side;
-    board = 0; 
+    board = 0;
   }
+  cal.label_board = board;
+  cal.label_side = side;
 
-  ofstream calfile;
   if (!pdf_only)
   {
     if (!fast)
@@ -171,112 +180,646 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
 
     std::time_t result = std::time(nullptr);
 
-    if (!single_file)
+    std::ostringstream header;
+    header << "#temp_SN= NC\n";
+    header << "#temp_SN= NC\n";
+    header << "#name= " << name << "\n";
+    header << "#location= " << location << "\n";
+    header << "#bias_volt= " << bias << "V\n";
+    header << "#leak_curr= " << leak << "uA\n";
+    header << "#6v_curr= " << curr6v << "mA\n";
+    header << "#3v_curr= " << curr3v << "mA\n";
+    header << "#starting_time= " << std::asctime(std::localtime(&result));
+    header << "#temp_right= NC\n";
+    header << "#temp_left= NC\n";
+    header << "#hold_delay= " << delay << "\n";
+    header << "#sigmaraw_cut= " << sigmaraw_cut << "\n";
+    header << "#sigmaraw_noise_cut= NC\n";
+    header << "#sigma_cut= " << sigma_cut << "\n";
+    header << "#sigma_noise_cut= NC\n";
+    header << "#sigma_k= NC\n";
+    header << "#occupancy_k= NC\n";
+    cal.header = header.str();
+  }
+
+  std::cout << "\nProcessing data for detector on board " << board << " on side " << side << std::endl;
+  cal.entries = reader.GetEntries(cal.detector);
+  std::cout << "\tThis run has " << cal.entries << " entries" << std::endl;
+
+  if (cal.entries == 0)
+  {
+    std::cout << "\tERROR: skipping empty run" << std::endl;
+  }
+  return true;
+}
+
+// What a chunk of entries adds to the calibration of a detector: the moments of its values and, for the
+// fit histograms, the values themselves event by event (NaN where nothing is filled). Count tables are
+// filled directly, one per thread, as their sum doesn't depend on the order.
+struct calibration_chunk
+{
+  ChannelMoments moments;
+  std::vector<float> values;
+};
+
+enum calibration_phase
+{
+  pedestal_phase, // raw ADC, first half of the entries
+  signal_phase    // CN-subtracted signal, second half
+};
+
+void fill_pedestals(const detector_calibration &cal, calibration_chunk &chunk, ChannelCounts *counts, const std::vector<unsigned int> &raw_event, bool fit)
+{
+  if (raw_event.size() != cal.channels)
+  {
+    return;
+  }
+  for (int k = 0; k < cal.channels; k++)
+  {
+    chunk.moments.Fill(k, raw_event[k]);
+  }
+  if (counts)
+  {
+    for (int k = 0; k < cal.channels; k++)
     {
-      calfile.open(output_filename + "_board-" + Form("%d", board) + "_side-" + Form("%d", side) + ".cal");
+      counts->Fill(k, raw_event[k]);
     }
-    else
+  }
+  if (fit)
+  {
+    chunk.values.insert(chunk.values.end(), raw_event.begin(), raw_event.end());
+  }
+}
+
+// Like before, but this time we correct for common noise
+void fill_signal(const detector_calibration &cal, calibration_chunk &chunk, ChannelCounts *counts, const std::vector<unsigned int> &raw_event, std::vector<float> &signal, bool fit)
+{
+  if (raw_event.size() != cal.pedestals.size())
+  {
+    return;
+  }
+
+  // Pedestal subtraction
+  signal.resize(raw_event.size());
+  for (size_t ch = 0; ch < raw_event.size(); ch++)
+  {
+    signal[ch] = (double)raw_event[ch] - (double)cal.pedestals[ch];
+  }
+
+  size_t first_value = chunk.values.size();
+  if (fit)
+  {
+    chunk.values.resize(first_value + cal.channels, NAN);
+  }
+
+  // Chip-wise CN subtraction before filling the histos
+  int NVas = cal.channels / 64;
+  for (int va = 0; va < NVas; va++) // Loop on VA
+  {
+    float cn = GetCN(&signal, va, 0);
+    if (cn != -999)
     {
-      calfile.open(output_filename + ".cal", std::ofstream::out | std::ofstream::app);
+      for (int va_chan = 0; va_chan < 64; va_chan++)
+      {
+        int ch = 64 * va + va_chan;
+        chunk.moments.Fill(ch, signal[ch] - cn);
+        if (counts)
+        {
+          counts->Fill(ch, signal[ch] - cn);
+        }
+        if (fit)
+        {
+          chunk.values[first_value + ch] = signal[ch] - cn;
+        }
+      }
     }
+  }
+}
 
-    calfile << "#temp_SN= NC\n";
-    calfile << "#temp_SN= NC\n";
-    calfile << "#name= " << name << "\n";
-    calfile << "#location= " << location << "\n";
-    calfile << "#bias_volt= " << bias << "V\n";
-    calfile << "#leak_curr= " << leak << "uA\n";
-    calfile << "#6v_curr= " << curr6v << "mA\n";
-    calfile << "#3v_curr= " << curr3v << "mA\n";
-    calfile << "#starting_time= " << std::asctime(std::localtime(&result));
-    calfile << "#temp_right= NC\n";
-    calfile << "#temp_left= NC\n";
-    calfile << "#hold_delay= " << delay << "\n";
-    calfile << "#sigmaraw_cut= " << sigmaraw_cut << "\n";
-    calfile << "#sigmaraw_noise_cut= NC\n";
-    calfile << "#sigma_cut= " << sigma_cut << "\n";
-    calfile << "#sigma_noise_cut= NC\n";
-    calfile << "#sigma_k= NC\n";
-    calfile << "#occupancy_k= NC\n";
+// Reads the entries [begin, end) for all the detectors, one every `every` from the first entry of the phase.
+// Each detector uses its own entries, as they may differ by the last, incomplete event.
+// counts are the count tables of the detectors for this thread, empty if they are not used.
+// False if an entry can't be read.
+bool fill_chunk(RawEventReader &reader, const std::vector<detector_calibration> &calibrations, calibration_phase phase, Long64_t phase_begin, Long64_t begin, Long64_t end, int every, bool fit, std::vector<ChannelCounts> &counts, std::vector<calibration_chunk> &chunks)
+{
+  chunks.resize(calibrations.size());
+  for (size_t i = 0; i < calibrations.size(); i++)
+  {
+    chunks[i].moments = phase == pedestal_phase ? ChannelMoments(calibrations[i].channels) : ChannelMoments(calibrations[i].channels, -cn_range, cn_range);
+    chunks[i].values.clear();
   }
 
-  std::cout << "\nProcessing data for detector on board " << board << " on side " << side << std::endl;
-  int entries = chain.GetEntries();
-  std::cout << "\tThis run has " << entries << " entries" << std::endl;
+  std::vector<float> signal;
+  for (Long64_t entry = phase_begin + (begin - phase_begin + every - 1) / every * every; entry < end; entry += every)
+  {
+    for (size_t i = 0; i < calibrations.size(); i++)
+    {
+      const detector_calibration &cal = calibrations[i];
+      ChannelCounts *detector_counts = counts.empty() ? nullptr : &counts[i];
+      bool pedestal_entry = phase == pedestal_phase && entry < cal.entries / 2;
+      bool signal_entry = phase == signal_phase && entry >= cal.entries / 2 && entry < cal.entries;
+      if (!pedestal_entry && !signal_entry)
+      {
+        continue;
+      }
+      if (!reader.GetEntry(entry, cal.detector))
+      {
+        std::cout << "ERROR: can't read entry " << entry << " of detector " << cal.detector << std::endl;
+        return false;
+      }
+      if (pedestal_entry)
+      {
+        fill_pedestals(cal, chunks[i], detector_counts, reader.GetData(cal.detector), fit);
+      }
+      else
+      {
+        fill_signal(cal, chunks[i], detector_counts, reader.GetData(cal.detector), signal, fit);
+      }
+    }
+  }
+  return true;
+}
 
-  if (entries == 0)
+void merge_chunk(detector_calibration &cal, calibration_phase phase, const calibration_chunk &chunk, bool fit)
+{
+  (phase == pedestal_phase ? cal.adc_moments : cal.cn_moments).Merge(chunk.moments);
+  if (!fit)
   {
-    std::cout << "\tERROR: skipping empty run" << std::endl;
-    return -1;
+    return;
+  }
+  std::vector<TH1D *> &histos = phase == pedestal_phase ? cal.hADC : cal.hCN;
+  for (size_t i = 0; i < chunk.values.size(); i++)
+  {
+    if (!std::isnan(chunk.values[i]))
+    {
+      histos[i % cal.channels]->Fill(chunk.values[i]);
+    }
   }
+}
 
-  // First half of events are used to compute pedestals and raw_sigmas
-  for (int index_event = 1; index_event < entries / 2; index_event++)
+// Entries [begin, end) of a phase, in chunks of calibration_chunk_entries read by the threads, one per reader.
+// The chunks are merged into the calibrations in entry order, as they were read by a single thread: the
+// result doesn't depend on the number of threads. Each thread fills its own count tables, summed at the end.
+// False if an entry can't be read: the threads stop reading, and the calibration can't be trusted.
+bool run_phase(const std::vector<RawEventReader *> &readers, std::vector<detector_calibration> &calibrations, calibration_phase phase, Long64_t begin, Long64_t end, int every, bool fit, bool tables)
+{
+  if (end <= begin)
   {
-    chain.GetEntry(index_event);
-    // if (index_event == 1)
-    // {
-    //   cout << "Reading event " << index_event << endl;
-    //   cout << "\tEvent size " << raw_event->size() << endl;
-    // }
+    return true;
+  }
+  std::vector<std::vector<ChannelCounts>> reader_counts(readers.size());
+  if (tables)
+  {
+    for (std::vector<ChannelCounts> &counts : reader_counts)
+    {
+      for (const detector_calibration &cal : calibrations)
+      {
+        if (phase == pedestal_phase)
+        {
+          counts.emplace_back(cal.adc_counts_min, 1, adc_counts_bins);
+        }
+        else
+        {
+          counts.emplace_back(cal.channels, -cn_range, 1.0 / cn_counts_per_adc, 2 * cn_range * cn_counts_per_adc);
+        }
+      }
+    }
+  }
 
-    if (raw_event->size() == NChannels)
+  Long64_t nchunks = (end - begin + calibration_chunk_entries - 1) / calibration_chunk_entries;
+  auto fill = [&](size_t r, Long64_t k, std::vector<calibration_chunk> &chunks)
+  {
+    Long64_t chunk_begin = begin + k * calibration_chunk_entries;
+    return fill_chunk(*readers[r], calibrations, phase, begin, chunk_begin, std::min(end, chunk_begin + calibration_chunk_entries), every, fit, reader_counts[r], chunks);
+  };
+  auto sum_counts = [&]()
+  {
+    for (size_t i = 0; i < calibrations.size() && tables; i++)
     {
-      for (int k = 0; k < raw_event->size(); k++)
+      ChannelCounts &counts = phase == pedestal_phase ? calibrations[i].adc_counts : calibrations[i].cn_counts;
+      counts = std::move(reader_counts[0][i]);
+      for (size_t r = 1; r < readers.size(); r++)
       {
-        // Filling histos for each channel for Gaussian Fit
-        hADC[k]->Fill(raw_event->at(k));
+        counts.Add(reader_counts[r][i]);
       }
     }
+  };
+  auto merge = [&](const std::vector<calibration_chunk> &chunks)
+  {
+    for (size_t i = 0; i < calibrations.size(); i++)
+    {
+      merge_chunk(calibrations[i], phase, chunks[i], fit);
+    }
+  };
+
+  std::vector<calibration_chunk> chunks;
+  if (readers.size() == 1)
+  {
+    for (Long64_t k = 0; k < nchunks; k++)
+    {
+      if (!fill(0, k, chunks))
+      {
+        return false;
+      }
+      merge(chunks);
+    }
+    sum_counts();
+    return true;
   }
 
-  for (int ch = 0; ch < NChannels; ch++)
+  // Chunks are handed over to this thread through window slots: a chunk is read only when its slot is free
+  Long64_t window = 2 * readers.size();
+  std::vector<std::vector<calibration_chunk>> slots(window);
+  std::vector<Long64_t> slot_chunk(window, -1);
+  Long64_t merged = 0;
+  std::atomic<Long64_t> next(0);
+  std::atomic<bool> failed(false); // chunks are still handed over, but not read nor merged
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  auto worker = [&](size_t r)
+  {
+    std::vector<calibration_chunk> worker_chunks;
+    for (Long64_t k = next++; k < nchunks; k = next++)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return k < merged + window; });
+      }
+      if (!failed && !fill(r, k, worker_chunks))
+      {
+        failed = true;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        slots[k % window].swap(worker_chunks);
+        slot_chunk[k % window] = k;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (size_t r = 0; r < readers.size(); r++)
+  {
+    pool.emplace_back(worker, r);
+  }
+  for (Long64_t k = 0; k < nchunks; k++)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return slot_chunk[k % window] == k; });
+      chunks.swap(slots[k % window]);
+    }
+    if (!failed)
+    {
+      merge(chunks);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      merged++;
+    }
+    cv.notify_all();
+  }
+  for (auto &t : pool)
+  {
+    t.join();
+  }
+  if (failed)
+  {
+    return false;
+  }
+  sum_counts();
+  return true;
+}
+
+// Center and width of the distribution of a channel in a count table
+void estimate_counts(const ChannelCounts &counts, int ch, calibration_estimator estimator, double clip, double &center, double &width)
+{
+  if (estimator == median_estimator)
+  {
+    center = counts.GetMedian(ch);
+    width = 1.4826 * counts.GetMAD(ch);
+  }
+  else if (estimator == fastfit_estimator)
+  {
+    counts.GetGaussianCore(ch, center, width);
+  }
+  else
+  {
+    counts.GetClipped(ch, clip, center, width);
+  }
+}
+
+// estimate_counts for all the channels, shared among the threads
+void estimate_channels(const ChannelCounts &counts, calibration_estimator estimator, double clip, int threads, std::vector<double> &centers, std::vector<double> &widths)
+{
+  int channels = counts.GetChannels();
+  centers.assign(channels, 0);
+  widths.assign(channels, 0);
+  std::atomic<int> next(0);
+  auto worker = [&]()
+  {
+    for (int ch = next++; ch < channels; ch = next++)
+    {
+      estimate_counts(counts, ch, estimator, clip, centers[ch], widths[ch]);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; t++)
+  {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : pool)
+  {
+    t.join();
+  }
+}
+
+// Tells how many values the count tables of a detector left out
+void report_outside(const detector_calibration &cal, const ChannelCounts &counts, const char *values)
+{
+  uint64_t outside = 0;
+  int channels = 0;
+  for (int ch = 0; ch < counts.GetChannels(); ch++)
+  {
+    outside += counts.GetOutside(ch);
+    channels += counts.GetOutside(ch) > 0;
+  }
+  if (outside)
+  {
+    std::cout << "\tBoard " << cal.label_board << " side " << cal.label_side << ": " << outside << " " << values << " out of the count tables on " << channels << " channel(s), left out of the estimates" << std::endl;
+  }
+}
+
+void compute_pedestals(detector_calibration &cal, calibration_estimator estimator, double clip, int threads, bool check_fastfit)
+{
+  std::vector<double> counts_pedestals, counts_rsigma;
+  if (uses_counts(estimator) || check_fastfit)
+  {
+    estimate_channels(cal.adc_counts, check_fastfit ? fastfit_estimator : estimator, clip, threads, counts_pedestals, counts_rsigma);
+    report_outside(cal, cal.adc_counts, "ADC samples");
+  }
+  for (int ch = 0; ch < cal.channels; ch++)
   {
     // Fitting histos with gaus to compute ped and raw_sigma
-    if (hADC[ch]->GetEntries())
+    if (cal.adc_moments.GetEntries(ch))
     {
-      if (fit)
+      if (uses_counts(estimator))
       {
-        hADC[ch]->Fit("gaus", "QS");
-        fittedgaus = (TF1 *)hADC[ch]->GetListOfFunctions()->FindObject("gaus");
-        pedestals->push_back(fittedgaus->GetParameter(1));
-        rsigma->push_back(fittedgaus->GetParameter(2));
-        gr->SetPoint(ch, ch, fittedgaus->GetParameter(1));
-        gr2->SetPoint(ch, ch, fittedgaus->GetParameter(2));
+        cal.pedestals.push_back(counts_pedestals[ch]);
+        cal.rsigma.push_back(counts_rsigma[ch]);
+      }
+      else if (estimator == fit_estimator)
+      {
+        cal.hADC[ch]->Fit("gaus", "QS");
+        TF1 *fittedgaus = (TF1 *)cal.hADC[ch]->GetListOfFunctions()->FindObject("gaus");
+        cal.pedestals.push_back(fittedgaus->GetParameter(1));
+        cal.rsigma.push_back(fittedgaus->GetParameter(2));
       }
       else
       {
-        pedestals->push_back(hADC[ch]->GetMean());
-        rsigma->push_back(hADC[ch]->GetRMS());
-        gr->SetPoint(ch, ch, hADC[ch]->GetMean());
-        gr2->SetPoint(ch, ch, hADC[ch]->GetRMS());
+        cal.pedestals.push_back(cal.adc_moments.GetMean(ch));
+        cal.rsigma.push_back(cal.adc_moments.GetRMS(ch));
       }
     }
     else
     {
-      pedestals->push_back(0);
-      rsigma->push_back(0);
-      gr->SetPoint(ch, ch, 0);
-      gr2->SetPoint(ch, ch, 0);
+      cal.pedestals.push_back(0);
+      cal.rsigma.push_back(0);
+    }
+  }
+  if (check_fastfit)
+  {
+    cal.fastfit_pedestals.swap(counts_pedestals);
+    cal.fastfit_rsigma.swap(counts_rsigma);
+  }
+}
+
+// Largest differences of the fast fit from the fit, and channels beyond the tolerance
+void compare_fastfit(const detector_calibration &cal, const std::vector<double> &fit_sigmas)
+{
+  double worst_pedestal = 0;
+  double worst_rsigma = 0;
+  double worst_sigma = 0;
+  int beyond = 0;
+  for (int ch = 0; ch < cal.channels; ch++)
+  {
+    double pedestal_error = 0;
+    double rsigma_error = 0;
+    double sigma_error = 0;
+    double n = cal.adc_moments.GetEntries(ch);
+    double rsigma = std::fabs(cal.rsigma[ch]);
+    if (n > 0 && rsigma > 0)
+    {
+      pedestal_error = std::fabs(cal.fastfit_pedestals[ch] - cal.pedestals[ch]) / (rsigma / std::sqrt(n));
+      rsigma_error = std::fabs(cal.fastfit_rsigma[ch] - rsigma) / (rsigma / std::sqrt(2 * n));
+    }
+    n = cal.cn_moments.GetEntries(ch);
+    double sigma = std::fabs(fit_sigmas[ch]);
+    if (n > 0 && sigma > 0)
+    {
+      sigma_error = std::fabs(cal.sigmas[ch] - sigma) / (sigma / std::sqrt(2 * n));
+    }
+    worst_pedestal = std::max(worst_pedestal, pedestal_error);
+    worst_rsigma = std::max(worst_rsigma, rsigma_error);
+    worst_sigma = std::max(worst_sigma, sigma_error);
+    if (pedestal_error > fastfit_mean_tolerance || rsigma_error > fastfit_sigma_tolerance || sigma_error > fastfit_sigma_tolerance)
+    {
+      beyond++;
+    }
+  }
+  std::cout << "\tFast fit vs fit, largest differences in statistical errors:" << std::endl;
+  std::cout << Form("\tpedestal %.2f \t raw sigma %.2f \t sigma %.2f", worst_pedestal, worst_rsigma, worst_sigma) << std::endl;
+  std::cout << "\t" << beyond << " channel(s) beyond the tolerance (" << fastfit_mean_tolerance << " for pedestals, " << fastfit_sigma_tolerance << " for sigmas)" << std::endl;
+}
+
+// Places the ADC count table of each channel around the median of its values in the entries of the pedestal
+// phase from begin on, within the ADC range. False if an entry can't be read.
+bool place_adc_tables(RawEventReader &reader, std::vector<detector_calibration> &calibrations, Long64_t begin)
+{
+  for (detector_calibration &cal : calibrations)
+  {
+    std::vector<std::vector<int>> values(cal.channels);
+    Long64_t end = std::min<Long64_t>(cal.entries / 2, begin + adc_window_entries);
+    for (Long64_t entry = begin; entry < end; entry++)
+    {
+      if (!reader.GetEntry(entry, cal.detector))
+      {
+        std::cout << "ERROR: can't read entry " << entry << " of detector " << cal.detector << std::endl;
+        return false;
+      }
+      const std::vector<unsigned int> &raw_event = reader.GetData(cal.detector);
+      if ((int)raw_event.size() != cal.channels)
+      {
+        continue;
+      }
+      for (int ch = 0; ch < cal.channels; ch++)
+      {
+        values[ch].push_back(raw_event[ch]);
+      }
+    }
+    cal.adc_counts_min.assign(cal.channels, -0.5);
+    for (int ch = 0; ch < cal.channels; ch++)
+    {
+      if (values[ch].empty())
+      {
+        continue;
+      }
+      std::nth_element(values[ch].begin(), values[ch].begin() + values[ch].size() / 2, values[ch].end());
+      int first = std::min(values[ch][values[ch].size() / 2] - adc_counts_bins / 2, adc_range - adc_counts_bins);
+      cal.adc_counts_min[ch] = std::max(first, 0) - 0.5;
     }
   }
+  return true;
+}
 
-  mean_pedestal = std::accumulate(pedestals->begin(), pedestals->end(), 0.0) / pedestals->size();
+// The single pass over the run: the first half of the entries of all the detectors for pedestals and raw
+// sigmas, then the second half for the sigmas. Only the detectors being calibrated are read.
+// False if the run can't be read.
+bool fill_calibration(const std::vector<RawEventReader *> &readers, std::vector<detector_calibration> &calibrations, calibration_estimator estimator, double clip, bool check_fastfit, int every)
+{
+  bool fit = estimator == fit_estimator;
+  bool tables = uses_counts(estimator) || check_fastfit;
+  Long64_t pedestal_end = 0;
+  Long64_t signal_begin = -1;
+  Long64_t signal_end = 0;
+  for (const detector_calibration &cal : calibrations)
+  {
+    pedestal_end = std::max(pedestal_end, cal.entries / 2);
+    signal_begin = signal_begin < 0 ? cal.entries / 2 : std::min(signal_begin, cal.entries / 2);
+    signal_end = std::max(signal_end, cal.entries);
+  }
+
+  // the first event is skipped
+  if (tables && !place_adc_tables(*readers[0], calibrations, 1))
+  {
+    return false;
+  }
+  if (!run_phase(readers, calibrations, pedestal_phase, 1, pedestal_end, every, fit, tables))
+  {
+    return false;
+  }
+
+  for (detector_calibration &cal : calibrations)
+  {
+    compute_pedestals(cal, estimator, clip, readers.size(), check_fastfit);
+    cal.adc_counts = ChannelCounts();
+  }
+
+  if (!run_phase(readers, calibrations, signal_phase, std::max<Long64_t>(signal_begin, 0), signal_end, every, fit, tables))
+  {
+    return false;
+  }
+
+  for (detector_calibration &cal : calibrations)
+  {
+    if (!tables)
+    {
+      continue;
+    }
+    std::vector<double> centers;
+    estimate_channels(cal.cn_counts, check_fastfit ? fastfit_estimator : estimator, clip, readers.size(), centers, cal.sigmas);
+    report_outside(cal, cal.cn_counts, Form("CN-subtracted values beyond %g ADC", cn_range));
+    cal.cn_counts = ChannelCounts();
+  }
+  return true;
+}
+
+// Sigmas, .cal file, plots and PDF page of a detector, after the pass over the run
+int finish_calibration(detector_calibration &cal, TString output_filename, TCanvas &c1, float sigmaraw_cut, float sigma_cut, bool pdf_only, calibration_estimator estimator, bool check_fastfit, bool single_file, int max_ADC)
+{
+  TFile *foutput;
+  if (!pdf_only)
+  {
+    TString root_filename;
+    if (!single_file)
+    {
+      root_filename = output_filename + "_board-" + cal.board + "_side-" + cal.side + ".root";
+    }
+    else
+    {
+      root_filename = output_filename + ".root";
+    }
+    foutput = new TFile(root_filename.Data(), "UPDATE");
+    foutput->cd();
+  }
+
+  int board = cal.label_board;
+  int side = cal.label_side;
+  int NChannels = cal.channels;
+  int NVas = NChannels / 64;
+
+  TF1 *fittedgaus = nullptr;
+
+  TGraph *gr = new TGraph(NChannels);
+  gr->SetName((TString) "Pedestals" + "_board-" + cal.board + "_side-" + cal.side);
+  gr->SetTitle("Pedestals");
+
+  TGraph *gr2 = new TGraph(NChannels);
+  gr2->SetName((TString) "RawSigma" + "_board-" + cal.board + "_side-" + cal.side);
+  gr2->SetTitle("Raw Sigmas");
+  gr2->GetXaxis()->SetTitle("channel");
+  gr2->GetXaxis()->SetLimits(0, NChannels);
+
+  TGraph *gr3 = new TGraph(NChannels);
+  gr3->SetName((TString) "Sigma" + "_board-" + cal.board + "_side-" + cal.side);
+  gr3->SetTitle("Sigmas");
+  gr3->GetXaxis()->SetTitle("channel");
+  gr3->GetXaxis()->SetLimits(0, NChannels);
+
+  float mean_pedestal = 0;
+  float rms_pedestal = 0;
+  float mean_rsigma = 0;
+  float rms_rsigma = 0;
+  std::vector<float> sigma;
+  float mean_sigma = 0;
+  float rms_sigma = 0;
+  float max_sigma = 0;
+
+  ofstream calfile;
+  if (!pdf_only)
+  {
+    if (!single_file)
+    {
+      calfile.open(output_filename + "_board-" + Form("%d", board) + "_side-" + Form("%d", side) + ".cal");
+    }
+    else
+    {
+      calfile.open(output_filename + ".cal", std::ofstream::out | std::ofstream::app);
+    }
+    calfile << cal.header;
+  }
+
+  if (cal.entries == 0)
+  {
+    return -1;
+  }
+
+  for (int ch = 0; ch < NChannels; ch++)
+  {
+    gr->SetPoint(ch, ch, cal.pedestals.at(ch));
+    gr2->SetPoint(ch, ch, cal.rsigma.at(ch));
+  }
+
+  mean_pedestal = std::accumulate(cal.pedestals.begin(), cal.pedestals.end(), 0.0) / cal.pedestals.size();
 
   float num_ped = 0;
-  for (int i = 0; i < pedestals->size(); i++)
+  for (int i = 0; i < cal.pedestals.size(); i++)
   {
-    num_ped += pow(pedestals->at(i) - mean_pedestal, 2);
+    num_ped += pow(cal.pedestals.at(i) - mean_pedestal, 2);
   }
-  rms_pedestal = std::sqrt(num_ped / pedestals->size());
+  rms_pedestal = std::sqrt(num_ped / cal.pedestals.size());
 
-  mean_rsigma = std::accumulate(rsigma->begin(), rsigma->end(), 0.0) / rsigma->size();
+  mean_rsigma = std::accumulate(cal.rsigma.begin(), cal.rsigma.end(), 0.0) / cal.rsigma.size();
   float num_rsigma = 0;
-  for (int i = 0; i < rsigma->size(); i++)
+  for (int i = 0; i < cal.rsigma.size(); i++)
   {
-    num_rsigma += pow(rsigma->at(i) - mean_rsigma, 2);
+    num_rsigma += pow(cal.rsigma.at(i) - mean_rsigma, 2);
   }
-  rms_rsigma = std::sqrt(num_rsigma / rsigma->size());
+  rms_rsigma = std::sqrt(num_rsigma / cal.rsigma.size());
 
   gr->GetXaxis()->SetTitle("channel");
   TAxis *axis = gr->GetXaxis();
@@ -302,56 +845,40 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
   gr2->SetMarkerSize(0.8);
   gr2->Draw("AL*");
 
-  // Like before, but this time we correct for common noise
-  for (int index_event = entries / 2; index_event < entries; index_event++)
-  {
-    chain.GetEntry(index_event);
-
-    if (raw_event->size() == pedestals->size())
-    {
-      // Pedestal subtraction
-      std::vector<float> signal;
-      std::transform(raw_event->begin(), raw_event->end(), pedestals->begin(), std::back_inserter(signal), [&](double raw, double ped)
-                     { return raw - ped; });
-
-      // Chip-wise CN subtraction before filling the histos
-      for (int va = 0; va < NVas; va++) // Loop on VA
-      {
-        float cn = GetCN(&signal, va, 0);
-        if (cn != -999)
-        {
-          for (int va_chan = 0; va_chan < 64; va_chan++)
-          {
-            if (signal.size() == NChannels)
-            {
-              {
-                hSignal[64 * va + va_chan]->Fill(signal.at(64 * va + va_chan));
-                hCN[64 * va + va_chan]->Fill(signal.at(64 * va + va_chan) - cn);
-              }
-            }
-          }
-        }
-      }
-    }
-  }
-
   // Fitting with gaus to compute sigmas
   int va_chan = 0;
   double sigma_value;
+  std::vector<double> fit_sigmas(NChannels, 0);
 
   for (int ch = 0; ch < NChannels; ch++)
   {
     bool badchan = false;
-    if (hCN[ch]->GetEntries())
+    double counts_sigma = 0;
+    if (cal.cn_moments.GetEntries(ch))
     {
-      if (fit)
+      if (uses_counts(estimator))
       {
-        hCN[ch]->Fit("gaus", "QS");
-        fittedgaus = (TF1 *)hCN[ch]->GetListOfFunctions()->FindObject("gaus");
+        counts_sigma = cal.sigmas.at(ch);
+        gr3->SetPoint(ch, ch, counts_sigma);
+        sigma.push_back(counts_sigma);
+        // Flag for channels that are too noisy or dead
+        if (cal.rsigma.at(ch) < 1.5 || cal.rsigma.at(ch) > sigmaraw_cut)
+        {
+          if (counts_sigma < 1 || counts_sigma > sigma_cut)
+          {
+            badchan = true;
+          }
+        }
+      }
+      else if (estimator == fit_estimator)
+      {
+        cal.hCN[ch]->Fit("gaus", "QS");
+        fittedgaus = (TF1 *)cal.hCN[ch]->GetListOfFunctions()->FindObject("gaus");
+        fit_sigmas[ch] = fittedgaus->GetParameter(2);
         gr3->SetPoint(ch, ch, fittedgaus->GetParameter(2));
-        sigma->push_back(fittedgaus->GetParameter(2));
+        sigma.push_back(fittedgaus->GetParameter(2));
         // Flag for channels that are too noisy or dead
-        if (rsigma->at(ch) < 1.5 || rsigma->at(ch) > sigmaraw_cut)
+        if (cal.rsigma.at(ch) < 1.5 || cal.rsigma.at(ch) > sigmaraw_cut)
         {
           if (fittedgaus->GetParameter(2) < 1 || fittedgaus->GetParameter(2) > sigma_cut)
           {
@@ -361,12 +888,12 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
       }
       else
       {
-        gr3->SetPoint(ch, ch, hCN[ch]->GetRMS());
-        sigma->push_back(hCN[ch]->GetRMS());
+        gr3->SetPoint(ch, ch, cal.cn_moments.GetRMS(ch));
+        sigma.push_back(cal.cn_moments.GetRMS(ch));
         // Flag for channels that are too noisy or dead
-        if (rsigma->at(ch) < 1.5 || rsigma->at(ch) > sigmaraw_cut)
+        if (cal.rsigma.at(ch) < 1.5 || cal.rsigma.at(ch) > sigmaraw_cut)
         {
-          if (hCN[ch]->GetRMS() < 1 || hCN[ch]->GetRMS() > sigma_cut)
+          if (cal.cn_moments.GetRMS(ch) < 1 || cal.cn_moments.GetRMS(ch) > sigma_cut)
           {
             badchan = true;
           }
@@ -376,24 +903,27 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
     else
     {
       gr3->SetPoint(ch, ch, 0);
-      rsigma->push_back(0);
       badchan = true;
     }
 
     if (!pdf_only)
     {
-      if (fit)
+      if (uses_counts(estimator))
       {
-        sigma_value = fittedgaus->GetParameter(2);
+        sigma_value = counts_sigma;
+      }
+      else if (estimator == fit_estimator)
+      {
+        sigma_value = fittedgaus ? fittedgaus->GetParameter(2) : 0;
       }
       else
       {
-        sigma_value = hCN[ch]->GetRMS();
+        sigma_value = cal.cn_moments.GetRMS(ch);
       }
       // Writing info in .cal file (should be backwards-compatible with miniTRB tools)
       calfile << ch << ", " << ch / 64 << ", "
               << va_chan
-              << ", " << pedestals->at(ch) << ", " << rsigma->at(ch) << ", "
+              << ", " << cal.pedestals.at(ch) << ", " << cal.rsigma.at(ch) << ", "
               << sigma_value
               << ", "
               << badchan
@@ -407,12 +937,17 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
       }
     }
   }
-  mean_sigma = std::accumulate(sigma->begin(), sigma->end(), 0.0) / sigma->size();
-  rms_sigma = std::sqrt(std::inner_product(sigma->begin(), sigma->end(), sigma->begin(), 0.0) / sigma->size());
+  if (check_fastfit)
+  {
+    compare_fastfit(cal, fit_sigmas);
+  }
+
+  mean_sigma = std::accumulate(sigma.begin(), sigma.end(), 0.0) / sigma.size();
+  rms_sigma = std::sqrt(std::inner_product(sigma.begin(), sigma.end(), sigma.begin(), 0.0) / sigma.size());
 
   if (!std::isnan(mean_sigma))
   {
-    max_sigma = *std::max_element(sigma->begin(), sigma->end());
+    max_sigma = *std::max_element(sigma.begin(), sigma.end());
   }
   else
   {
@@ -420,11 +955,11 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
   }
 
   float num_sigma = 0;
-  for (int i = 0; i < sigma->size(); i++)
+  for (int i = 0; i < sigma.size(); i++)
   {
-    num_sigma += pow(sigma->at(i) - mean_sigma, 2);
+    num_sigma += pow(sigma.at(i) - mean_sigma, 2);
   }
-  rms_sigma = std::sqrt(num_sigma / sigma->size());
+  rms_sigma = std::sqrt(num_sigma / sigma.size());
 
   TAxis *axis3 = gr3->GetXaxis();
   axis3->SetLimits(0, NChannels);
@@ -450,12 +985,12 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
   pt->AddText(Form("Board: %i \t Side: %i", board, side));
   pt->Draw();
 
-  if (board == 0 && !last_board)
+  if (board == 0 && !cal.last_board)
   {
     c1.SetGrid();
     c1.Print(output_filename + ".pdf(", "pdf");
   }
-  else if (last_board)
+  else if (cal.last_board)
   {
     c1.Print(output_filename + ".pdf)", "pdf");
   }
@@ -478,6 +1013,14 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1, flo
     foutput->Close();
   }
 
+  for (int ch = 0; ch < (int)cal.hADC.size(); ch++)
+  {
+    delete cal.hADC[ch];
+    delete cal.hCN[ch];
+  }
+  cal.hADC.clear();
+  cal.hCN.clear();
+
   return 0;
 }
 
@@ -487,7 +1030,9 @@ int main(int argc, char *argv[])
   bool verb = false;
   bool pdf_only = false;
   bool fast_mode = false;
-  bool fit_mode = false;
+  calibration_estimator estimator = moments_estimator;
+  double clip = 3;
+  bool check_fastfit = false;
   bool single_file = true;
   int max_ADC = -1;
 
@@ -515,7 +1060,13 @@ int main(int argc, char *argv[])
   opt->addUsage("  --fast           ................................. no info prompt");
   opt->addUsage("  --minitrb        ................................. For files acquired with the miniTRB");
   opt->addUsage("  --fit            ................................. Compute calibration parameters with gaussian fits");
+  opt->addUsage("  --fastfit        ................................. Closed-form fits of the gaussian core on --threads threads, not Minuit: with --fit, both run and are compared");
+  opt->addUsage("  --robust         ................................. Compute calibration parameters as median and MAD of the ADC counts, not pulled by signal");
+  opt->addUsage("  --clip           ................................. Compute calibration parameters as mean and RMS within this number of sigmas (e.g. 3)");
   opt->addUsage("  --max_ADC        ................................. Maximum ADC value for noise plots");
+  opt->addUsage("  --threads        ................................. Number of threads reading the run (default: 1), the result is the same. With --robust, --clip or --fastfit each thread keeps count tables of all the detectors: about 2.7 MB per detector of 384 channels");
+  opt->addUsage("  --every          ................................. Quick look: use only one event every N");
+  opt->addUsage("  --sample_fraction ................................ Quick look: use only about this fraction (0, 1] of the events");
   opt->setFlag("help", 'h');
   opt->setFlag("minitrb");
   opt->setFlag("verbose", 'v');
@@ -523,8 +1074,14 @@ int main(int argc, char *argv[])
   opt->setFlag("pdf");
   opt->setFlag("fast");
   opt->setFlag("fit");
+  opt->setFlag("fastfit");
+  opt->setFlag("robust");
   opt->setFlag("dune");
   opt->setOption("max_ADC");
+  opt->setOption("clip");
+  opt->setOption("threads");
+  opt->setOption("every");
+  opt->setOption("sample_fraction");
 
   opt->setOption("output");
   opt->setOption("cn");
@@ -585,8 +1142,34 @@ int main(int argc, char *argv[])
 
   if (opt->getFlag("fit"))
   {
-    fit_mode = true;
+    estimator = fit_estimator;
     std::cout << "\nUsing Gaussian fits to compute calibrations" << std::endl;
+    if (opt->getFlag("fastfit"))
+    {
+      check_fastfit = true;
+      std::cout << "\nThe fast fits will be compared with the Gaussian fits" << std::endl;
+    }
+  }
+  else if (opt->getFlag("fastfit"))
+  {
+    estimator = fastfit_estimator;
+    std::cout << "\nUsing closed-form fits of the gaussian core to compute calibrations" << std::endl;
+  }
+  else if (opt->getFlag("robust"))
+  {
+    estimator = median_estimator;
+    std::cout << "\nUsing median and MAD to compute calibrations" << std::endl;
+  }
+  else if (opt->getValue("clip"))
+  {
+    estimator = clipped_estimator;
+    clip = atof(opt->getValue("clip"));
+    if (!(clip > 0))
+    {
+      std::cout << "Error: the clipping must be a positive number of sigmas" << std::endl;
+      return 2;
+    }
+    std::cout << "\nUsing mean and RMS within " << clip << " sigmas to compute calibrations" << std::endl;
   }
 
   // Create output .cal file
@@ -604,16 +1187,78 @@ int main(int argc, char *argv[])
   if (opt->getValue("max_ADC"))
     max_ADC = atoi(opt->getValue("max_ADC"));
 
+  int every = 1;
+  if (opt->getValue("every"))
+  {
+    every = std::max(1, atoi(opt->getValue("every")));
+  }
+  else if (opt->getValue("sample_fraction"))
+  {
+    every = sampling_step(atof(opt->getValue("sample_fraction")));
+    if (every == 0)
+    {
+      std::cout << "Error: the sample fraction must be in (0, 1]" << std::endl;
+      return 2;
+    }
+  }
+  if (every > 1)
+  {
+    std::cout << "\nQuick look: one event every " << every << " will be used" << std::endl;
+  }
+
+  int threads = 1;
+  if (opt->getValue("threads"))
+  {
+    threads = std::max(1, atoi(opt->getValue("threads")));
+    std::cout << "\nReading the run with " << threads << " threads" << std::endl;
+  }
+  if (threads > 1)
+  {
+    ROOT::EnableThreadSafety();
+  }
+
   int detectors = 0;
   int detector_num = 0;
   int ladder_side = 0;
 
-  // Join ROOTfiles in a single chain
-  TChain *chain = new TChain("raw_events"); // Chain input rootfiles
+  // Join ROOTfiles in a single run
+  RawEventReader reader;
   for (int ii = 0; ii < opt->getArgc(); ii++)
   {
     std::cout << "\nAdding file " << opt->getArgv(ii) << " to the chain..." << std::endl;
-    chain->Add(opt->getArgv(ii));
+    if (!reader.Add(opt->getArgv(ii)))
+    {
+      std::cout << "Error: can't add " << opt->getArgv(ii) << " to the run" << std::endl;
+      return 2;
+    }
+  }
+
+  // every thread reads the run on its own, and must see the same run
+  std::vector<RawEventReader *> readers = {&reader};
+  std::vector<std::unique_ptr<RawEventReader>> thread_readers;
+  for (int t = 1; t < threads; t++)
+  {
+    thread_readers.emplace_back(new RawEventReader);
+    RawEventReader &thread_reader = *thread_readers.back();
+    for (int ii = 0; ii < opt->getArgc(); ii++)
+    {
+      if (!thread_reader.Add(opt->getArgv(ii)))
+      {
+        std::cout << "Error: thread " << t << " can't add " << opt->getArgv(ii) << " to the run" << std::endl;
+        return 2;
+      }
+    }
+    bool same = thread_reader.GetDetectors() == reader.GetDetectors();
+    for (int det = 0; same && det < reader.GetDetectors(); det++)
+    {
+      same = thread_reader.GetEntries(det) == reader.GetEntries(det);
+    }
+    if (!same)
+    {
+      std::cout << "Error: thread " << t << " doesn't see the same run" << std::endl;
+      return 2;
+    }
+    readers.push_back(&thread_reader);
   }
 
   if (single_file && std::ifstream(output_filename + ".cal"))
@@ -624,61 +1269,51 @@ int main(int argc, char *argv[])
   TCanvas *c1 = new TCanvas("calibration", "Canvas", 1920, 1080);
   c1->Divide(2, 2);
 
-  TFile tempfile(opt->getArgv(0));
-  TIter list(tempfile.GetListOfKeys());
-  TKey *key;
-  while ((key = (TKey *)list()))
-  {
-    if (!strcmp(key->GetClassName(), "TTree"))
-    {
-      detectors++;
-    }
-  }
+  detectors = reader.GetDetectors();
   std::cout << "File with " << detectors << " detector(s)" << std::endl;
   if (detectors == 1)
     newDAQ = false;
 
+  // Detectors to calibrate, in the order of the .cal file and of the PDF pages
+  std::vector<detector_calibration> calibrations;
   if (!newDAQ)
   {
-    compute_calibration(*chain, output_filename, *c1, sigmaraw_cut, sigma_cut, 0, 0, pdf_only, fast_mode, fit_mode, single_file, true, max_ADC, dune);
+    calibrations.resize(1);
+    calibrations[0].last_board = true;
   }
   else
   {
     std::cout << "\nNEW DAQ FILE" << std::endl;
 
-    TTree *T;
-    TIter list2(tempfile.GetListOfKeys());
-    while ((key = (TKey *)list2()))
+    calibrations.resize(detectors);
+    for (detector_num = 0; detector_num < detectors; detector_num++)
     {
-      if (!strcmp(key->GetClassName(), "TTree"))
-      {
-        TChain *chain2 = new TChain(key->GetName());
+      ladder_side = detector_num % 2;
+      calibrations[detector_num].board = detector_num / 2;
+      calibrations[detector_num].side = ladder_side;
+      calibrations[detector_num].last_board = detector_num / 2 == detectors / 2 - 1 && ladder_side == 1;
+    }
+  }
 
-        for (int ii = 0; ii < opt->getArgc(); ii++)
-        {
-          chain2->Add(opt->getArgv(ii));
-        }
-        if (detector_num / 2 == detectors / 2 - 1 && ladder_side == 1)
-        {
-          compute_calibration(*chain2, output_filename, *c1, sigmaraw_cut, sigma_cut, detector_num / 2, ladder_side, pdf_only, fast_mode, fit_mode, single_file, true, max_ADC, dune);
-        }
-        else
-        {
-          compute_calibration(*chain2, output_filename, *c1, sigmaraw_cut, sigma_cut, detector_num / 2, ladder_side, pdf_only, fast_mode, fit_mode, single_file, false, max_ADC, dune);
-        }
-        detector_num++;
-        if (ladder_side == 0)
-        {
-          ladder_side = 1;
-        }
-        else
-        {
-          ladder_side = 0;
-        }
-      }
+  for (detector_calibration &cal : calibrations)
+  {
+    if (!begin_calibration(reader, cal, sigmaraw_cut, sigma_cut, pdf_only, fast_mode, estimator, dune))
+    {
+      std::cout << "Error: can't calibrate board " << cal.board << " side " << cal.side << std::endl;
+      return 2;
     }
+  }
+
+  // a single pass over the run for all the detectors
+  if (!fill_calibration(readers, calibrations, estimator, clip, check_fastfit, every))
+  {
+    std::cout << "Error: can't read the run, no calibration written" << std::endl;
+    return 2;
+  }
 
-    tempfile.Close();
+  for (detector_calibration &cal : calibrations)
+  {
+    finish_calibration(cal, output_filename, *c1, sigmaraw_cut, sigma_cut, pdf_only, estimator, check_fastfit, single_file, max_ADC);
   }
 
   return 0;
@@ -0,0 +1,274 @@
+#include "channelStats.h"
+
+#include <algorithm>
+#include <cmath>
+
+void ChannelMoments::Reset(int channels, double _min, double _max)
+{
+  min = _min;
+  max = _max;
+  entries.assign(channels, 0);
+  n.assign(channels, 0);
+  mean.assign(channels, 0);
+  m2.assign(channels, 0);
+}
+
+// Chan et al. update for the union of two sets of values
+void ChannelMoments::Merge(const ChannelMoments &other)
+{
+  for (size_t ch = 0; ch < entries.size(); ch++)
+  {
+    entries[ch] += other.entries[ch];
+    if (other.n[ch] == 0)
+    {
+      continue;
+    }
+    uint64_t count = n[ch] + other.n[ch];
+    double delta = other.mean[ch] - mean[ch];
+    mean[ch] += delta * other.n[ch] / count;
+    m2[ch] += other.m2[ch] + delta * delta * n[ch] / count * other.n[ch];
+    n[ch] = count;
+  }
+}
+
+double ChannelMoments::GetRMS(int channel) const
+{
+  return n[channel] ? std::sqrt(m2[channel] / n[channel]) : 0;
+}
+
+void ChannelCounts::Reset(const std::vector<double> &_mins, double _width, int _bins)
+{
+  channels = _mins.size();
+  mins = _mins;
+  width = _width;
+  bins = _bins;
+  counts.assign((size_t)channels * bins, 0);
+  outside.assign(channels, 0);
+}
+
+void ChannelCounts::Add(const ChannelCounts &other)
+{
+  for (size_t i = 0; i < counts.size(); i++)
+  {
+    counts[i] += other.counts[i];
+  }
+  for (int ch = 0; ch < channels; ch++)
+  {
+    outside[ch] += other.outside[ch];
+  }
+}
+
+uint64_t ChannelCounts::GetEntries(int channel) const
+{
+  const uint32_t *table = &counts[(size_t)channel * bins];
+  uint64_t total = 0;
+  for (int b = 0; b < bins; b++)
+  {
+    total += table[b];
+  }
+  return total;
+}
+
+void ChannelCounts::Cumulative(int channel, std::vector<uint64_t> &below) const
+{
+  const uint32_t *table = &counts[(size_t)channel * bins];
+  below.resize(bins + 1);
+  below[0] = 0;
+  for (int b = 0; b < bins; b++)
+  {
+    below[b + 1] = below[b] + table[b];
+  }
+}
+
+double ChannelCounts::Below(int channel, const std::vector<uint64_t> &below, double x) const
+{
+  double t = (x - mins[channel]) / width;
+  if (t <= 0)
+  {
+    return 0;
+  }
+  if (t >= bins)
+  {
+    return below[bins];
+  }
+  int b = (int)t;
+  return below[b] + (t - b) * counts[(size_t)channel * bins + b];
+}
+
+double ChannelCounts::GetQuantile(int channel, double q) const
+{
+  std::vector<uint64_t> below;
+  Cumulative(channel, below);
+  if (below[bins] == 0)
+  {
+    return 0;
+  }
+  double target = q * below[bins];
+  int b = 0;
+  while (b < bins - 1 && (below[b + 1] < target || below[b + 1] == below[b]))
+  {
+    b++;
+  }
+  double inside = below[b + 1] - below[b];
+  return mins[channel] + (b + (inside ? (target - below[b]) / inside : 0.5)) * width;
+}
+
+// The fraction of the values within d from the median grows with d: bisection down to a small fraction
+// of a bin
+double ChannelCounts::GetMAD(int channel) const
+{
+  std::vector<uint64_t> below;
+  Cumulative(channel, below);
+  if (below[bins] == 0)
+  {
+    return 0;
+  }
+  double median = GetQuantile(channel, 0.5);
+  double target = 0.5 * below[bins];
+  double low = 0;
+  double high = bins * width;
+  while (high - low > 1e-6 * width)
+  {
+    double d = 0.5 * (low + high);
+    if (Below(channel, below, median + d) - Below(channel, below, median - d) < target)
+    {
+      low = d;
+    }
+    else
+    {
+      high = d;
+    }
+  }
+  return 0.5 * (low + high);
+}
+
+// Values are taken at the center of their bin, exact for integers in bins of width 1
+void ChannelCounts::GetClipped(int channel, double k, double &mean, double &sigma) const
+{
+  const uint32_t *table = &counts[(size_t)channel * bins];
+  mean = GetMedian(channel);
+  sigma = 1.4826 * GetMAD(channel);
+  for (int iteration = 0; iteration < 100 && sigma > 0; iteration++)
+  {
+    double n = 0, sum = 0, sum2 = 0;
+    for (int b = 0; b < bins; b++)
+    {
+      double x = mins[channel] + (b + 0.5) * width;
+      if (table[b] && std::fabs(x - mean) <= k * sigma)
+      {
+        n += table[b];
+        sum += table[b] * x;
+        sum2 += table[b] * x * x;
+      }
+    }
+    if (n == 0)
+    {
+      break;
+    }
+    double next_mean = sum / n;
+    double next_sigma = std::sqrt(std::max(0.0, sum2 / n - next_mean * next_mean));
+    bool same = std::fabs(next_mean - mean) < 1e-9 * width && std::fabs(next_sigma - sigma) < 1e-9 * width;
+    mean = next_mean;
+    sigma = next_sigma;
+    if (same)
+    {
+      break;
+    }
+  }
+}
+
+// Least squares with weights equal to the expected counts, as the variance of log(counts) is about 1 / counts:
+// the counts themselves the first time, then the parabola of the previous iteration (Guo), so that fluctuations
+// don't weigh themselves. Positions are taken in bins from the mode. The window follows mean and sigma until
+// they don't change.
+void ChannelCounts::GetGaussianCore(int channel, double &mean, double &sigma) const
+{
+  mean = GetMedian(channel);
+  sigma = 1.4826 * GetMAD(channel);
+  if (bins == 0)
+  {
+    return;
+  }
+  const uint32_t *table = &counts[(size_t)channel * bins];
+  int mode = std::max_element(table, table + bins) - table;
+  if (table[mode] == 0)
+  {
+    return;
+  }
+
+  double center = mode;
+  double spread = std::max(sigma / width, 1.0);
+  double c[3] = {0, 0, 0}; // log(counts) = c0 + c1 t + c2 t^2
+  bool fitted = false;
+  for (int iteration = 0; iteration < 50; iteration++)
+  {
+    int begin = (int)std::max(0.0, std::floor(center - 3 * spread));
+    int end = (int)std::min(bins - 1.0, std::ceil(center + 3 * spread));
+    // a parabola needs at least 3 bins that are not empty
+    for (;;)
+    {
+      int filled = 0;
+      for (int b = begin; b <= end; b++)
+      {
+        filled += table[b] > 0;
+      }
+      if (filled >= 3 || (begin == 0 && end == bins - 1))
+      {
+        break;
+      }
+      begin = std::max(0, begin - 1);
+      end = std::min(bins - 1, end + 1);
+    }
+
+    double s[5] = {0, 0, 0, 0, 0}; // sums of w t^k
+    double r[3] = {0, 0, 0};       // sums of w log(counts) t^k
+    for (int b = begin; b <= end; b++)
+    {
+      if (table[b] == 0)
+      {
+        continue;
+      }
+      double t = b - mode;
+      double w = fitted ? std::exp(c[0] + c[1] * t + c[2] * t * t) : table[b];
+      double y = std::log(table[b]);
+      double tk = 1;
+      for (int k = 0; k < 5; k++)
+      {
+        s[k] += w * tk;
+        if (k < 3)
+        {
+          r[k] += w * y * tk;
+        }
+        tk *= t;
+      }
+    }
+    // normal equations, by Cramer's rule
+    double det = s[0] * (s[2] * s[4] - s[3] * s[3]) - s[1] * (s[1] * s[4] - s[3] * s[2]) + s[2] * (s[1] * s[3] - s[2] * s[2]);
+    if (det == 0)
+    {
+      break;
+    }
+    double c0 = (r[0] * (s[2] * s[4] - s[3] * s[3]) - s[1] * (r[1] * s[4] - s[3] * r[2]) + s[2] * (r[1] * s[3] - s[2] * r[2])) / det;
+    double c1 = (s[0] * (r[1] * s[4] - s[3] * r[2]) - r[0] * (s[1] * s[4] - s[3] * s[2]) + s[2] * (s[1] * r[2] - r[1] * s[2])) / det;
+    double c2 = (s[0] * (s[2] * r[2] - r[1] * s[3]) - s[1] * (s[1] * r[2] - r[1] * s[2]) + r[0] * (s[1] * s[3] - s[2] * s[2])) / det;
+    if (!(c2 < 0))
+    {
+      break;
+    }
+    double next_center = mode - c1 / (2 * c2);
+    double next_spread = std::sqrt(-1 / (2 * c2));
+    bool same = fitted && std::fabs(next_center - center) < 1e-6 && std::fabs(next_spread - spread) < 1e-6;
+    c[0] = c0;
+    c[1] = c1;
+    c[2] = c2;
+    center = next_center;
+    spread = next_spread;
+    fitted = true;
+    mean = mins[channel] + (center + 0.5) * width;
+    sigma = spread * width;
+    if (same)
+    {
+      break;
+    }
+  }
+}
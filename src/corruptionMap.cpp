@@ -0,0 +1,409 @@
+#include "corruptionMap.h"
+#include "eventIndex.h"
+#include "PAPERO_kernels.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+// Layout of the sidecar, native (little endian) byte order:
+//   header (128 bytes): magic, version, boards, raw file size, raw mtime (s, ns), regions, complete events,
+//   broken events, missing footers, bytes of each type (events, padding, footer, garbage), reserved
+//   regions, 24 bytes each: begin, end, type, events
+static const char map_magic[8] = {'P', 'A', 'P', 'E', 'M', 'A', 'P', '\0'};
+static const uint32_t map_version = 1;
+static const uint64_t map_header_size = 128;
+static const uint64_t region_record_size = 24;
+static const uint64_t scan_chunk = 1 << 20; // bytes handed to the sync word scanner at once
+
+template <typename T>
+static void put(unsigned char *buffer, uint64_t position, T value)
+{
+  memcpy(buffer + position, &value, sizeof(T));
+}
+
+template <typename T>
+static T get(const unsigned char *buffer, uint64_t position)
+{
+  T value;
+  memcpy(&value, buffer + position, sizeof(T));
+  return value;
+}
+
+static uint32_t word_le(const unsigned char *buffer)
+{
+  return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+static bool is_word(RawFile &file, uint64_t offset, const unsigned char pattern[4])
+{
+  const unsigned char *buffer = file.GetData(offset, 4);
+  return buffer && memcmp(buffer, pattern, 4) == 0;
+}
+
+// Offset of the first word equal to pattern from offset on, moving by 4 bytes: the end of the file if there is none
+static uint64_t find_word(RawFile &file, uint64_t offset, const unsigned char pattern[4])
+{
+  while (true)
+  {
+    uint64_t available = file.Available(offset, scan_chunk);
+    uint64_t nwords = available / 4;
+    if (nwords == 0)
+    {
+      return offset + available;
+    }
+    uint64_t index = find_sync_word(file.GetData(offset, nwords * 4), nwords, pattern);
+    if (index < nwords)
+    {
+      return offset + 4 * index;
+    }
+    offset += 4 * nwords;
+  }
+}
+
+const char *region_name(raw_region_type type)
+{
+  switch (type)
+  {
+  case region_events:
+    return "events";
+  case region_padding:
+    return "padding";
+  case region_footer:
+    return "footer";
+  default:
+    return "garbage";
+  }
+}
+
+void CorruptionMap::Clear()
+{
+  boards = 0;
+  size = 0;
+  regions.clear();
+  good_events = 0;
+  broken_events = 0;
+  missing_footers = 0;
+  std::fill(bytes, bytes + 4, 0);
+}
+
+void CorruptionMap::Add(uint64_t begin, uint64_t end, raw_region_type type, raw_region_type content, uint32_t events)
+{
+  if (end <= begin)
+  {
+    return;
+  }
+  bytes[content] += end - begin;
+  if (!regions.empty() && regions.back().type == type && regions.back().end == begin)
+  {
+    regions.back().end = end;
+    regions.back().events += events;
+    return;
+  }
+  regions.push_back({begin, end, type, events});
+}
+
+void CorruptionMap::Scan(RawFile &file, int _boards)
+{
+  Clear();
+  boards = _boards;
+
+  struct piece
+  {
+    uint64_t begin;
+    uint64_t end;
+    raw_region_type type;
+  };
+  std::vector<piece> pieces;
+
+  uint64_t offset = find_word(file, 0, evt_header_bytes);
+  Add(0, offset, region_garbage, region_garbage);
+
+  while (!file.Eof(offset))
+  {
+    if (!is_word(file, offset, evt_header_bytes))
+    {
+      uint64_t next = find_word(file, offset + std::min<uint64_t>(4, file.Available(offset, 4)), evt_header_bytes);
+      Add(offset, next, region_garbage, region_garbage);
+      offset = next;
+      continue;
+    }
+
+    // event header, then boards fragments: DE10 header and payload, padding, footer
+    pieces.clear();
+    pieces.push_back({offset, offset + 4, region_events});
+    uint64_t position = offset + 4;
+    int missing = 0;
+    bool complete = true;
+    for (int board = 0; board < boards && complete; board++)
+    {
+      const unsigned char *header = file.GetData(position, 36);
+      if (!header || memcmp(header, de10_header_bytes, 4) != 0)
+      {
+        complete = false;
+        break;
+      }
+      // as read_de10_header does
+      int evt_size = (int)(word_le(header + 4) - 10);
+      unsigned long fw_version = (unsigned long)(int32_t)word_le(header + 8);
+      uint64_t payload_size = 4 * (uint64_t)evt_size;
+      if (evt_size <= 0 || file.Available(position + 36, payload_size) < payload_size)
+      {
+        complete = false;
+        break;
+      }
+      pieces.push_back({position, position + 36 + payload_size, region_events});
+      position += 36 + payload_size;
+
+      if (fw_version == ladderone_fw_version)
+      {
+        if (file.Available(position, ladderone_padding) < ladderone_padding)
+        {
+          complete = false;
+          break;
+        }
+        pieces.push_back({position, position + ladderone_padding, region_padding});
+        position += ladderone_padding;
+      }
+
+      // the walker trusts the payload lenght and doesn't check the footer: a footer that is not there
+      // breaks the event only if what follows is not in place either
+      if (is_word(file, position, de10_footer_bytes))
+      {
+        pieces.push_back({position, position + 4, region_footer});
+      }
+      else if (board < boards - 1 ? is_word(file, position + 4, de10_header_bytes) : file.Eof(position + 8) || is_word(file, position + 8, evt_header_bytes))
+      {
+        missing++;
+        pieces.push_back({position, position + 4, region_events});
+      }
+      else
+      {
+        complete = false;
+        break;
+      }
+      position += 4;
+    }
+
+    // then the word closing the event: whatever comes after it is classified on its own
+    if (complete)
+    {
+      pieces.push_back({position, position + 4, region_events});
+      position += 4;
+      good_events++;
+      missing_footers += missing;
+      for (const piece &item : pieces)
+      {
+        // footer and closing word of the last event may be cut by the end of the file
+        uint64_t end = item.begin + file.Available(item.begin, item.end - item.begin);
+        Add(item.begin, end, region_events, item.type, &item == &pieces[0]);
+      }
+      offset = position;
+      continue;
+    }
+
+    // broken event: its fragments are garbage up to the next event header, padding and footers are kept apart
+    broken_events++;
+    uint64_t next = find_word(file, offset + 4, evt_header_bytes);
+    uint64_t covered = offset;
+    for (const piece &item : pieces)
+    {
+      if (item.begin >= next)
+      {
+        break;
+      }
+      raw_region_type type = item.type == region_events ? region_garbage : item.type;
+      Add(covered, item.begin, region_garbage, region_garbage);
+      Add(item.begin, std::min(item.end, next), type, type);
+      covered = std::min(item.end, next);
+    }
+    Add(covered, next, region_garbage, region_garbage);
+    offset = next;
+  }
+
+  size = file.GetSize();
+}
+
+uint64_t CorruptionMap::GetDamagedRegions() const
+{
+  // whatever comes before the first event is skipped looking for its header anyway
+  uint64_t damaged = 0;
+  for (size_t i = 1; i < regions.size(); i++)
+  {
+    if (regions[i].type != region_events && regions[i - 1].type == region_events)
+    {
+      damaged++;
+    }
+  }
+  return damaged;
+}
+
+uint64_t CorruptionMap::NextGood(uint64_t offset, uint64_t &until) const
+{
+  until = -1;
+  if (offset >= size)
+  {
+    return offset;
+  }
+  auto region = std::upper_bound(regions.begin(), regions.end(), offset, [](uint64_t value, const raw_region &item) { return value < item.begin; });
+  if (region == regions.begin())
+  {
+    return offset;
+  }
+  for (--region; region != regions.end(); ++region)
+  {
+    if (region->type == region_events)
+    {
+      until = region->end;
+      return std::max(offset, region->begin);
+    }
+  }
+  return -1;
+}
+
+void CorruptionMap::Print(std::ostream &out, size_t largest) const
+{
+  out << "\tCorruption map: " << good_events << " complete events, " << broken_events << " broken, "
+      << GetDamagedRegions() << " damaged regions" << std::endl;
+  for (int type = (int)region_events; type <= (int)region_garbage; type++)
+  {
+    out << "\t\t" << region_name((raw_region_type)type) << ": " << bytes[type] << " bytes" << std::endl;
+  }
+  if (missing_footers)
+  {
+    out << "\t\tmissing footers in complete events: " << missing_footers << std::endl;
+  }
+
+  // damaged regions, as runs of regions that are not events
+  std::vector<std::pair<uint64_t, uint64_t>> damaged;
+  for (const raw_region &region : regions)
+  {
+    if (region.type == region_events || &region == &regions[0])
+    {
+      continue;
+    }
+    if (!damaged.empty() && damaged.back().second == region.begin)
+    {
+      damaged.back().second = region.end;
+    }
+    else
+    {
+      damaged.emplace_back(region.begin, region.end);
+    }
+  }
+  std::stable_sort(damaged.begin(), damaged.end(), [](const std::pair<uint64_t, uint64_t> &a, const std::pair<uint64_t, uint64_t> &b) { return a.second - a.first > b.second - b.first; });
+  if (damaged.size() > largest)
+  {
+    damaged.resize(largest);
+  }
+  if (!damaged.empty())
+  {
+    out << "\tLargest damaged regions:" << std::endl;
+  }
+  for (const auto &item : damaged)
+  {
+    out << "\t\toffset " << item.first << ": " << item.second - item.first << " bytes" << std::endl;
+  }
+}
+
+bool CorruptionMap::Write(const std::string &raw_filename) const
+{
+  uint64_t raw_size;
+  int64_t mtime_s, mtime_ns;
+  if (!raw_file_stamp(raw_filename, raw_size, mtime_s, mtime_ns) || raw_size != size)
+  {
+    return false;
+  }
+
+  std::string map_filename = GetMapName(raw_filename);
+  std::string tmp_filename = map_filename + ".tmp";
+  std::ofstream out(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out.is_open())
+  {
+    return false;
+  }
+
+  std::vector<unsigned char> buffer(map_header_size + region_record_size * regions.size(), 0);
+  memcpy(buffer.data(), map_magic, 8);
+  put<uint32_t>(buffer.data(), 8, map_version);
+  put<uint32_t>(buffer.data(), 12, boards);
+  put<uint64_t>(buffer.data(), 16, raw_size);
+  put<int64_t>(buffer.data(), 24, mtime_s);
+  put<int64_t>(buffer.data(), 32, mtime_ns);
+  put<uint64_t>(buffer.data(), 40, regions.size());
+  put<uint64_t>(buffer.data(), 48, good_events);
+  put<uint64_t>(buffer.data(), 56, broken_events);
+  put<uint64_t>(buffer.data(), 64, missing_footers);
+  for (int type = 0; type < 4; type++)
+  {
+    put<uint64_t>(buffer.data(), 72 + 8 * type, bytes[type]);
+  }
+  uint64_t position = map_header_size;
+  for (const raw_region &region : regions)
+  {
+    put<uint64_t>(buffer.data(), position, region.begin);
+    put<uint64_t>(buffer.data(), position + 8, region.end);
+    put<uint32_t>(buffer.data(), position + 16, region.type);
+    put<uint32_t>(buffer.data(), position + 20, region.events);
+    position += region_record_size;
+  }
+  out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+  out.close();
+  if (out.fail() || rename(tmp_filename.c_str(), map_filename.c_str()) != 0)
+  {
+    remove(tmp_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CorruptionMap::Read(const std::string &raw_filename, int _boards)
+{
+  Clear();
+
+  uint64_t raw_size;
+  int64_t mtime_s, mtime_ns;
+  RawFile file;
+  if (!raw_file_stamp(raw_filename, raw_size, mtime_s, mtime_ns) || !file.Open(GetMapName(raw_filename).c_str()))
+  {
+    return false;
+  }
+
+  const unsigned char *header = file.GetData(0, map_header_size);
+  if (!header || memcmp(header, map_magic, 8) != 0 || get<uint32_t>(header, 8) != map_version ||
+      get<uint32_t>(header, 12) != (uint32_t)_boards || get<uint64_t>(header, 16) != raw_size ||
+      get<int64_t>(header, 24) != mtime_s || get<int64_t>(header, 32) != mtime_ns)
+  {
+    return false;
+  }
+
+  uint64_t n = get<uint64_t>(header, 40);
+  uint64_t events = get<uint64_t>(header, 48);
+  uint64_t broken = get<uint64_t>(header, 56);
+  uint64_t missing = get<uint64_t>(header, 64);
+  uint64_t type_bytes[4];
+  for (int type = 0; type < 4; type++)
+  {
+    type_bytes[type] = get<uint64_t>(header, 72 + 8 * type);
+  }
+  const unsigned char *data = file.GetData(map_header_size, region_record_size * n);
+  if (!data)
+  {
+    return false;
+  }
+
+  regions.resize(n);
+  for (uint64_t i = 0; i < n; i++)
+  {
+    const unsigned char *record = data + region_record_size * i;
+    regions[i] = {get<uint64_t>(record, 0), get<uint64_t>(record, 8), (raw_region_type)get<uint32_t>(record, 16), get<uint32_t>(record, 20)};
+  }
+  boards = _boards;
+  size = raw_size;
+  good_events = events;
+  broken_events = broken;
+  missing_footers = missing;
+  std::copy(type_bytes, type_bytes + 4, bytes);
+  return true;
+}
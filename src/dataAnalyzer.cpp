@@ -22,6 +22,8 @@
 #include "CmdLineParser.h"
 #include "Logger.h"
 #include "event.h"
+#include "rawEventReader.h"
+#include "timeIndex.h"
 
 LoggerInit([]{
   Logger::getUserHeader() << "[" << FILENAME << "]";
@@ -40,6 +42,9 @@ int main(int argc, char* argv[]) {
     clp.addOption("inputCalFile",   {"-c", "--cal-file"},       "Calibration file.");
     clp.addOption("outputDir",      {"-o", "--output"},         "Specify output directory path");
     clp.addOption("nSigma",         {"-s", "--n-sigma"},        "Number of sigmas above pedestal to consider signal");
+    clp.addOption("timeWindow",     {"--time-window"},          "Analyze only the entries with ext_timestamp in t0:t1");
+    clp.addOption("every",          {"--every"},                "Quick look: analyze only one entry every N");
+    clp.addOption("sampleFraction", {"--sample-fraction"},      "Quick look: analyze only about this fraction (0, 1] of the entries");
 
     clp.addDummyOption("Triggers");
     clp.addTriggerOption("verboseMode",     {"-v"},             "RunVerboseMode, bool");
@@ -148,25 +153,16 @@ int main(int argc, char* argv[]) {
     // Get root file name
     std::string input_root_filename = clp.getOptionVal<std::string>("inputRootFile");
     LogInfo << "Root file: " << input_root_filename << std::endl;   
-    TFile *input_root_file = new TFile(input_root_filename.c_str(), "READ");
-    // check if the file is open correctly
-    if (!input_root_file->IsOpen()) {
+    // one tree per detector or single tree layout, the reader takes care of it
+    RawEventReader reader;
+    if (!reader.Add(input_root_filename.c_str())) {
         LogError << "Error: file not open" << std::endl;
         return 1;
     }
-
-    // get trees
-    // TODO change at converter level, I don't like the names
-    std::vector <TTree*> raw_events_trees = std::vector <TTree*>();
-    raw_events_trees.reserve(nDetectors);
-    TTree *these_raw_events = (TTree*)input_root_file->Get("raw_events");
-    raw_events_trees.emplace_back(these_raw_events);
-    these_raw_events = (TTree*)input_root_file->Get("raw_events_B");
-    raw_events_trees.emplace_back(these_raw_events);
-    these_raw_events = (TTree*)input_root_file->Get("raw_events_C");
-    raw_events_trees.emplace_back(these_raw_events);
-    these_raw_events = (TTree*)input_root_file->Get("raw_events_D");
-    raw_events_trees.emplace_back(these_raw_events);
+    if (reader.GetDetectors() < nDetectors) {
+        LogError << "Error: the file has only " << reader.GetDetectors() << " detectors" << std::endl;
+        return 1;
+    }
 
     LogInfo << "Got the trees" << std::endl;
 
@@ -174,7 +170,7 @@ int main(int argc, char* argv[]) {
     std::vector <int> nEntries = std::vector <int>();
     nEntries.reserve(nDetectors);
     for (int detit = 0; detit < nDetectors; detit++) {
-        nEntries.emplace_back(raw_events_trees.at(detit)->GetEntries());
+        nEntries.emplace_back(reader.GetEntries(detit));
         LogInfo << "Detector " << detit << " has " << nEntries.at(detit) << " entries" << std::endl;
     }
 
@@ -275,20 +271,39 @@ int main(int argc, char* argv[]) {
         data->emplace_back(this_data);
     }
 
-    // TODO consider changing branch names?
-    raw_events_trees.at(0)->SetBranchAddress("RAW Event", &data->at(0));
-    raw_events_trees.at(1)->SetBranchAddress("RAW Event B", &data->at(1));
-    raw_events_trees.at(2)->SetBranchAddress("RAW Event C", &data->at(2));
-    raw_events_trees.at(3)->SetBranchAddress("RAW Event D", &data->at(3));
-    
-    int limit = nEntries.at(0);
+    // entries to analyze: all of them, or the ones in the time window found with the time index
+    EntrySelection selection(nEntries.at(0));
+    if (clp.isOptionTriggered("timeWindow")) {
+        uint64_t t0, t1;
+        LogThrowIf(!parse_time_window(clp.getOptionVal<std::string>("timeWindow"), t0, t1), "The time window must be t0:t1, with t0 < t1");
+        TimeIndex timeIndex;
+        LogThrowIf(!timeIndex.Load({input_root_filename}, true), "Can't index " + input_root_filename + " by time");
+        selection = EntrySelection(timeIndex.Find(t0, t1));
+        LogInfo << "Time window " << t0 << ":" << t1 << " has " << selection.GetEntries() << " entries" << std::endl;
+    }
+    if (clp.isOptionTriggered("every")) {
+        int every = clp.getOptionVal<int>("every");
+        LogThrowIf(every < 1, "--every must be at least 1");
+        selection.SetEvery(every);
+    }
+    else if (clp.isOptionTriggered("sampleFraction")) {
+        int every = sampling_step(clp.getOptionVal<double>("sampleFraction"));
+        LogThrowIf(every == 0, "The sample fraction must be in (0, 1]");
+        selection.SetEvery(every);
+    }
+    if (selection.GetEvery() > 1) {
+        LogInfo << "Sampling one entry every " << selection.GetEvery() << ": " << selection.GetEntries() << " entries" << std::endl;
+    }
+
+    int limit = selection.GetEntries();
     int setLimit = 50000; // TODO from json settings
     if (limit > setLimit) limit = setLimit;
 
     int hitsInEvent = 0;
     int triggeredEvents = 0;
     
-    for (int entryit = 0; entryit < limit; entryit++) {
+    Long64_t processed = 0;
+    for (Long64_t entryit = selection.First(); entryit >= 0 && processed < limit; entryit = selection.Next(entryit), processed++) {
 
         hitsInEvent = 0;
         
@@ -304,8 +319,14 @@ int main(int argc, char* argv[]) {
         // clear data
         for (int detit = 0; detit < nDetectors; detit++)   data->at(detit)->clear();
 
+        if (!reader.GetEntry(entryit)) {
+            LogError << "Error: can't read entry " << entryit << std::endl;
+            delete this_event;
+            return 1;
+        }
+
         for (int detit = 0; detit < nDetectors; detit++) {
-            raw_events_trees.at(detit)->GetEntry(entryit);
+            data->at(detit)->assign(reader.GetData(detit).begin(), reader.GetData(detit).end());
             this_event->AddPeak(detit, *data->at(detit));
             for (int chit = 0; chit < nChannels; chit++) {
                 // LogInfo << "DetId " << detit << ", channel " << chit << ", peak: " << this_event->GetPeak(detit, chit) << ", baseline: " << this_event->GetBaseline(detit, chit) << ", sigma: " << this_event->GetSigma(detit, chit) << "\t";
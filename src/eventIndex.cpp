@@ -0,0 +1,211 @@
+#include "eventIndex.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+// Layout of the sidecar, native (little endian) byte order:
+//   header (64 bytes): magic, version, boards, raw file size, raw mtime (s, ns), sync window, entries, reserved
+//   one record per event: offset (8), trigger (4), trigger_id (4), then per board: board_id (4), timestamp (8), ext_timestamp (8)
+static const char index_magic[8] = {'P', 'A', 'P', 'E', 'I', 'D', 'X', '\0'};
+static const uint32_t index_version = 1;
+static const uint64_t index_header_size = 64;
+static const uint64_t event_record_size = 16;
+static const uint64_t board_record_size = 20;
+
+static uint64_t record_size(int boards)
+{
+  return event_record_size + board_record_size * boards;
+}
+
+template <typename T>
+static void put(unsigned char *buffer, uint64_t position, T value)
+{
+  memcpy(buffer + position, &value, sizeof(T));
+}
+
+template <typename T>
+static T get(const unsigned char *buffer, uint64_t position)
+{
+  T value;
+  memcpy(&value, buffer + position, sizeof(T));
+  return value;
+}
+
+bool raw_file_stamp(const std::string &raw_filename, uint64_t &size, int64_t &mtime_s, int64_t &mtime_ns)
+{
+  struct stat st;
+  if (stat(raw_filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    return false;
+  }
+  size = st.st_size;
+  mtime_s = st.st_mtim.tv_sec;
+  mtime_ns = st.st_mtim.tv_nsec;
+  return true;
+}
+
+//////////////////////////////////////////////
+// EventIndex
+
+bool EventIndex::Open(const std::string &raw_filename, int _boards, uint64_t sync_window)
+{
+  Close();
+  entries = 0;
+
+  uint64_t size;
+  int64_t mtime_s, mtime_ns;
+  if (!raw_file_stamp(raw_filename, size, mtime_s, mtime_ns) || !file.Open(GetIndexName(raw_filename).c_str()) || !file.IsMapped())
+  {
+    Close();
+    return false;
+  }
+
+  const unsigned char *header = file.GetData(0, index_header_size);
+  if (!header || memcmp(header, index_magic, 8) != 0 || get<uint32_t>(header, 8) != index_version ||
+      get<uint32_t>(header, 12) != (uint32_t)_boards || get<uint64_t>(header, 16) != size ||
+      get<int64_t>(header, 24) != mtime_s || get<int64_t>(header, 32) != mtime_ns ||
+      get<uint64_t>(header, 40) != sync_window)
+  {
+    Close();
+    return false;
+  }
+
+  boards = _boards;
+  entries = get<uint64_t>(header, 48);
+  if (file.GetSize() < index_header_size + entries * record_size(boards))
+  {
+    Close();
+    entries = 0;
+    return false;
+  }
+  return true;
+}
+
+uint64_t EventIndex::GetOffset(uint64_t n)
+{
+  if (n >= entries)
+  {
+    return -1;
+  }
+  return get<uint64_t>(file.GetData(index_header_size + n * record_size(boards), 8), 0);
+}
+
+bool EventIndex::GetEvent(uint64_t n, event_record &record)
+{
+  if (n >= entries)
+  {
+    return false;
+  }
+
+  const unsigned char *data = file.GetData(index_header_size + n * record_size(boards), record_size(boards));
+  record.offset = get<uint64_t>(data, 0);
+  record.trigger = get<int32_t>(data, 8);
+  record.trigger_id = get<int32_t>(data, 12);
+  record.boards.resize(boards);
+  for (int i = 0; i < boards; i++)
+  {
+    const unsigned char *board = data + event_record_size + i * board_record_size;
+    record.boards[i].board_id = get<int32_t>(board, 0);
+    record.boards[i].timestamp = get<uint64_t>(board, 4);
+    record.boards[i].ext_timestamp = get<uint64_t>(board, 12);
+  }
+  return true;
+}
+
+//////////////////////////////////////////////
+// EventIndexWriter
+
+EventIndexWriter::~EventIndexWriter()
+{
+  Discard();
+}
+
+bool EventIndexWriter::Create(const std::string &raw_filename, int _boards, uint64_t sync_window)
+{
+  Discard();
+
+  uint64_t size;
+  int64_t mtime_s, mtime_ns;
+  if (!raw_file_stamp(raw_filename, size, mtime_s, mtime_ns))
+  {
+    return false;
+  }
+
+  index_filename = EventIndex::GetIndexName(raw_filename);
+  tmp_filename = index_filename + ".tmp";
+  out.open(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out.is_open())
+  {
+    return false;
+  }
+
+  boards = _boards;
+  entries = 0;
+  header.assign(index_header_size, 0);
+  memcpy(header.data(), index_magic, 8);
+  put<uint32_t>(header.data(), 8, index_version);
+  put<uint32_t>(header.data(), 12, boards);
+  put<uint64_t>(header.data(), 16, size);
+  put<int64_t>(header.data(), 24, mtime_s);
+  put<int64_t>(header.data(), 32, mtime_ns);
+  put<uint64_t>(header.data(), 40, sync_window);
+  out.write(reinterpret_cast<const char *>(header.data()), index_header_size);
+
+  record.assign(record_size(boards), 0);
+  return out.good();
+}
+
+void EventIndexWriter::Fill(const de10_fragment &fragment)
+{
+  if (!out.is_open() || fragment.board >= boards)
+  {
+    return;
+  }
+
+  if (fragment.board == 0)
+  {
+    put<uint64_t>(record.data(), 0, fragment.event_offset);
+    put<int32_t>(record.data(), 8, fragment.trigger);
+    put<int32_t>(record.data(), 12, fragment.trigger_id);
+  }
+
+  unsigned char *board = record.data() + event_record_size + fragment.board * board_record_size;
+  put<int32_t>(board, 0, fragment.board_id);
+  put<uint64_t>(board, 4, fragment.timestamp);
+  put<uint64_t>(board, 12, fragment.ext_timestamp);
+
+  if (fragment.board == boards - 1)
+  {
+    out.write(reinterpret_cast<const char *>(record.data()), record.size());
+    entries++;
+  }
+}
+
+bool EventIndexWriter::Write()
+{
+  if (!out.is_open())
+  {
+    return false;
+  }
+
+  put<uint64_t>(header.data(), 48, entries);
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(header.data()), index_header_size);
+  out.close();
+  if (out.fail() || rename(tmp_filename.c_str(), index_filename.c_str()) != 0)
+  {
+    remove(tmp_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+void EventIndexWriter::Discard()
+{
+  if (out.is_open())
+  {
+    out.close();
+    remove(tmp_filename.c_str());
+  }
+}
@@ -0,0 +1,117 @@
+#include "headerDiagnostics.h"
+
+#include <algorithm>
+
+#include "TGraph.h"
+#include "TH1.h"
+#include "TString.h"
+
+HeaderDiagnostics::HeaderDiagnostics(int _boards, uint64_t expected_events) : boards(_boards), columns(_boards)
+{
+  Reserve(expected_events);
+}
+
+void HeaderDiagnostics::Reserve(uint64_t expected_events)
+{
+  for (board_columns &board : columns)
+  {
+    board.event.reserve(expected_events);
+    board.trigger.reserve(expected_events);
+    board.trigger_id.reserve(expected_events);
+    board.timestamp.reserve(expected_events);
+    board.ext_timestamp.reserve(expected_events);
+  }
+}
+
+void HeaderDiagnostics::Fill(const de10_fragment &fragment)
+{
+  if (fragment.board < 0 || fragment.board >= boards)
+  {
+    return;
+  }
+  board_columns &board = columns[fragment.board];
+  board.event.push_back(fragment.event);
+  board.trigger.push_back(fragment.trigger);
+  board.trigger_id.push_back(fragment.trigger_id);
+  board.timestamp.push_back(fragment.timestamp);
+  board.ext_timestamp.push_back(fragment.ext_timestamp);
+}
+
+uint64_t HeaderDiagnostics::EstimateEvents(uint64_t bytes, int boards, const de10_fragment &first)
+{
+  // DE10 header, payload and footer of each board
+  uint64_t event_size = boards * (40 + 4 * (uint64_t)std::max(0, first.evt_size));
+  return event_size ? bytes / event_size + 1 : 0;
+}
+
+template <typename T>
+static std::vector<double> to_double(const std::vector<T> &column)
+{
+  return std::vector<double>(column.begin(), column.end());
+}
+
+static TGraph *make_graph(const std::vector<double> &x, const std::vector<double> &y, const TString &name, const TString &title, const char *ytitle)
+{
+  TGraph *graph = new TGraph(std::min(x.size(), y.size()), x.data(), y.data());
+  graph->SetName(name);
+  graph->SetTitle(title);
+  graph->GetXaxis()->SetTitle("Event read number");
+  graph->GetYaxis()->SetTitle(ytitle);
+  return graph;
+}
+
+// time from the previous event, the first one from 0
+static TH1F *make_rate(const std::vector<uint64_t> &timestamp, const TString &name, const TString &title, const char *xtitle)
+{
+  std::vector<double> rate(timestamp.size());
+  uint64_t previous = 0;
+  for (size_t i = 0; i < timestamp.size(); i++)
+  {
+    rate[i] = timestamp[i] - previous;
+    previous = timestamp[i];
+  }
+  TH1F *histo = new TH1F("", "", 10000, 499900, 1e6);
+  histo->SetName(name);
+  histo->SetTitle(title);
+  histo->GetXaxis()->SetTitle(xtitle);
+  histo->GetYaxis()->SetTitle("Entries");
+  if (!rate.empty())
+  {
+    histo->FillN(rate.size(), rate.data(), nullptr);
+  }
+  return histo;
+}
+
+// first board minus this one, event by event
+static std::vector<double> delta(const std::vector<uint64_t> &first, const std::vector<uint64_t> &board)
+{
+  std::vector<double> values(std::min(first.size(), board.size()));
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    values[i] = (long long)(first[i] - board[i]);
+  }
+  return values;
+}
+
+void HeaderDiagnostics::Write() const
+{
+  for (int i = 0; i < boards; i++)
+  {
+    const board_columns &board = columns[i];
+    std::vector<double> x = to_double(board.event);
+
+    make_graph(x, to_double(board.trigger), TString::Format("g_trigger_number_board_%d", i), TString::Format("Trigger number for board %d", i), "Trigger number")->Write();
+    make_graph(x, to_double(board.trigger_id), TString::Format("g_trigger_id_board_%d", i), TString::Format("Trigger id for board %d", i), "Trigger id")->Write();
+    make_graph(x, to_double(board.timestamp), TString::Format("g_timestamp_board_%d", i), TString::Format("Timestamp for board %d", i), "Timestamp")->Write();
+    make_graph(x, to_double(board.ext_timestamp), TString::Format("g_ext_timestamp_board_%d", i), TString::Format("Ext Timestamp for board %d", i), "Ext Timestamp")->Write();
+    make_rate(board.timestamp, TString::Format("g_timestamp_rate_board_%d", i), TString::Format("Timestamp rate for board %d", i), "Timestamp rate")->Write();
+    make_rate(board.ext_timestamp, TString::Format("g_ext_timestamp_rate_board_%d", i), TString::Format("Ext Timestamp rate for board %d", i), "Ext Timestamp rate")->Write();
+  }
+
+  for (int i = 1; i < boards; i++)
+  {
+    std::vector<double> x = to_double(columns[i].event);
+    make_graph(x, delta(columns[0].timestamp, columns[i].timestamp), TString::Format("g_timestamp_delta_board_%d", i), TString::Format("Timestamp delta for board %d", i), "Timestamp delta")->Write();
+    make_graph(x, delta(columns[0].ext_timestamp, columns[i].ext_timestamp), TString::Format("g_ext_timestamp_delta_board_%d", i), TString::Format("Ext Timestamp delta for board %d", i), "Ext Timestamp delta")->Write();
+  }
+}
@@ -6,6 +6,7 @@
 #include "TGraph.h"
 #include "anyoption.h"
 #include <ctime>
+#include <climits>
 
 #include "miniTRB.h"
 
@@ -54,8 +55,8 @@ int main(int argc, char *argv[])
     }
 
     //Open binary data file
-    std::fstream file(opt->getArgv(0), std::ios::in | std::ios::out | std::ios::binary);
-    if (file.fail())
+    RawFile file;
+    if (!file.Open(opt->getArgv(0)))
     {
         std::cout << "ERROR: can't open input file" << std::endl; // file could not be opened
         return 2;
@@ -83,9 +84,8 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    file.seekg(0, std::ios::end);
-    int fileSize = file.tellg() / bitsize; //Estimate number of events from filesize
-    file.seekg(0);
+    //Estimate number of events from filesize, streamed input is read to the end
+    int fileSize = file.IsMapped() ? file.GetSize() / bitsize : INT_MAX;
 
     //Create output ROOT file
     TString output_filename = opt->getArgv(1);
@@ -125,18 +125,20 @@ int main(int argc, char *argv[])
     }
 
     //Read raw events and write to TTree
-    std::cout << "Trying to read " << fileSize << " events ..." << std::endl;
+    if (file.IsMapped())
+        std::cout << "Trying to read " << fileSize << " events ..." << std::endl;
 
     int evtnum = 0;
-    unsigned char buffer[2];
+    const unsigned char *buffer;
     unsigned short val;
 
-    while (evtnum < fileSize)
+    while (evtnum < fileSize && (buffer = file.GetData(offset + (uint64_t)evtnum * bitsize, 2)))
     {
-        std::cout << "\rReading event " << evtnum << " of " << fileSize - 1 << std::flush;
+        if (file.IsMapped())
+            std::cout << "\rReading event " << evtnum << " of " << fileSize - 1 << std::flush;
+        else
+            std::cout << "\rReading event " << evtnum << std::flush;
 
-        file.seekg(offset + evtnum * bitsize);
-        file.read(reinterpret_cast<char *>(&buffer), 2);
         val = buffer[0] | (buffer[1] << 8);
 
         raw_event = read_event(file, offset, version, evtnum);
@@ -163,10 +165,10 @@ int main(int argc, char *argv[])
     if (fixVAnumber)
         std::cout << "10to6 flag: remember to fix the calibration file!" << std::endl;
 
-    std::cout << "Read " << goodevents << " good events out of " << fileSize << std::endl;
+    std::cout << "Read " << goodevents << " good events out of " << evtnum << std::endl;
 
     header->Write();
     foutput->Close();
-    file.close();
+    file.Close();
     return 0;
 }
@@ -0,0 +1,270 @@
+#include "nativeEvents.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const char native_magic[8] = {'P', 'A', 'P', 'E', 'E', 'V', 'T', '\0'};
+static const uint32_t native_version = 1;
+static const uint64_t native_header_size = 64;
+static const uint64_t record_header_size = 32;
+static const uint64_t chunk_record_size = 40;
+
+static uint64_t align8(uint64_t size)
+{
+  return (size + 7) & ~(uint64_t)7;
+}
+
+template <typename T>
+static void put(unsigned char *buffer, uint64_t position, T value)
+{
+  memcpy(buffer + position, &value, sizeof(T));
+}
+
+template <typename T>
+static T get(const unsigned char *buffer, uint64_t position)
+{
+  T value;
+  memcpy(&value, buffer + position, sizeof(T));
+  return value;
+}
+
+//////////////////////////////////////////////
+// NativeEventWriter
+
+bool NativeEventWriter::Create(const std::string &filename, uint32_t _chunk_entries)
+{
+  Close();
+  out.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out.is_open())
+  {
+    return false;
+  }
+
+  channels.clear();
+  chunks.clear();
+  entries = 0;
+  chunk_entries = _chunk_entries ? _chunk_entries : 1;
+  record_size = 0;
+  data_offset = native_header_size;
+  WriteHeader(0);
+  bytes_written = native_header_size;
+  return out.good();
+}
+
+void NativeEventWriter::WriteHeader(uint64_t index_offset)
+{
+  std::vector<unsigned char> header(native_header_size, 0);
+  memcpy(header.data(), native_magic, 8);
+  put<uint32_t>(header.data(), 8, native_version);
+  put<uint32_t>(header.data(), 12, channels.size());
+  put<uint64_t>(header.data(), 16, entries);
+  put<uint64_t>(header.data(), 24, record_size);
+  put<uint32_t>(header.data(), 32, chunk_entries);
+  put<uint64_t>(header.data(), 40, index_offset);
+  put<uint64_t>(header.data(), 48, data_offset);
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(header.data()), native_header_size);
+}
+
+void NativeEventWriter::SetDetectors(const std::vector<uint32_t> &_channels)
+{
+  if (!out.is_open() || entries)
+  {
+    return;
+  }
+
+  channels = _channels;
+  uint64_t samples = 0;
+  for (uint32_t n : channels)
+  {
+    samples += n;
+  }
+  record_size = align8(record_header_size + 2 * samples);
+  record.assign(record_size, 0);
+  data_offset = native_header_size + align8(4 * channels.size());
+
+  WriteHeader(0);
+  std::vector<unsigned char> table(data_offset - native_header_size, 0);
+  for (size_t det = 0; det < channels.size(); det++)
+  {
+    put<uint32_t>(table.data(), 4 * det, channels[det]);
+  }
+  out.write(reinterpret_cast<const char *>(table.data()), table.size());
+  bytes_written += table.size();
+}
+
+void NativeEventWriter::Fill(const native_event_header &header, const uint16_t *const *samples)
+{
+  if (!out.is_open() || channels.empty())
+  {
+    return;
+  }
+
+  if (entries % chunk_entries == 0)
+  {
+    chunks.push_back({entries, header.event, header.timestamp, header.timestamp, header.ext_timestamp, header.ext_timestamp});
+  }
+  else
+  {
+    native_chunk &chunk = chunks.back();
+    chunk.min_timestamp = std::min(chunk.min_timestamp, header.timestamp);
+    chunk.max_timestamp = std::max(chunk.max_timestamp, header.timestamp);
+    chunk.min_ext_timestamp = std::min(chunk.min_ext_timestamp, header.ext_timestamp);
+    chunk.max_ext_timestamp = std::max(chunk.max_ext_timestamp, header.ext_timestamp);
+  }
+
+  put<int32_t>(record.data(), 0, header.event);
+  put<uint32_t>(record.data(), 4, header.trigger);
+  put<uint32_t>(record.data(), 8, header.trigger_id);
+  put<uint64_t>(record.data(), 16, header.timestamp);
+  put<uint64_t>(record.data(), 24, header.ext_timestamp);
+  uint64_t position = record_header_size;
+  for (size_t det = 0; det < channels.size(); det++)
+  {
+    memcpy(record.data() + position, samples[det], 2 * channels[det]);
+    position += 2 * channels[det];
+  }
+  out.write(reinterpret_cast<const char *>(record.data()), record_size);
+  bytes_written += record_size;
+  entries++;
+}
+
+bool NativeEventWriter::Close()
+{
+  if (!out.is_open())
+  {
+    return false;
+  }
+
+  uint64_t index_offset = data_offset + entries * record_size;
+  std::vector<unsigned char> index(chunks.size() * chunk_record_size);
+  for (size_t i = 0; i < chunks.size(); i++)
+  {
+    unsigned char *chunk = index.data() + i * chunk_record_size;
+    put<int64_t>(chunk, 0, chunks[i].first_event);
+    put<uint64_t>(chunk, 8, chunks[i].min_timestamp);
+    put<uint64_t>(chunk, 16, chunks[i].max_timestamp);
+    put<uint64_t>(chunk, 24, chunks[i].min_ext_timestamp);
+    put<uint64_t>(chunk, 32, chunks[i].max_ext_timestamp);
+  }
+  out.seekp(index_offset);
+  out.write(reinterpret_cast<const char *>(index.data()), index.size());
+  bytes_written += index.size();
+  WriteHeader(index_offset);
+  out.close();
+  return !out.fail();
+}
+
+//////////////////////////////////////////////
+// NativeEventFile
+
+bool NativeEventFile::IsNative(const char *filename)
+{
+  std::ifstream in(filename, std::ios::in | std::ios::binary);
+  char magic[8];
+  return in.read(magic, 8) && memcmp(magic, native_magic, 8) == 0;
+}
+
+bool NativeEventFile::Open(const char *filename)
+{
+  Close();
+  channels.clear();
+  detector_offset.clear();
+  chunks.clear();
+  entries = 0;
+
+  if (!file.Open(filename))
+  {
+    return false;
+  }
+
+  const unsigned char *header = file.GetData(0, native_header_size);
+  if (!header || memcmp(header, native_magic, 8) != 0 || get<uint32_t>(header, 8) != native_version)
+  {
+    Close();
+    return false;
+  }
+  uint32_t detectors = get<uint32_t>(header, 12);
+  uint64_t header_entries = get<uint64_t>(header, 16);
+  record_size = get<uint64_t>(header, 24);
+  uint32_t chunk_entries = get<uint32_t>(header, 32);
+  uint64_t index_offset = get<uint64_t>(header, 40);
+  data_offset = get<uint64_t>(header, 48);
+
+  if (detectors == 0)
+  {
+    // the layout of the detectors comes with the first event: a file without events has none
+    return header_entries == 0;
+  }
+
+  const unsigned char *table = file.GetData(native_header_size, 4 * (uint64_t)detectors);
+  if (!table)
+  {
+    Close();
+    return false;
+  }
+  uint64_t position = record_header_size;
+  for (uint32_t det = 0; det < detectors; det++)
+  {
+    channels.push_back(get<uint32_t>(table, 4 * det));
+    detector_offset.push_back(position);
+    position += 2 * channels.back();
+  }
+  if (record_size < position || data_offset < native_header_size + 4 * (uint64_t)detectors)
+  {
+    Close();
+    return false;
+  }
+
+  if (index_offset == 0)
+  {
+    // not closed by the writer: complete records only
+    entries = record_size && file.GetSize() > data_offset ? (file.GetSize() - data_offset) / record_size : 0;
+    return true;
+  }
+
+  entries = header_entries;
+  uint64_t nchunks = chunk_entries ? (entries + chunk_entries - 1) / chunk_entries : 0;
+  const unsigned char *index = file.GetData(index_offset, nchunks * chunk_record_size);
+  if (index_offset < data_offset + entries * record_size || (nchunks && !index))
+  {
+    Close();
+    return false;
+  }
+  for (uint64_t i = 0; i < nchunks; i++)
+  {
+    const unsigned char *chunk = index + i * chunk_record_size;
+    chunks.push_back({i * chunk_entries, get<int64_t>(chunk, 0), get<uint64_t>(chunk, 8), get<uint64_t>(chunk, 16),
+                      get<uint64_t>(chunk, 24), get<uint64_t>(chunk, 32)});
+  }
+  return true;
+}
+
+const uint16_t *NativeEventFile::GetSamples(uint64_t entry, int detector)
+{
+  if (entry >= entries || detector < 0 || detector >= GetDetectors())
+  {
+    return nullptr;
+  }
+  // records are 8-byte aligned, so are the 16-bit samples
+  return reinterpret_cast<const uint16_t *>(file.GetData(data_offset + entry * record_size + detector_offset[detector], 2 * channels[detector]));
+}
+
+bool NativeEventFile::GetHeader(uint64_t entry, native_event_header &header)
+{
+  if (entry >= entries)
+  {
+    return false;
+  }
+  const unsigned char *record = file.GetData(data_offset + entry * record_size, record_header_size);
+  if (!record)
+  {
+    return false;
+  }
+  header.event = get<int32_t>(record, 0);
+  header.trigger = get<uint32_t>(record, 4);
+  header.trigger_id = get<uint32_t>(record, 8);
+  header.timestamp = get<uint64_t>(record, 16);
+  header.ext_timestamp = get<uint64_t>(record, 24);
+  return true;
+}
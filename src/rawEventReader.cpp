@@ -0,0 +1,499 @@
+#include "rawEventReader.h"
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TObjArray.h"
+#include <algorithm>
+#include <iostream>
+
+static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTWXYZ";
+static const int max_header_boards = 64; // size of the de10_headers arrays read
+
+RawEventReader::~RawEventReader()
+{
+  for (auto chain : chains)
+  {
+    delete chain;
+  }
+  delete events;
+  delete headers;
+  for (auto native_file : native_files)
+  {
+    delete native_file;
+  }
+}
+
+// Native files are added to the run by Add: they must have the detectors of the first one, unless they are empty
+bool RawEventReader::AddNative(const char *filename)
+{
+  NativeEventFile *native_file = new NativeEventFile();
+  if (!native_file->Open(filename))
+  {
+    std::cout << "ERROR: can't read native file " << filename << std::endl;
+    delete native_file;
+    return false;
+  }
+
+  bool match = native_file->GetDetectors() == detectors;
+  for (int det = 0; match && det < detectors; det++)
+  {
+    match = native_file->GetChannels(det) == channels[det];
+  }
+  // a file without events has no detectors, and adds nothing to the run
+  if (!match && native_file->GetEntries() > 0)
+  {
+    std::cout << "ERROR: the detectors of " << filename << " don't match the ones of the first file" << std::endl;
+    delete native_file;
+    return false;
+  }
+
+  native_first.push_back(native_entries);
+  native_entries += native_file->GetEntries();
+  native_files.push_back(native_file);
+  return true;
+}
+
+NativeEventFile *RawEventReader::LocateNative(Long64_t entry, Long64_t &local_entry)
+{
+  if (entry < 0 || entry >= native_entries)
+  {
+    return nullptr;
+  }
+  size_t file = std::upper_bound(native_first.begin(), native_first.end(), entry) - native_first.begin() - 1;
+  local_entry = entry - native_first[file];
+  return native_files[file];
+}
+
+bool RawEventReader::Init(const char *filename)
+{
+  if (NativeEventFile::IsNative(filename))
+  {
+    NativeEventFile native_file;
+    if (!native_file.Open(filename) || native_file.GetDetectors() == 0)
+    {
+      std::cout << "ERROR: no raw events in " << filename << std::endl;
+      return false;
+    }
+    native = true;
+    detectors = native_file.GetDetectors();
+    for (int det = 0; det < detectors; det++)
+    {
+      channels.push_back(native_file.GetChannels(det));
+    }
+    data.resize(detectors);
+    for (int det = 0; det < detectors; det++)
+    {
+      data[det].resize(channels[det]);
+    }
+    return true;
+  }
+
+  TFile *f = TFile::Open(filename);
+  if (!f || f->IsZombie())
+  {
+    std::cout << "ERROR: can't open " << filename << std::endl;
+    delete f;
+    return false;
+  }
+
+  TTree *tree = dynamic_cast<TTree *>(f->Get(single_tree_name));
+  if (tree)
+  {
+    single_tree = true;
+    zero_suppressed = tree->GetBranch((detector_branch_name(0) + "_n").c_str()) != nullptr;
+    if (zero_suppressed)
+    {
+      // the channels of each detector are the ones of its pedestals
+      if (!ReadPedestals(f, filename))
+      {
+        f->Close();
+        delete f;
+        return false;
+      }
+      for (const auto &pedestal : pedestals.back())
+      {
+        channels.push_back(pedestal.size());
+      }
+    }
+    else
+    {
+      for (int det = 0; tree->GetBranch(detector_branch_name(det).c_str()); det++)
+      {
+        TLeaf *leaf = tree->GetLeaf(detector_branch_name(det).c_str());
+        channels.push_back(leaf ? leaf->GetLenStatic() : 0);
+      }
+    }
+    detectors = channels.size();
+
+    events = new TChain(single_tree_name);
+    arrays.resize(detectors);
+    branches.assign(detectors, nullptr);
+    data.resize(detectors);
+    for (int det = 0; det < detectors; det++)
+    {
+      arrays[det].resize(channels[det]);
+      data[det].resize(channels[det]);
+    }
+    if (zero_suppressed)
+    {
+      zs_n.assign(detectors, 0);
+      zs_channel.resize(detectors);
+      zs_adc.resize(detectors);
+      zs_branches.assign(detectors, std::vector<TBranch *>(3, nullptr));
+      for (int det = 0; det < detectors; det++)
+      {
+        zs_channel[det].resize(channels[det]);
+        zs_adc[det].resize(channels[det]);
+      }
+    }
+  }
+  else
+  {
+    // raw_events, raw_events_B, raw_events_C, ...
+    std::vector<std::string> branch_names;
+    for (int det = 0; det < (int)alphabet.size(); det++)
+    {
+      std::string name = det == 0 ? "raw_events" : "raw_events_" + alphabet.substr(det, 1);
+      tree = dynamic_cast<TTree *>(f->Get(name.c_str()));
+      if (!tree || !tree->GetListOfBranches()->GetEntries())
+      {
+        break;
+      }
+      chains.push_back(new TChain(name.c_str()));
+      branch_names.push_back(tree->GetListOfBranches()->At(0)->GetName()); // RAW Event J5, RAW Event J7, RAW Event B, ...
+    }
+    detectors = chains.size();
+    vectors.assign(detectors, nullptr);
+    channels.assign(detectors, 0);
+
+    if (detectors && dynamic_cast<TTree *>(f->Get(de10_headers_tree_name)))
+    {
+      headers = new TChain(de10_headers_tree_name);
+      headers->Add(filename);
+      header_trigger.assign(max_header_boards, 0);
+      header_trigger_id.assign(max_header_boards, 0);
+      header_timestamp.assign(max_header_boards, 0);
+      header_ext_timestamp.assign(max_header_boards, 0);
+      headers->SetBranchStatus("*", false);
+      for (const char *name : {"event", "trigger", "trigger_id", "timestamp", "ext_timestamp"})
+      {
+        headers->SetBranchStatus(name, true);
+      }
+      headers->SetBranchAddress("event", &header.event);
+      headers->SetBranchAddress("trigger", header_trigger.data());
+      headers->SetBranchAddress("trigger_id", header_trigger_id.data());
+      headers->SetBranchAddress("timestamp", header_timestamp.data());
+      headers->SetBranchAddress("ext_timestamp", header_ext_timestamp.data());
+    }
+
+    for (int det = 0; det < detectors; det++)
+    {
+      chains[det]->Add(filename);
+      chains[det]->SetBranchAddress(branch_names[det].c_str(), &vectors[det]);
+      if (chains[det]->GetEntry(0) > 0 && vectors[det])
+      {
+        channels[det] = vectors[det]->size();
+      }
+    }
+  }
+
+  f->Close();
+  delete f;
+
+  if (detectors == 0)
+  {
+    std::cout << "ERROR: no raw events in " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool RawEventReader::Add(const char *filename)
+{
+  bool first = detectors == 0;
+  if (first && !Init(filename))
+  {
+    return false;
+  }
+
+  if (native)
+  {
+    return AddNative(filename);
+  }
+  if (single_tree)
+  {
+    if (zero_suppressed && !first)
+    {
+      TFile *f = TFile::Open(filename);
+      bool good = f && !f->IsZombie() && ReadPedestals(f, filename);
+      delete f;
+      if (!good)
+      {
+        return false;
+      }
+    }
+
+    events->Add(filename);
+    if (first)
+    {
+      if (zero_suppressed)
+      {
+        for (int det = 0; det < detectors; det++)
+        {
+          std::string name = detector_branch_name(det);
+          events->SetBranchAddress((name + "_n").c_str(), &zs_n[det], &zs_branches[det][0]);
+          events->SetBranchAddress((name + "_ch").c_str(), zs_channel[det].data(), &zs_branches[det][1]);
+          events->SetBranchAddress((name + "_adc").c_str(), zs_adc[det].data(), &zs_branches[det][2]);
+        }
+        events->SetBranchAddress("full", &header.full);
+      }
+      else
+      {
+        for (int det = 0; det < detectors; det++)
+        {
+          events->SetBranchAddress(detector_branch_name(det).c_str(), arrays[det].data(), &branches[det]);
+        }
+      }
+      header_branches.assign(5, nullptr);
+      events->SetBranchAddress("event", &header.event, &header_branches[0]);
+      events->SetBranchAddress("trigger", &header.trigger, &header_branches[1]);
+      events->SetBranchAddress("trigger_id", &header.trigger_id, &header_branches[2]);
+      events->SetBranchAddress("timestamp", &header.timestamp, &header_branches[3]);
+      events->SetBranchAddress("ext_timestamp", &header.ext_timestamp, &header_branches[4]);
+    }
+  }
+  else if (!first)
+  {
+    for (auto chain : chains)
+    {
+      chain->Add(filename);
+    }
+    if (headers)
+    {
+      headers->Add(filename);
+    }
+  }
+  return true;
+}
+
+Long64_t RawEventReader::GetEntries(int detector)
+{
+  if (detectors == 0)
+  {
+    return 0;
+  }
+  if (native)
+  {
+    return native_entries;
+  }
+  return single_tree ? events->GetEntries() : chains.at(detector)->GetEntries();
+}
+
+bool RawEventReader::GetEntry(Long64_t entry)
+{
+  if (native)
+  {
+    Long64_t local_entry;
+    NativeEventFile *native_file = LocateNative(entry, local_entry);
+    if (!LoadNativeHeader(native_file, local_entry))
+    {
+      return false;
+    }
+    for (int det = 0; det < detectors; det++)
+    {
+      const uint16_t *samples = native_file->GetSamples(local_entry, det);
+      std::copy(samples, samples + channels[det], data[det].begin());
+    }
+    return true;
+  }
+
+  if (single_tree)
+  {
+    if (events->GetEntry(entry) <= 0)
+    {
+      return false;
+    }
+    for (int det = 0; det < detectors; det++)
+    {
+      if (zero_suppressed)
+      {
+        Expand(det, events->GetTreeNumber());
+      }
+      else
+      {
+        std::copy(arrays[det].begin(), arrays[det].end(), data[det].begin());
+      }
+    }
+    return true;
+  }
+
+  bool good = true;
+  for (int det = 0; det < detectors; det++)
+  {
+    good &= chains[det]->GetEntry(entry) > 0;
+  }
+  LoadHeaders(entry);
+  return good;
+}
+
+bool RawEventReader::GetHeaderEntry(Long64_t entry)
+{
+  if (native)
+  {
+    Long64_t local_entry;
+    return LoadNativeHeader(LocateNative(entry, local_entry), local_entry);
+  }
+
+  if (single_tree)
+  {
+    Long64_t local_entry = events->LoadTree(entry);
+    if (local_entry < 0)
+    {
+      return false;
+    }
+    for (auto branch : header_branches)
+    {
+      if (!branch || branch->GetEntry(local_entry) <= 0)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  return LoadHeaders(entry);
+}
+
+// header of the first board from the de10_headers tree, with one tree per detector
+bool RawEventReader::LoadHeaders(Long64_t entry)
+{
+  if (!headers || headers->GetEntry(entry) <= 0)
+  {
+    return false;
+  }
+  header.trigger = header_trigger[0];
+  header.trigger_id = header_trigger_id[0];
+  header.timestamp = header_timestamp[0];
+  header.ext_timestamp = header_ext_timestamp[0];
+  return true;
+}
+
+bool RawEventReader::LoadNativeHeader(NativeEventFile *native_file, Long64_t local_entry)
+{
+  native_event_header native_header;
+  if (!native_file || !native_file->GetHeader(local_entry, native_header))
+  {
+    return false;
+  }
+  header.event = native_header.event;
+  header.trigger = native_header.trigger;
+  header.trigger_id = native_header.trigger_id;
+  header.timestamp = native_header.timestamp;
+  header.ext_timestamp = native_header.ext_timestamp;
+  return true;
+}
+
+bool RawEventReader::GetEntry(Long64_t entry, int detector)
+{
+  if (native)
+  {
+    Long64_t local_entry;
+    NativeEventFile *native_file = LocateNative(entry, local_entry);
+    const uint16_t *samples = native_file ? native_file->GetSamples(local_entry, detector) : nullptr;
+    if (!samples)
+    {
+      return false;
+    }
+    std::copy(samples, samples + channels[detector], data.at(detector).begin());
+    return true;
+  }
+
+  if (!single_tree)
+  {
+    return chains.at(detector)->GetEntry(entry) > 0;
+  }
+
+  // only the array of the detector is read
+  Long64_t local_entry = events->LoadTree(entry);
+  if (zero_suppressed)
+  {
+    if (local_entry < 0 || !zs_branches.at(detector)[0] || zs_branches[detector][0]->GetEntry(local_entry) <= 0)
+    {
+      return false;
+    }
+    zs_branches[detector][1]->GetEntry(local_entry); // empty if no channel was kept
+    zs_branches[detector][2]->GetEntry(local_entry);
+    Expand(detector, events->GetTreeNumber());
+    return true;
+  }
+  if (local_entry < 0 || !branches.at(detector) || branches[detector]->GetEntry(local_entry) <= 0)
+  {
+    return false;
+  }
+  std::copy(arrays[detector].begin(), arrays[detector].end(), data[detector].begin());
+  return true;
+}
+
+const std::vector<unsigned int> &RawEventReader::GetData(int detector) const
+{
+  if (single_tree || native)
+  {
+    return data.at(detector);
+  }
+
+  static const std::vector<unsigned int> empty;
+  return vectors.at(detector) ? *vectors[detector] : empty;
+}
+
+bool RawEventReader::ReadPedestals(TFile *f, const char *filename)
+{
+  TTree *tree = dynamic_cast<TTree *>(f->Get(zs_calibration_tree_name));
+  std::vector<int> *pedestal = nullptr;
+  if (!tree || tree->SetBranchAddress("pedestal", &pedestal) < 0)
+  {
+    std::cout << "ERROR: no pedestals of the zero suppression in " << filename << std::endl;
+    return false;
+  }
+
+  std::vector<std::vector<int>> file_pedestals;
+  for (Long64_t det = 0; det < tree->GetEntries(); det++)
+  {
+    tree->GetEntry(det);
+    file_pedestals.push_back(*pedestal);
+  }
+  tree->ResetBranchAddresses();
+  delete pedestal;
+
+  // files after the first one must have the same detectors
+  bool match = detectors == 0 || (int)file_pedestals.size() == detectors;
+  for (int det = 0; match && det < detectors; det++)
+  {
+    match = (int)file_pedestals[det].size() == channels[det];
+  }
+  if (!match)
+  {
+    std::cout << "ERROR: the detectors of " << filename << " don't match the ones of the first file" << std::endl;
+    return false;
+  }
+
+  pedestals.push_back(file_pedestals);
+  return true;
+}
+
+// Dense ADC values of a zero-suppressed detector: the pedestal where the channel was suppressed
+void RawEventReader::Expand(int detector, int tree_number)
+{
+  const std::vector<int> &pedestal = pedestals.at(tree_number)[detector];
+  std::vector<unsigned int> &values = data[detector];
+  std::copy(pedestal.begin(), pedestal.end(), values.begin());
+  int kept = std::min<int>(zs_n[detector], channels[detector]);
+  for (int i = 0; i < kept; i++)
+  {
+    int ch = zs_channel[detector][i];
+    if (ch < channels[detector])
+    {
+      values[ch] = pedestal[ch] + zs_adc[detector][i];
+    }
+  }
+}
@@ -0,0 +1,368 @@
+#include "rawFile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint64_t stream_chunk = 4 << 20;    // bytes read at once from a streamed input
+static const size_t prefetch_chunks = 4;         // chunks a streamed input is read ahead
+static const uint64_t mmap_prefetch = 64 << 20;  // bytes of a mapped file requested ahead of the last offset read
+static const uint64_t stream_history = 1 << 20;  // bytes of a streamed input kept before the last offset read
+static const int reader_poll_ms = 100;           // how often the reader thread checks if it has to stop
+
+bool RawFile::Open(const char *filename)
+{
+  Close();
+
+  // Regular files are mapped. Check with stat before opening: opening a fifo blocks
+  // until the writer shows up and we don't want to do that twice.
+  struct stat st;
+  if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    fd = open(filename, O_RDONLY);
+    if (fd >= 0)
+    {
+      void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        mapped_data = static_cast<const unsigned char *>(data);
+        size = st.st_size;
+        prefetched = 0;
+        Prefetch(0);
+        is_open = true;
+        return true;
+      }
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  // Fallback: read it as a stream
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+  window.clear();
+  window_start = 0;
+  stream_eof = false;
+  reader_eof = false;
+  is_open = true;
+  StartReader();
+  return true;
+}
+
+void RawFile::Close()
+{
+  StopReader();
+  ready.clear();
+  spare.clear();
+  chunk.clear();
+  reader_eof = false;
+
+  if (mapped_data)
+  {
+    munmap(const_cast<unsigned char *>(mapped_data), size);
+    mapped_data = nullptr;
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+  window.clear();
+  window_start = 0;
+  stream_eof = false;
+  size = 0;
+  prefetched = 0;
+  is_open = false;
+}
+
+bool RawFile::Refresh()
+{
+  if (!is_open)
+  {
+    return false;
+  }
+
+  if (!IsMapped())
+  {
+    // the reader stops at the end of the stream: start it again to read what came after
+    bool restart;
+    {
+      std::lock_guard<std::mutex> lock(reader_mutex);
+      restart = reader_eof;
+    }
+    if (restart)
+    {
+      StopReader();
+      reader_eof = false;
+      StartReader();
+    }
+    stream_eof = false;
+    return true;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    return false;
+  }
+  if ((uint64_t)st.st_size <= size)
+  {
+    return true;
+  }
+
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  munmap(const_cast<unsigned char *>(mapped_data), size);
+  mapped_data = static_cast<const unsigned char *>(data);
+  size = st.st_size;
+  return true;
+}
+
+// Asks the kernel to start loading the pages after offset, so that they are in memory by the time they are read
+// instead of being faulted in one readahead window at a time
+void RawFile::Prefetch(uint64_t offset)
+{
+  uint64_t start = prefetched.load(std::memory_order_relaxed);
+  uint64_t end = std::min(size, offset + mmap_prefetch);
+  // only one of the threads reading the file issues the request
+  if (end <= start || !prefetched.compare_exchange_strong(start, end, std::memory_order_relaxed))
+  {
+    return;
+  }
+  start = std::max(start, offset);
+  start -= start % sysconf(_SC_PAGESIZE);
+  madvise(const_cast<unsigned char *>(mapped_data) + start, end - start, MADV_WILLNEED);
+}
+
+//////////////////////////////////////////////
+// Stream mode: a reader thread keeps up to prefetch_chunks chunks read ahead of the window
+
+void RawFile::StartReader()
+{
+  reader_stop = false;
+  reader = std::thread(&RawFile::ReaderLoop, this);
+}
+
+void RawFile::StopReader()
+{
+  if (!reader.joinable())
+  {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    reader_stop = true;
+  }
+  reader_cv.notify_all();
+  reader.join();
+}
+
+void RawFile::ReaderLoop()
+{
+  std::vector<unsigned char> buffer;
+  bool eof = false;
+  while (!eof)
+  {
+    {
+      std::unique_lock<std::mutex> lock(reader_mutex);
+      reader_cv.wait(lock, [this] { return reader_stop || ready.size() < prefetch_chunks; });
+      if (reader_stop)
+      {
+        return;
+      }
+      if (!spare.empty())
+      {
+        buffer = std::move(spare.back());
+        spare.pop_back();
+      }
+    }
+
+    // a full chunk, unless the input stays quiet (e.g. a pipe the DAQ writes slowly): what is there is handed over
+    buffer.resize(stream_chunk);
+    uint64_t got = 0;
+    while (got < stream_chunk && !reader_stop)
+    {
+      pollfd input = {fd, POLLIN, 0};
+      int events = poll(&input, 1, reader_poll_ms);
+      if (events == 0 && got > 0)
+      {
+        break;
+      }
+      if (events <= 0)
+      {
+        if (events < 0 && errno != EINTR)
+        {
+          eof = true;
+          break;
+        }
+        continue;
+      }
+      ssize_t n = read(fd, buffer.data() + got, stream_chunk - got);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        eof = true;
+        break;
+      }
+      got += n;
+    }
+    buffer.resize(got);
+
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    if (got > 0)
+    {
+      ready.push_back(std::move(buffer));
+      buffer.clear();
+    }
+    reader_eof = eof;
+    reader_cv.notify_all();
+  }
+}
+
+// Takes the next chunk read ahead into chunk, waiting for it if needed. False at the end of the stream.
+// The previous chunk goes back to the reader to be filled again.
+bool RawFile::NextChunk()
+{
+  std::unique_lock<std::mutex> lock(reader_mutex);
+  reader_cv.wait(lock, [this] { return !ready.empty() || reader_eof || !reader.joinable(); });
+  if (ready.empty())
+  {
+    return false;
+  }
+  if (chunk.capacity() > 0)
+  {
+    spare.push_back(std::move(chunk));
+  }
+  chunk = std::move(ready.front());
+  ready.pop_front();
+  reader_cv.notify_all();
+  return true;
+}
+
+bool RawFile::Fill(uint64_t offset, uint64_t len)
+{
+  if (offset < window_start)
+  {
+    // going back is only possible if the stream can seek (i.e. it is not a pipe)
+    StopReader();
+    if (lseek(fd, offset, SEEK_SET) < 0)
+    {
+      // keep going from where the reader was
+      StartReader();
+      return false;
+    }
+    for (auto &item : ready)
+    {
+      spare.push_back(std::move(item));
+    }
+    ready.clear();
+    window.clear();
+    window_start = offset;
+    stream_eof = false;
+    reader_eof = false;
+    StartReader();
+  }
+
+  if (offset + len <= window_start + window.size())
+  {
+    return true;
+  }
+
+  // we need to read more: drop the part of the window that is not needed anymore. The stream_history bytes before
+  // offset are kept, so that the fragments of an event can be decoded after walking to the next one
+  uint64_t keep_from = std::max(window_start, offset > stream_history ? offset - stream_history : 0);
+  uint64_t drop = std::min<uint64_t>(keep_from - window_start, window.size());
+  window.erase(window.begin(), window.begin() + drop);
+  window_start += drop;
+
+  // nothing left in the window: skip forward to keep_from
+  while (window.empty() && window_start < keep_from && !stream_eof)
+  {
+    if (!NextChunk())
+    {
+      stream_eof = true;
+    }
+    else if (window_start + chunk.size() <= keep_from)
+    {
+      window_start += chunk.size();
+    }
+    else
+    {
+      window.assign(chunk.begin() + (keep_from - window_start), chunk.end());
+      window_start = keep_from;
+    }
+  }
+
+  while (window_start + window.size() < offset + len && !stream_eof)
+  {
+    if (!NextChunk())
+    {
+      stream_eof = true;
+    }
+    else
+    {
+      window.insert(window.end(), chunk.begin(), chunk.end());
+    }
+  }
+
+  return window_start + window.size() >= offset + len;
+}
+
+uint64_t RawFile::Available(uint64_t offset, uint64_t len)
+{
+  if (!is_open)
+  {
+    return 0;
+  }
+
+  if (IsMapped())
+  {
+    if (offset >= size)
+    {
+      return 0;
+    }
+    uint64_t requested = prefetched.load(std::memory_order_relaxed);
+    if (requested < size && offset + mmap_prefetch / 2 > requested)
+    {
+      Prefetch(offset);
+    }
+    return std::min(len, size - offset);
+  }
+
+  Fill(offset, len);
+  uint64_t window_end = window_start + window.size();
+  if (offset < window_start || offset >= window_end)
+  {
+    return 0;
+  }
+  return std::min(len, window_end - offset);
+}
+
+const unsigned char *RawFile::GetData(uint64_t offset, uint64_t len)
+{
+  if (Available(offset, len) < len)
+  {
+    return nullptr;
+  }
+
+  if (IsMapped())
+  {
+    return mapped_data + offset;
+  }
+  return window.data() + (offset - window_start);
+}
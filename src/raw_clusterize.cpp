@@ -17,6 +17,8 @@
 
 #include "anyoption.h"
 #include "event.h"
+#include "rawEventReader.h"
+#include "timeIndex.h"
 
 AnyOption *opt; // Handle the input options
 
@@ -201,47 +203,28 @@ int clusterize_detector(int board, int side, int minADC_h, int maxADC_h, int min
   nclus_event->SetName((TString) "nclus_event_board_" + board + "_side_" + side);
   nclus_event->SetTitle((TString) "nclus_event_board_" + board + "_side_" + side);
 
-  // Join ROOTfiles in a single chain
-  TChain *chain = new TChain();  // TChain for the first detector TTree (we read 2 detectors with each board on the new DAQ and 1 with the miniTRB)
-  TChain *chain2 = new TChain(); // TChain for the second detector TTree
-
-  std::string alphabet = "ABCDEFGHIJKLMNOPQRSTWXYZ";
-
-  if (board == 0) // TTree name depends on DAQ board
+  // Join ROOTfiles in a single run, whatever their layout (one tree per detector or a single tree)
+  // we read 2 detectors with each board on the new DAQ and 1 with the miniTRB
+  RawEventReader reader;
+  std::vector<std::string> filenames;
+  for (int ii = 0; ii < opt->getArgc(); ii++)
   {
-    chain->SetName("raw_events"); // simply called raw_events for retrocompatibility with old files from the prototype
-    for (int ii = 0; ii < opt->getArgc(); ii++)
+    std::cout << "\nAdding file " << opt->getArgv(ii) << " to the chain..." << std::endl;
+    if (!reader.Add(opt->getArgv(ii)))
     {
-      std::cout << "\nAdding file " << opt->getArgv(ii) << " to the chain..." << std::endl;
-      chain->Add(opt->getArgv(ii));
-    }
-    if (newDAQ)
-    {
-      chain2->SetName("raw_events_B");
-      for (int ii = 0; ii < opt->getArgc(); ii++)
-      {
-        chain2->Add(opt->getArgv(ii));
-      }
-      chain->AddFriend(chain2);
+      std::cout << "Error: can't add " << opt->getArgv(ii) << " to the run" << std::endl;
+      return 2;
     }
+    filenames.push_back(opt->getArgv(ii));
   }
-  else
+  int detector = 2 * board + side;
+  if (detector >= reader.GetDetectors())
   {
-    chain->SetName((TString) "raw_events_" + alphabet.at(2 * board));
-    for (int ii = 0; ii < opt->getArgc(); ii++)
-    {
-      std::cout << "\nAdding file " << opt->getArgv(ii) << " to the chain..." << std::endl;
-      chain->Add(opt->getArgv(ii));
-    }
-    chain2->SetName((TString) "raw_events_" + alphabet.at(2 * board + 1));
-    for (int ii = 0; ii < opt->getArgc(); ii++)
-    {
-      chain2->Add(opt->getArgv(ii));
-    }
-    chain->AddFriend(chain2);
+    std::cout << "Error: no data for board " << board << " side " << side << std::endl;
+    return 2;
   }
 
-  int entries = chain->GetEntries();
+  int entries = reader.GetEntries(detector);
 
   if (opt->getValue("nevents")) // to process only the first "nevents" events in the chain
   {
@@ -265,17 +248,39 @@ int clusterize_detector(int board, int side, int minADC_h, int maxADC_h, int min
     return 2;
   }
 
-  std::vector<unsigned int> *raw_event = 0; // buffer vector for the raw event in the TTree
-  TBranch *RAW = 0;
-
-  if(side == 0)
+  // entries to process: [first_event, entries), only the ones in the time window if there is one
+  std::vector<entry_range> ranges = {{first_event, entries}};
+  if (opt->getValue("time-window"))
   {
-    chain->SetBranchAddress("RAW Event J5", &raw_event, &RAW);
-  }
-  else
-  {
-    chain->SetBranchAddress("RAW Event J7", &raw_event, &RAW);
+    uint64_t t0, t1;
+    if (!parse_time_window(opt->getValue("time-window"), t0, t1))
+    {
+      std::cout << "Error: the time window must be t0:t1, with t0 < t1" << std::endl;
+      return 2;
+    }
+    TimeIndex time_index;
+    if (!time_index.Load(filenames, true))
+    {
+      std::cout << "Error: can't index the run by time" << std::endl;
+      return 2;
+    }
+    ranges = time_index.Find(t0, t1);
+    for (entry_range &range : ranges)
+    {
+      range.first = std::max<int64_t>(range.first, first_event);
+      range.last = std::min<int64_t>(range.last, entries);
+    }
+    int64_t window_entries = EntrySelection(ranges).GetEntries();
+    std::cout << "Time window " << t0 << ":" << t1 << " has " << window_entries << " entries" << std::endl;
+    if (window_entries == 0)
+    {
+      std::cout << "Error: no entries to process in the time window" << std::endl;
+      return 2;
+    }
   }
+  EntrySelection selection(ranges);
+
+  const std::vector<unsigned int> *raw_event = 0; // raw event of the detector
 
   std::vector<cluster> result; // Vector of resulting clusters
 
@@ -319,7 +324,7 @@ int clusterize_detector(int board, int side, int minADC_h, int maxADC_h, int min
   std::cout << "\n===========================================================" << std::endl;
   std::cout << "\nProcessing events for board " << board << " side " << side << std::endl;
 
-  std::cout << "\nProcessing " << entries << " entries, starting from event " << first_event << std::endl;
+  std::cout << "\nProcessing " << selection.GetEntries() << " entries, starting from event " << first_event << std::endl;
 
   bool BL_monster = false;
   if (atoi(opt->getValue("version")) == 2023 || atoi(opt->getValue("version")) == 2024)
@@ -333,9 +338,14 @@ int clusterize_detector(int board, int side, int minADC_h, int maxADC_h, int min
     }
   }
 
-  for (int index_event = first_event; index_event < entries; index_event++) // looping on the events
+  for (int index_event = selection.First(); index_event >= 0; index_event = selection.Next(index_event)) // looping on the events
   {
-    chain->GetEntry(index_event);
+    if (!reader.GetEntry(index_event, detector))
+    {
+      std::cout << "Error: can't read entry " << index_event << std::endl;
+      return 2;
+    }
+    raw_event = &reader.GetData(detector);
 
     if (verb)
     {
@@ -805,6 +815,7 @@ int main(int argc, char *argv[])
   opt->addUsage("  -v, --verbose    ................................. Verbose ");
   opt->addUsage("  --nevents        ................................. Number of events to process ");
   opt->addUsage("  --first          ................................. First event to process ");
+  opt->addUsage("  --time-window    ................................. Process only the events with ext_timestamp in t0:t1 ");
   opt->addUsage("  --version        ................................. 1212 for 6VA  miniTRB");
   opt->addUsage("                   ................................. 1313 for 10VA miniTRB");
   opt->addUsage("                   ................................. 2020 for FOOT DAQ");
@@ -839,6 +850,7 @@ int main(int argc, char *argv[])
   opt->setOption("version");
   opt->setOption("nevents");
   opt->setOption("first");
+  opt->setOption("time-window");
   opt->setOption("output");
   opt->setOption("calibration");
   opt->setOption("highthreshold");
@@ -1022,17 +1034,16 @@ int main(int argc, char *argv[])
   if (newDAQ)
     std::cout << "\nNEW DAQ FILE" << std::endl;
 
-  TFile tempfile(opt->getArgv(0));
-  TIter list(tempfile.GetListOfKeys());
-  TKey *key;
-  while ((key = (TKey *)list()))
+  // Count the detectors with the reader, as the files may hold a single tree or be native
   {
-    if (!strcmp(key->GetClassName(), "TTree"))
+    RawEventReader first_file;
+    if (!first_file.Add(opt->getArgv(0)))
     {
-      detectors++;
+      std::cout << "Error: can't read " << opt->getArgv(0) << std::endl;
+      return 2;
     }
+    detectors = first_file.GetDetectors();
   }
-  tempfile.Close();
   std::cout << "File with " << detectors << " detector(s)" << std::endl;
 
   //Beam Profile 2D Histos
@@ -1055,12 +1066,16 @@ int main(int argc, char *argv[])
   {
     doutput = foutput->mkdir("histos");
     doutput->cd();
-    clusterize_detector(0, 0, minADC_h, maxADC_h, minStrip, maxStrip, opt,
-                        newDAQ, first_event, NChannels, verb, dynped,
-                        invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
-                        symmetric, symmetricwidth,
-                        sensor_pitch,
-                        atoi(opt->getValue("version")) == 2023);
+    if (clusterize_detector(0, 0, minADC_h, maxADC_h, minStrip, maxStrip, opt,
+                            newDAQ, first_event, NChannels, verb, dynped,
+                            invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
+                            symmetric, symmetricwidth,
+                            sensor_pitch,
+                            atoi(opt->getValue("version")) == 2023) != 0)
+    {
+      foutput->Close();
+      return 2;
+    }
   }
   else
   {
@@ -1069,21 +1084,29 @@ int main(int argc, char *argv[])
       cout << "Creating output directory " << i << endl;
       doutput = foutput->mkdir((TString) "board_" + i + "_side_0");
       doutput->cd();
-      clusterize_detector(i, 0, minADC_h, maxADC_h, minStrip, maxStrip, opt,
-                          newDAQ, first_event, NChannels, verb, dynped,
-                          invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
-                          symmetric, symmetricwidth,
-                          sensor_pitch,
-                          atoi(opt->getValue("version")) == 2023);
+      if (clusterize_detector(i, 0, minADC_h, maxADC_h, minStrip, maxStrip, opt,
+                              newDAQ, first_event, NChannels, verb, dynped,
+                              invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
+                              symmetric, symmetricwidth,
+                              sensor_pitch,
+                              atoi(opt->getValue("version")) == 2023) != 0)
+      {
+        foutput->Close();
+        return 2;
+      }
 
       doutput = foutput->mkdir((TString) "board_" + i + "_side_1");
       doutput->cd();
-      clusterize_detector(i, 1, minADC_h, maxADC_h, minStrip, maxStrip, opt,
-                          newDAQ, first_event, NChannels, verb, dynped,
-                          invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
-                          symmetric, symmetricwidth,
-                          sensor_pitch,
-                          atoi(opt->getValue("version")) == 2023);
+      if (clusterize_detector(i, 1, minADC_h, maxADC_h, minStrip, maxStrip, opt,
+                              newDAQ, first_event, NChannels, verb, dynped,
+                              invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
+                              symmetric, symmetricwidth,
+                              sensor_pitch,
+                              atoi(opt->getValue("version")) == 2023) != 0)
+      {
+        foutput->Close();
+        return 2;
+      }
 
       // Fill 2D Beam Profile Histos
       TTreeReader j5Reader((TString)"board_" + i + "_side_0/t_clusters_board_" + i + "_side_0", foutput);
@@ -0,0 +1,319 @@
+#include "timeIndex.h"
+#include "eventIndex.h"
+#include "rawEventReader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// Layout of the sidecar, native (little endian) byte order:
+//   header (64 bytes): magic, version, reserved, file size, file mtime (s, ns), entries, reserved
+//   (time, entry) pairs sorted by time, 16 bytes each: all the entries for timestamp, then for ext_timestamp
+static const char time_index_magic[8] = {'P', 'A', 'P', 'E', 'T', 'I', 'X', '\0'};
+static const uint32_t time_index_version = 1;
+static const uint64_t time_index_header_size = 64;
+
+template <typename T>
+static void put(unsigned char *buffer, uint64_t position, T value)
+{
+  memcpy(buffer + position, &value, sizeof(T));
+}
+
+template <typename T>
+static T get(const unsigned char *buffer, uint64_t position)
+{
+  T value;
+  memcpy(&value, buffer + position, sizeof(T));
+  return value;
+}
+
+// sorted entries to ranges of consecutive entries
+static std::vector<entry_range> merge_entries(std::vector<int64_t> &selected)
+{
+  std::sort(selected.begin(), selected.end());
+  std::vector<entry_range> ranges;
+  for (int64_t entry : selected)
+  {
+    if (!ranges.empty() && ranges.back().last == entry)
+    {
+      ranges.back().last++;
+    }
+    else
+    {
+      ranges.push_back({entry, entry + 1});
+    }
+  }
+  return ranges;
+}
+
+//////////////////////////////////////////////
+// TimeIndex
+
+void TimeIndex::Add(uint64_t timestamp, uint64_t ext_timestamp)
+{
+  by_time[board_clock].emplace_back(timestamp, entries);
+  by_time[external_clock].emplace_back(ext_timestamp, entries);
+  entries++;
+  sorted = false;
+}
+
+void TimeIndex::Clear()
+{
+  entries = 0;
+  sorted = true;
+  by_time[board_clock].clear();
+  by_time[external_clock].clear();
+}
+
+void TimeIndex::Sort()
+{
+  if (sorted)
+  {
+    return;
+  }
+  // timestamps mostly grow with the entries already
+  for (auto &index : by_time)
+  {
+    if (!std::is_sorted(index.begin(), index.end()))
+    {
+      std::sort(index.begin(), index.end());
+    }
+  }
+  sorted = true;
+}
+
+bool TimeIndex::Write(const std::string &filename)
+{
+  Sort();
+
+  uint64_t size;
+  int64_t mtime_s, mtime_ns;
+  if (!raw_file_stamp(filename, size, mtime_s, mtime_ns))
+  {
+    return false;
+  }
+
+  std::string index_filename = GetIndexName(filename);
+  std::string tmp_filename = index_filename + ".tmp";
+  std::ofstream out(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out.is_open())
+  {
+    return false;
+  }
+
+  std::vector<unsigned char> buffer(time_index_header_size + 2 * 16 * entries, 0);
+  memcpy(buffer.data(), time_index_magic, 8);
+  put<uint32_t>(buffer.data(), 8, time_index_version);
+  put<uint64_t>(buffer.data(), 16, size);
+  put<int64_t>(buffer.data(), 24, mtime_s);
+  put<int64_t>(buffer.data(), 32, mtime_ns);
+  put<uint64_t>(buffer.data(), 40, entries);
+  uint64_t position = time_index_header_size;
+  for (const auto &index : by_time)
+  {
+    for (const auto &item : index)
+    {
+      put<uint64_t>(buffer.data(), position, item.first);
+      put<uint64_t>(buffer.data(), position + 8, item.second);
+      position += 16;
+    }
+  }
+  out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+  out.close();
+  if (out.fail() || rename(tmp_filename.c_str(), index_filename.c_str()) != 0)
+  {
+    remove(tmp_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool TimeIndex::Read(const std::string &filename)
+{
+  Clear();
+
+  uint64_t size;
+  int64_t mtime_s, mtime_ns;
+  RawFile file;
+  if (!raw_file_stamp(filename, size, mtime_s, mtime_ns) || !file.Open(GetIndexName(filename).c_str()))
+  {
+    return false;
+  }
+
+  const unsigned char *header = file.GetData(0, time_index_header_size);
+  if (!header || memcmp(header, time_index_magic, 8) != 0 || get<uint32_t>(header, 8) != time_index_version ||
+      get<uint64_t>(header, 16) != size || get<int64_t>(header, 24) != mtime_s || get<int64_t>(header, 32) != mtime_ns)
+  {
+    return false;
+  }
+
+  uint64_t n = get<uint64_t>(header, 40);
+  const unsigned char *data = file.GetData(time_index_header_size, 2 * 16 * n);
+  if (!data)
+  {
+    return false;
+  }
+  for (int clock = 0; clock < 2; clock++)
+  {
+    by_time[clock].resize(n);
+    for (uint64_t i = 0; i < n; i++)
+    {
+      const unsigned char *item = data + 16 * (clock * n + i);
+      by_time[clock][i] = {get<uint64_t>(item, 0), get<uint64_t>(item, 8)};
+    }
+  }
+  entries = n;
+  return true;
+}
+
+bool TimeIndex::Load(const std::vector<std::string> &filenames, bool verbose)
+{
+  Clear();
+
+  TimeIndex file_index;
+  for (const std::string &filename : filenames)
+  {
+    if (!file_index.Read(filename))
+    {
+      // build it from the headers of the events
+      RawEventReader reader;
+      if (!reader.Add(filename.c_str()))
+      {
+        return false;
+      }
+      Long64_t file_entries = reader.GetEntries();
+      for (Long64_t entry = 0; entry < file_entries; entry++)
+      {
+        if (!reader.GetHeaderEntry(entry))
+        {
+          std::cout << "ERROR: no event headers in " << filename << ", it can't be indexed by time" << std::endl;
+          return false;
+        }
+        file_index.Add(reader.GetHeader().timestamp, reader.GetHeader().ext_timestamp);
+      }
+      if (file_index.Write(filename) && verbose)
+      {
+        std::cout << "Time index saved to " << GetIndexName(filename) << std::endl;
+      }
+    }
+
+    // the entries of each file follow the ones of the previous files
+    for (int clock = 0; clock < 2; clock++)
+    {
+      for (const auto &item : file_index.by_time[clock])
+      {
+        by_time[clock].emplace_back(item.first, entries + item.second);
+      }
+    }
+    entries += file_index.entries;
+    sorted = false;
+  }
+  Sort();
+  return true;
+}
+
+std::vector<entry_range> TimeIndex::Find(uint64_t t0, uint64_t t1, time_clock clock) const
+{
+  const auto &index = by_time[clock];
+  auto begin = std::lower_bound(index.begin(), index.end(), std::make_pair(t0, (uint64_t)0));
+  auto end = std::lower_bound(begin, index.end(), std::make_pair(t1, (uint64_t)0));
+
+  std::vector<int64_t> selected;
+  selected.reserve(end - begin);
+  for (auto item = begin; item != end; ++item)
+  {
+    selected.push_back(item->second);
+  }
+  return merge_entries(selected);
+}
+
+std::vector<entry_range> TimeIndex::FindSpill(uint64_t t, uint64_t max_gap, time_clock clock) const
+{
+  const auto &index = by_time[clock];
+  auto item = std::lower_bound(index.begin(), index.end(), std::make_pair(t, (uint64_t)0));
+
+  std::vector<int64_t> selected;
+  for (auto previous = item; item != index.end() && item->first - previous->first <= max_gap; previous = item++)
+  {
+    selected.push_back(item->second);
+  }
+  return merge_entries(selected);
+}
+
+bool parse_time_window(const std::string &window, uint64_t &t0, uint64_t &t1)
+{
+  size_t colon = window.find(':');
+  if (colon == std::string::npos || colon == 0 || colon == window.size() - 1)
+  {
+    return false;
+  }
+  try
+  {
+    t0 = std::stoull(window.substr(0, colon));
+    t1 = std::stoull(window.substr(colon + 1));
+  }
+  catch (const std::exception &)
+  {
+    return false;
+  }
+  return t0 < t1;
+}
+
+int sampling_step(double fraction)
+{
+  if (!(fraction > 0 && fraction <= 1))
+  {
+    return 0;
+  }
+  return std::max(1L, std::lround(1 / fraction));
+}
+
+//////////////////////////////////////////////
+// EntrySelection
+
+int64_t EntrySelection::First() const
+{
+  current = 0;
+  while (current < ranges.size() && ranges[current].first >= ranges[current].last)
+  {
+    current++;
+  }
+  return current < ranges.size() ? ranges[current].first : -1;
+}
+
+int64_t EntrySelection::Next(int64_t entry) const
+{
+  int64_t step = every; // entries still to move forward
+  while (current < ranges.size())
+  {
+    if (entry + step < ranges[current].last)
+    {
+      return entry + step;
+    }
+    // the rest of the step goes on from the first entry of the next non-empty range
+    step -= ranges[current].last - entry;
+    current++;
+    while (current < ranges.size() && ranges[current].first >= ranges[current].last)
+    {
+      current++;
+    }
+    if (current < ranges.size())
+    {
+      entry = ranges[current].first;
+    }
+  }
+  return -1;
+}
+
+int64_t EntrySelection::GetEntries() const
+{
+  int64_t n = 0;
+  for (const entry_range &range : ranges)
+  {
+    n += std::max<int64_t>(0, range.last - range.first);
+  }
+  return (n + every - 1) / every;
+}